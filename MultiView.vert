@@ -0,0 +1,23 @@
+#version 410 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 3) in vec3 vertexBary;
+// per draw : one instance for every mesh drawn from the arena
+layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec4 edgeColor;
+layout (location = 5) in mat4 model;
+
+// output data : used by geometry shader
+out vec3 geomColor;
+out vec3 geomBary;
+out vec4 geomEdge;
+
+void main ()
+{
+    // The camera transform is applied per viewport in the geometry shader
+    geomColor = vertexColor;
+    geomBary = vertexBary;
+    geomEdge = edgeColor;
+    gl_Position = model * vec4(vertexPosition, 1);
+}
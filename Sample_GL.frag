@@ -2,13 +2,20 @@
 
 // Interpolated values from the vertex shaders
 in vec3 fragColor;
+in vec3 fragBary;
+flat in vec4 fragEdge;
 
 // output data
 out vec3 color;
 
 void main()
 {
-    // Output color = color specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
-    color = fragColor;
+    // Distance to the nearest triangle edge in pixels, from the barycentric coordinates
+    vec3 d = fragBary / fwidth(fragBary);
+    float edge = 1.0 - clamp(min(min(d.x, d.y), d.z) - 0.5, 0.0, 1.0);
+
+    // Alpha 0 draws the edges only, like GL_LINE polygon mode
+    if (fragEdge.a < 0.5 && edge < 0.5)
+        discard;
+    color = mix(fragColor, fragEdge.rgb, fragEdge.a < 0.5 ? 1.0 : edge);
 }
@@ -2,21 +2,28 @@
 
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
+layout (location = 3) in vec3 vertexBary;
+// per draw : one instance for every mesh drawn from the arena
 layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec4 edgeColor;
+layout (location = 5) in mat4 model;
 
-uniform mat4 MVP;
+uniform mat4 VP;
 
 // output data : used by fragment shader
 out vec3 fragColor;
+out vec3 fragBary;
+flat out vec4 fragEdge;
 
 void main ()
 {
     vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
 
-    // The color of each vertex will be interpolated
-    // to produce the color of each fragment
+    // Every vertex of a draw has the same color
     fragColor = vertexColor;
+    fragBary = vertexBary;
+    fragEdge = edgeColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * model * v;
 }
@@ -4,9 +4,32 @@
 #include <vector>
 #include <map>
 #include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <bitset>
+#include <unordered_map>
+#include <future>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <GL/glew.h>
 #include <GL/gl.h>
+// Before GLFW, which then declares its Vulkan surface functions
+#ifdef USE_VULKAN
+#include <vulkan/vulkan.h>
+#endif
 #include <GLFW/glfw3.h>
 
 #define GLM_FORCE_RADIANS
@@ -18,13 +41,208 @@
 #include <FTGL/ftgl.h>
 #include <GLFW/glfw3.h>
 #include <SOIL/SOIL.h>
+#include <zlib.h>
 
 using namespace std;
 
+/* GPU memory accounting, readable from any thread */
+enum GpuKind { GPU_BUFFER, GPU_VERTEX_ARRAY, GPU_TEXTURE, GPU_PROGRAM, GPU_FRAMEBUFFER, GPU_RENDERBUFFER, GPU_QUERY };
+enum GpuCategory { GPU_MESHES, GPU_STREAMING, GPU_TEXTURES, GPU_PROGRAMS, GPU_TARGETS, GPU_CATEGORIES };
+static const char* gpu_category_names[GPU_CATEGORIES] = { "meshes", "streaming", "textures", "programs", "render targets" };
+std::atomic<long long> gpu_bytes[GPU_CATEGORIES];
+std::atomic<int> gpu_objects[GPU_CATEGORIES];
+
+/* Last state handed to GL. Repeated binds and mode changes are dropped here instead of
+   reaching the driver, and every call that does go out is counted */
+#define GL_STATE_UNKNOWN 0xFFFFFFFFu
+struct GLStateCache {
+	GLuint program;
+	GLuint vertex_array;
+	GLuint array_buffer;
+	GLuint texture_2d_array;	// on texture unit 0, the only one in use
+	GLenum polygon_mode;
+	long calls;		// issued this frame
+	long filtered;		// redundant calls dropped this frame
+} gl_state = { GL_STATE_UNKNOWN, GL_STATE_UNKNOWN, GL_STATE_UNKNOWN, GL_STATE_UNKNOWN, GL_STATE_UNKNOWN, 0, 0 };
+
+/* After code that changes GL state behind the cache, like FTGL */
+void invalidateGLState ()
+{
+	gl_state.program = gl_state.vertex_array = gl_state.array_buffer = gl_state.texture_2d_array = GL_STATE_UNKNOWN;
+	gl_state.polygon_mode = GL_STATE_UNKNOWN;
+}
+
+/* Calls that are not state changes, draws and uniforms */
+inline void countGLCalls (int n=1)
+{
+	gl_state.calls += n;
+}
+
+void useProgram (GLuint id)
+{
+	if(gl_state.program == id){
+		gl_state.filtered++;
+		return;
+	}
+	glUseProgram(id);
+	gl_state.program = id;
+	gl_state.calls++;
+}
+
+void bindVertexArray (GLuint id)
+{
+	if(gl_state.vertex_array == id){
+		gl_state.filtered++;
+		return;
+	}
+	glBindVertexArray(id);
+	gl_state.vertex_array = id;
+	gl_state.calls++;
+}
+
+void bindArrayBuffer (GLuint id)
+{
+	if(gl_state.array_buffer == id){
+		gl_state.filtered++;
+		return;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, id);
+	gl_state.array_buffer = id;
+	gl_state.calls++;
+}
+
+void bindTexture2DArray (GLuint id)
+{
+	if(gl_state.texture_2d_array == id){
+		gl_state.filtered++;
+		return;
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	gl_state.texture_2d_array = id;
+	gl_state.calls++;
+}
+
+void polygonMode (GLenum mode)
+{
+	if(gl_state.polygon_mode == mode){
+		gl_state.filtered++;
+		return;
+	}
+	glPolygonMode(GL_FRONT_AND_BACK, mode);
+	gl_state.polygon_mode = mode;
+	gl_state.calls++;
+}
+
+/* Owns one GL object, deletes it and its accounted bytes when it goes away.
+   Must be released while the context is still current */
+class GpuHandle {
+public:
+	GLuint id;
+
+	GpuHandle() : id(0), kind(GPU_BUFFER), category(GPU_MESHES), bytes(0) {}
+	// Generates a new object unless an existing one is adopted
+	GpuHandle(GpuKind kind, GpuCategory category, GLuint adopt=0) : id(adopt), kind(kind), category(category), bytes(0) {
+		if(id == 0){
+			if(kind == GPU_BUFFER)
+				glGenBuffers(1, &id);
+			else if(kind == GPU_VERTEX_ARRAY)
+				glGenVertexArrays(1, &id);
+			else if(kind == GPU_TEXTURE)
+				glGenTextures(1, &id);
+			else if(kind == GPU_FRAMEBUFFER)
+				glGenFramebuffers(1, &id);
+			else if(kind == GPU_RENDERBUFFER)
+				glGenRenderbuffers(1, &id);
+			else if(kind == GPU_QUERY)
+				glGenQueries(1, &id);
+		}
+		if(id != 0)
+			gpu_objects[category]++;
+	}
+	GpuHandle(GpuHandle&& other) : id(other.id), kind(other.kind), category(other.category), bytes(other.bytes) {
+		other.id = 0;
+		other.bytes = 0;
+	}
+	GpuHandle& operator= (GpuHandle&& other) {
+		if(this != &other){
+			reset();
+			id = other.id;
+			kind = other.kind;
+			category = other.category;
+			bytes = other.bytes;
+			other.id = 0;
+			other.bytes = 0;
+		}
+		return *this;
+	}
+	GpuHandle(const GpuHandle&) = delete;
+	GpuHandle& operator= (const GpuHandle&) = delete;
+	~GpuHandle() { reset(); }
+
+	/* Record how much memory the object holds now, e.g. after glBufferData */
+	void setBytes (size_t size) {
+		gpu_bytes[category] += (long long)size - (long long)bytes;
+		bytes = size;
+	}
+	/* glBufferData on this buffer, accounted */
+	void bufferData (GLenum target, size_t size, const void* data, GLenum usage) {
+		if(target == GL_ARRAY_BUFFER)
+			bindArrayBuffer(id);
+		else{
+			glBindBuffer(target, id);
+			countGLCalls();
+		}
+		glBufferData(target, size, data, usage);
+		countGLCalls();
+		setBytes(size);
+	}
+	void reset () {
+		if(id == 0)
+			return;
+		// Deleting a bound object unbinds it
+		GLuint* bound = kind == GPU_BUFFER ? &gl_state.array_buffer : kind == GPU_VERTEX_ARRAY ? &gl_state.vertex_array
+			: kind == GPU_TEXTURE ? &gl_state.texture_2d_array : kind == GPU_PROGRAM ? &gl_state.program : NULL;
+		if(bound && *bound == id)
+			*bound = 0;
+		if(kind == GPU_BUFFER)
+			glDeleteBuffers(1, &id);
+		else if(kind == GPU_VERTEX_ARRAY)
+			glDeleteVertexArrays(1, &id);
+		else if(kind == GPU_TEXTURE)
+			glDeleteTextures(1, &id);
+		else if(kind == GPU_FRAMEBUFFER)
+			glDeleteFramebuffers(1, &id);
+		else if(kind == GPU_RENDERBUFFER)
+			glDeleteRenderbuffers(1, &id);
+		else if(kind == GPU_QUERY)
+			glDeleteQueries(1, &id);
+		else
+			glDeleteProgram(id);
+		setBytes(0);
+		gpu_objects[category]--;
+		id = 0;
+	}
+
+private:
+	GpuKind kind;
+	GpuCategory category;
+	size_t bytes;
+};
+
+void printGpuStats (ostream& out)
+{
+	long long total = 0;
+	for(int c=0;c<GPU_CATEGORIES;c++){
+		out << "GPU " << gpu_category_names[c] << ": " << gpu_objects[c] << " objects, " << gpu_bytes[c]/1024 << " KiB" << endl;
+		total += gpu_bytes[c];
+	}
+	out << "GPU total: " << total/1024 << " KiB" << endl;
+}
+
 struct VAO {
-	GLuint VertexArrayID;
-	GLuint VertexBuffer;
-	GLuint ColorBuffer;
+	GpuHandle VertexArray;
+	GpuHandle VertexBuffer;
+	GpuHandle ColorBuffer;
 
 	GLenum PrimitiveMode;
 	GLenum FillMode;
@@ -60,6 +278,7 @@ struct GLMatrices {
 	glm::mat4 model;
 	glm::mat4 view;
 	GLuint MatrixID;
+	GLuint ViewProjectionID;
 } Matrices;
 typedef struct switch_struct{
 	bool used;
@@ -72,23 +291,135 @@ typedef struct cross_struct{
 	glm::vec3 other;
 }cross_struct;
 
+#define MAX_DIM 64
+#define MAX_LEVELS 10
+
 typedef struct Level_struct{
-	int levelMatrix[10][10];
+	int dim;
+	int levelMatrix[MAX_DIM][MAX_DIM];
 	glm::vec3 cube0_pos;
 	glm::vec3 cube1_pos;
 	vector<switch_struct>switches;
 	vector<cross_struct>crosses;
 }Level_struct;
+/* Everything the renderer needs from one simulation tick */
+struct GameSnapshot {
+	int dim;
+	int board_version;
+	glm::vec3 cube_pos[2];
+	glm::vec3 cube_theta[2];
+	int choice;
+	bool split_view;
+	bool minimap;
+	glm::vec3 eye[4], target[4], up[4];	// all four views, for the split screen
+	float camera_rotation_angle_x, camera_rotation_angle_y;
+	int score, moves, timer;
+	bool paused, game_over;
+	int boardMatrix[MAX_DIM][MAX_DIM];	// only copied when board_version changes
+};
+typedef struct GameSnapshot GameSnapshot;
+
+/* Lock-free triple buffer: one writer publishes, one reader picks up the latest */
+template <typename T>
+class TripleBuffer {
+	public:
+		TripleBuffer() : middle(1), front(0), back(2) {}
+
+		T& writeBuffer() { return buffers[back]; }
+		const T& readBuffer() const { return buffers[front]; }
+
+		/* Hand the written buffer over and take the stale one back */
+		void publish() {
+			back = middle.exchange(back | DIRTY) & INDEX;
+		}
+
+		/* Swap in the newest published buffer, false if nothing new */
+		bool update() {
+			if(!(middle.load() & DIRTY))
+				return false;
+			front = middle.exchange(front) & INDEX;
+			return true;
+		}
+
+	private:
+		enum { INDEX = 3, DIRTY = 4 };
+		T buffers[3];
+		std::atomic<int> middle;
+		int front, back;
+};
+
+/* Key or character event recorded by a GLFW callback */
+enum { INPUT_KEY, INPUT_CHAR };
+struct InputEvent {
+	double time;	// inputClock() when the callback ran
+	int code;	// GLFW key or unicode codepoint
+	short type;	// INPUT_KEY or INPUT_CHAR
+	short action;	// GLFW_PRESS or GLFW_RELEASE
+};
+typedef struct InputEvent InputEvent;
+
+/* Lock-free single producer, single consumer ring, N must be a power of two */
+template <typename T, unsigned N>
+class SpscRing {
+	public:
+		SpscRing() : head(0), tail(0) {}
+
+		/* Producer side, false when the ring is full */
+		bool push(const T& item) {
+			unsigned t = tail.load(std::memory_order_relaxed);
+			if(t - head.load(std::memory_order_acquire) == N)
+				return false;
+			items[t & (N-1)] = item;
+			tail.store(t+1, std::memory_order_release);
+			return true;
+		}
+
+		/* Consumer side, oldest item or NULL when empty */
+		const T* front() const {
+			unsigned h = head.load(std::memory_order_relaxed);
+			if(h == tail.load(std::memory_order_acquire))
+				return NULL;
+			return &items[h & (N-1)];
+		}
+
+		void pop() {
+			head.store(head.load(std::memory_order_relaxed)+1, std::memory_order_release);
+		}
+
+	private:
+		T items[N];
+		std::atomic<unsigned> head, tail;
+};
+
 struct FTGLFont {
 	FTFont* font;
 	GLuint fontMatrixID;
 	GLuint fontColorID;
 } GL3Font;
 int do_rot;
-GLuint programID, fontProgramID, textureProgramID;
+GLuint programID, fontProgramID, textureProgramID, multiviewProgramID;
 double last_update_time, current_time;
 float rectangle_rotation = 0;
 
+/* Shader sources read ahead of time by the asset loader, keyed by file name */
+map<string,string> shader_sources;
+
+std::string readShaderFile(const char * file_path) {
+	map<string,string>::iterator cached = shader_sources.find(file_path);
+	if(cached != shader_sources.end())
+		return cached->second;
+
+	std::string ShaderCode;
+	std::ifstream ShaderStream(file_path, std::ios::in);
+	if(ShaderStream.is_open()){
+		std::string Line = "";
+		while(getline(ShaderStream, Line))
+			ShaderCode += "\n" + Line;
+		ShaderStream.close();
+	}
+	return ShaderCode;
+}
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
@@ -96,26 +427,9 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
 	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}
-
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
-	}
+	// Read the shader code, from the preloaded sources when available
+	std::string VertexShaderCode = readShaderFile(vertex_file_path);
+	std::string FragmentShaderCode = readShaderFile(fragment_file_path);
 
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
@@ -166,13 +480,82 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	return ProgramID;
 }
 
+/* Read and compile one shader stage, compile errors are printed to stderr */
+GLuint CompileShaderFile(GLenum type, const char * file_path) {
+	std::string ShaderCode = readShaderFile(file_path);
+
+	GLuint ShaderID = glCreateShader(type);
+	char const * SourcePointer = ShaderCode.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+	glCompileShader(ShaderID);
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if(Result == GL_FALSE && InfoLogLength > 0){
+		std::vector<char> ShaderErrorMessage(InfoLogLength);
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		fprintf(stderr, "%s: %s\n", file_path, &ShaderErrorMessage[0]);
+	}
+	return ShaderID;
+}
+
+/* Load a program with a geometry stage, returns 0 if it does not link */
+GLuint LoadShaders(const char * vertex_file_path, const char * geometry_file_path, const char * fragment_file_path) {
+	GLuint VertexShaderID = CompileShaderFile(GL_VERTEX_SHADER, vertex_file_path);
+	GLuint GeometryShaderID = CompileShaderFile(GL_GEOMETRY_SHADER, geometry_file_path);
+	GLuint FragmentShaderID = CompileShaderFile(GL_FRAGMENT_SHADER, fragment_file_path);
+
+	GLuint ProgramID = glCreateProgram();
+	glAttachShader(ProgramID, VertexShaderID);
+	glAttachShader(ProgramID, GeometryShaderID);
+	glAttachShader(ProgramID, FragmentShaderID);
+	glLinkProgram(ProgramID);
+
+	glDeleteShader(VertexShaderID);
+	glDeleteShader(GeometryShaderID);
+	glDeleteShader(FragmentShaderID);
+
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if(Result == GL_FALSE){
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+GLuint LoadComputeShader(const char * compute_file_path) {
+	GLuint ComputeShaderID = CompileShaderFile(GL_COMPUTE_SHADER, compute_file_path);
+
+	GLuint ProgramID = glCreateProgram();
+	glAttachShader(ProgramID, ComputeShaderID);
+	glLinkProgram(ProgramID);
+	glDeleteShader(ComputeShaderID);
+
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if(Result == GL_FALSE){
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
 static void error_callback(int error, const char* description)
 {
 	fprintf(stderr, "Error: %s\n", description);
 }
 
+void stopSimulation();
+/* Free every GL object before the context goes away */
+void releaseGpuResources ();
+
 void quit(GLFWwindow *window)
 {
+	stopSimulation();
+	printGpuStats(cout);
+	releaseGpuResources();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
@@ -207,23 +590,35 @@ glm::vec3 getRGBfromHue (int hue)
 		return glm::vec3(1,0,x);
 }
 
+/* Every VAO made by create3DObject, sprites only keep plain pointers into this */
+vector< unique_ptr<VAO> > gpu_vaos;
+// Shader programs, the global program ids point into this
+vector<GpuHandle> gpu_programs;
+
+GLuint adoptProgram (GLuint id)
+{
+	if(id != 0)
+		gpu_programs.push_back(GpuHandle(GPU_PROGRAM, GPU_PROGRAMS, id));
+	return id;
+}
+
 /* Generate VAO, VBOs and return VAO handle */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
 	struct VAO* vao = new struct VAO;
+	gpu_vaos.push_back(unique_ptr<VAO>(vao));
 	vao->PrimitiveMode = primitive_mode;
 	vao->NumVertices = numVertices;
 	vao->FillMode = fill_mode;
 
 	// Create Vertex Array Object
 	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	vao->VertexArray = GpuHandle(GPU_VERTEX_ARRAY, GPU_MESHES); // VAO
+	vao->VertexBuffer = GpuHandle(GPU_BUFFER, GPU_MESHES); // VBO - vertices
+	vao->ColorBuffer = GpuHandle(GPU_BUFFER, GPU_MESHES);  // VBO - colors
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+	bindVertexArray (vao->VertexArray.id); // Bind the VAO 
+	vao->VertexBuffer.bufferData(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
 	glVertexAttribPointer(
 			0,                  // attribute 0. Vertices
 			3,                  // size (x,y,z)
@@ -233,8 +628,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 			(void*)0            // array buffer offset
 			);
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+	vao->ColorBuffer.bufferData(GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
 	glVertexAttribPointer(
 			1,                  // attribute 1. Color
 			3,                  // size (r,g,b)
@@ -244,49 +638,236 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 			(void*)0            // array buffer offset
 			);
 
+	// Enabled attributes are VAO state, draw3DObject does not need to touch them
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
 	return vao;
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+	vector<GLfloat> color_buffer_data(3*numVertices);
 	for (int i=0; i<numVertices; i++) {
 		color_buffer_data [3*i] = red;
 		color_buffer_data [3*i + 1] = green;
 		color_buffer_data [3*i + 2] = blue;
 	}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	// Change the Fill Mode for this object, skipped when it is already set
+	polygonMode (vao->FillMode);
+
+	// Bind the VAO to use, it already knows its buffers and enabled attributes
+	bindVertexArray (vao->VertexArray.id);
+
+	// Draw the geometry !
+	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	countGLCalls();
+}
+
+/* Release the VBOs and the VAO created by create3DObject */
+void delete3DObject (struct VAO* vao)
+{
+	for(vector< unique_ptr<VAO> >::iterator it=gpu_vaos.begin();it<gpu_vaos.end();it++){
+		if(it->get() == vao){
+			gpu_vaos.erase(it);
+			return;
+		}
+	}
+}
+
+/* Static mesh arena - every flat colour mesh lives in one vertex and index buffer under one VAO.
+   Colour, edge colour and model matrix are per-draw instance attributes, so a frame is one
+   glMultiDrawElementsIndirect call. Edges come from barycentrics in the fragment shader */
+struct ArenaMesh {
+	GLuint firstIndex;
+	GLuint indexCount;
+	GLint baseVertex;
+};
+typedef struct ArenaMesh ArenaMesh;
+
+// Read by the vertex shader through baseInstance, attribute 1, 2 and 5-8
+struct ArenaDraw {
+	GLfloat color[3];
+	GLfloat edge[4];	// edge colour, alpha 0 leaves the inside of the triangles empty
+	GLfloat model[16];
+};
+typedef struct ArenaDraw ArenaDraw;
+
+// Layout fixed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+typedef struct DrawElementsIndirectCommand DrawElementsIndirectCommand;
+
+struct ArenaQueued {
+	ArenaMesh mesh;
+	ArenaDraw draw;
+};
+typedef struct ArenaQueued ArenaQueued;
+
+bool compareArenaMesh (const ArenaQueued& a, const ArenaQueued& b)
+{
+	return a.mesh.firstIndex < b.mesh.firstIndex;
+}
+
+#define ARENA_VERTEX_FLOATS 6	// position, barycentric
+
+struct MeshArena {
+	GpuHandle VertexArray;
+	GpuHandle VertexBuffer;
+	GpuHandle IndexBuffer;
+	GpuHandle DrawBuffer;
+	GpuHandle CommandBuffer;
+	vector<GLfloat> vertices;	// until uploadArena
+	vector<GLuint> indices;
+	vector<ArenaQueued> queued;	// this frame
+	bool indirect;			// GL 4.3 multi-draw, else one draw per mesh
+} arena;
+
+/* Append a triangle list to the arena. Every corner carries its barycentric coordinate,
+   corners equal in both position and barycentric become one indexed vertex */
+ArenaMesh arenaAddMesh (const GLfloat* vertex_buffer_data, int numVertices)
+{
+	ArenaMesh mesh;
+	mesh.firstIndex = arena.indices.size();
+	mesh.indexCount = numVertices;
+	mesh.baseVertex = arena.vertices.size()/ARENA_VERTEX_FLOATS;
+	int unique = 0;
+	for(int i=0;i<numVertices;i++){
+		GLfloat v[ARENA_VERTEX_FLOATS] = { vertex_buffer_data[3*i], vertex_buffer_data[3*i+1], vertex_buffer_data[3*i+2], 0, 0, 0 };
+		v[3 + i%3] = 1;
+		int found = 0;
+		while(found<unique && memcmp(&arena.vertices[ARENA_VERTEX_FLOATS*(mesh.baseVertex+found)], v, sizeof(v)))
+			found++;
+		if(found == unique){
+			arena.vertices.insert(arena.vertices.end(), v, v+ARENA_VERTEX_FLOATS);
+			unique++;
+		}
+		arena.indices.push_back(found);
+	}
+	return mesh;
+}
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/* Point the per-draw attributes at draw number first of the draw buffer */
+void bindArenaDraws (size_t first)
+{
+	bindArrayBuffer(arena.DrawBuffer.id);
+	size_t base = first*sizeof(ArenaDraw);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaDraw), (void*)(base + offsetof(ArenaDraw, color)));
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(ArenaDraw), (void*)(base + offsetof(ArenaDraw, edge)));
+	for(int c=0;c<4;c++)
+		glVertexAttribPointer(5+c, 4, GL_FLOAT, GL_FALSE, sizeof(ArenaDraw), (void*)(base + offsetof(ArenaDraw, model) + 4*c*sizeof(GLfloat)));
+	countGLCalls(6);
+}
 
-	// Enable Vertex Attribute 0 - 3d Vertices
+/* Move the collected meshes to the GPU, called once after every create* function */
+void uploadArena ()
+{
+	// The commands select their per-draw data through baseInstance, which needs GL 4.2 or ARB_base_instance too
+	arena.indirect = (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance);
+	arena.VertexArray = GpuHandle(GPU_VERTEX_ARRAY, GPU_MESHES);
+	arena.VertexBuffer = GpuHandle(GPU_BUFFER, GPU_MESHES);
+	arena.IndexBuffer = GpuHandle(GPU_BUFFER, GPU_MESHES);
+	arena.DrawBuffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+	arena.CommandBuffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+
+	bindVertexArray(arena.VertexArray.id);
+	arena.VertexBuffer.bufferData(GL_ARRAY_BUFFER, arena.vertices.size()*sizeof(GLfloat), &arena.vertices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, ARENA_VERTEX_FLOATS*sizeof(GLfloat), (void*)0);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, ARENA_VERTEX_FLOATS*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
 	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+	glEnableVertexAttribArray(3);
+	// The element buffer binding is part of the VAO
+	arena.IndexBuffer.bufferData(GL_ELEMENT_ARRAY_BUFFER, arena.indices.size()*sizeof(GLuint), &arena.indices[0], GL_STATIC_DRAW);
+
+	arena.DrawBuffer.bufferData(GL_ARRAY_BUFFER, sizeof(ArenaDraw), NULL, GL_STREAM_DRAW);
+	static const int per_draw[] = { 1, 2, 5, 6, 7, 8 };
+	for(int a=0;a<6;a++){
+		glEnableVertexAttribArray(per_draw[a]);
+		glVertexAttribDivisor(per_draw[a], 1);
+	}
+	bindArenaDraws(0);
 
-	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+	arena.vertices.clear();
+	arena.indices.clear();
+}
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Queue one draw of an arena mesh for this frame, filled with color or only its edges */
+void arenaDraw (const ArenaMesh& mesh, const glm::mat4& model, const glm::vec3& color, const glm::vec3& edge, bool filled)
+{
+	ArenaQueued queued;
+	queued.mesh = mesh;
+	queued.draw.color[0] = color.r;
+	queued.draw.color[1] = color.g;
+	queued.draw.color[2] = color.b;
+	queued.draw.edge[0] = edge.r;
+	queued.draw.edge[1] = edge.g;
+	queued.draw.edge[2] = edge.b;
+	queued.draw.edge[3] = filled;
+	memcpy(queued.draw.model, &model[0][0], sizeof(queued.draw.model));
+	arena.queued.push_back(queued);
+}
+
+/* Submit draws queued with arenaDraw to the bound scene program, sorted by mesh */
+void flushArena (vector<ArenaQueued>& queued)
+{
+	size_t total = queued.size();
+	if(total == 0)
+		return;
+
+	vector<ArenaDraw> draws;
+	vector<ArenaMesh> meshes;
+	stable_sort(queued.begin(), queued.end(), compareArenaMesh);
+	for(size_t i=0;i<total;i++){
+		draws.push_back(queued[i].draw);
+		meshes.push_back(queued[i].mesh);
+	}
+	bindVertexArray(arena.VertexArray.id);
+	arena.DrawBuffer.bufferData(GL_ARRAY_BUFFER, total*sizeof(ArenaDraw), &draws[0], GL_STREAM_DRAW);
+	polygonMode(GL_FILL);
+
+	if(arena.indirect){
+		// Instance i of the whole frame reads per-draw data i through baseInstance
+		vector<DrawElementsIndirectCommand> commands(total);
+		for(size_t i=0;i<total;i++){
+			commands[i].count = meshes[i].indexCount;
+			commands[i].instanceCount = 1;
+			commands[i].firstIndex = meshes[i].firstIndex;
+			commands[i].baseVertex = meshes[i].baseVertex;
+			commands[i].baseInstance = i;
+		}
+		bindArenaDraws(0);
+		arena.CommandBuffer.bufferData(GL_DRAW_INDIRECT_BUFFER, total*sizeof(DrawElementsIndirectCommand), &commands[0], GL_STREAM_DRAW);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, total, 0);
+		countGLCalls();
+	}
+	else{
+		// No baseInstance before GL 4.2, move the per-draw attributes instead
+		for(size_t i=0;i<total;i++){
+			bindArenaDraws(i);
+			glDrawElementsBaseVertex(GL_TRIANGLES, meshes[i].indexCount, GL_UNSIGNED_INT, (void*)(meshes[i].firstIndex*sizeof(GLuint)), meshes[i].baseVertex);
+			countGLCalls();
+		}
+	}
 }
 
 /**************************
  * Customizable functions *
  **************************/
 void changeview();
+void computeView(int view, glm::vec3& eye, glm::vec3& target, glm::vec3& up);
 int choice,choices;
 int a1,a2,a3,a4;
 
@@ -300,7 +881,7 @@ Sprite cube[2];
 Sprite camera;
 vector<Level_struct>levels;
 int score=0;
-int timer[10];
+int timer[MAX_LEVELS+1];	// one past the last level, written when the game is won
 int current_level;
 int dom;
 int rec;
@@ -312,15 +893,132 @@ float rectangle_rot_dir = 1;
 bool rectangle_rot_status = true;
 int dim=10;
 bool paused;
-int boardMatrix[10][10];
+int (*boardMatrix)[MAX_DIM];	// board of the active PreparedLevel
+int board_version;
 int falling =0;
 float camera_rotation_angle_x = 90;
 float camera_rotation_angle_y = 90;
-int moves[10]={0};
+int moves[MAX_LEVELS+1]={0};
 bool right_move;
 bool game_over;
-map <string, bool> buttons;
+std::bitset<GLFW_KEY_LAST+1> keys_down;	// held keys, kept by handleKey on the simulation thread
+
+// Moves pressed while the block is still toppling, replayed once it settles
+#define MOVE_QUEUE_SIZE 4
+int move_queue[MOVE_QUEUE_SIZE];
+int move_queue_head, move_queue_count;
+int topple_speedup = 2;	// topple steps per tick while moves are waiting
+bool sound_enabled = true;	// offline exports run without the click of every move
+
+/* Fire and forget, aplay runs in the background */
+void playSound (const char* name)
+{
+	if(!sound_enabled)
+		return;
+	string command = string("aplay -q ./sounds/") + name + " &";
+	system(command.c_str());
+}
+
+// Rules are evaluated when the block settles instead of every tick
+bool rules_pending;
+unordered_map<int,vector<int> > switch_cells;	// cell key -> indices in levels[current_level].switches, all fire
+unordered_map<int,int> cross_cells;	// cell key -> index of the first cross there in levels[current_level].crosses
+
+/* Hash key of the board cell under a position, -1 when off the board */
+int cellKey(const glm::vec3& pos, int board_dim){
+	int x = (int)pos.x, y = (int)pos.y;
+	if(x<0 || y<0 || x>=board_dim || y>=board_dim || x!=pos.x || y!=pos.y)
+		return -1;
+	return x*MAX_DIM + y;
+}
+int cellKey(const glm::vec3& pos){
+	return cellKey(pos, dim);
+}
+
+/* A level ready to play, built on a worker thread while the block falls into the goal */
+struct PreparedLevel {
+	int level;		// index in levels, -1 while empty
+	int dim;
+	int board[MAX_DIM][MAX_DIM];
+	unordered_map<int,vector<int> > switch_cells;
+	unordered_map<int,int> cross_cells;
+	PreparedLevel() : level(-1), dim(0) {}
+};
+PreparedLevel prepared_levels[2];
+PreparedLevel* active_level = &prepared_levels[0];
+PreparedLevel* next_level = &prepared_levels[1];
+std::future<void> level_preload;
+bool level_preloading = true;	// off when several games take turns in the globals prepareLevel reads
+
+/* Only reads levels[level], so it may run next to the simulation */
+void prepareLevel(PreparedLevel* prepared, int level){
+	Level_struct& source = levels[level];
+	prepared->dim = source.dim;
+	for(int i=0;i<source.dim;i++)
+		memcpy(prepared->board[i], source.levelMatrix[i], source.dim*sizeof(int));
+	prepared->switch_cells.clear();
+	prepared->cross_cells.clear();
+	for(vector<switch_struct>::iterator it=source.switches.begin();it<source.switches.end();it++)
+	{
+		prepared->board[(int)it->place.x][(int)it->place.y]=8;
+		prepared->switch_cells[cellKey(it->place, source.dim)].push_back(it - source.switches.begin());
+	}
+	for(vector<cross_struct>::iterator it=source.crosses.begin();it<source.crosses.end();it++)
+	{
+		prepared->board[(int)it->place.x][(int)it->place.y]=7;
+		prepared->cross_cells.insert(std::make_pair(cellKey(it->place, source.dim), (int)(it - source.crosses.begin())));
+	}
+	prepared->level = level;
+}
+
+void startLevelPreload(int level){
+	if(!level_preloading || level >= (int)levels.size())
+		return;
+	next_level->level = -1;
+	level_preload = std::async(std::launch::async, prepareLevel, next_level, level);
+}
 glm::vec3 eye_vec, target_vec, up_vec;
+bool split_view;
+bool minimap = true;	// 'n', top-down board in the corner of the Tower and Follow-cam views
+bool multiview_supported;
+
+// Simulation runs on its own thread, the render thread only sees snapshots
+#define SIM_TICK 1.0/60.0
+TripleBuffer<GameSnapshot> snapshots;
+SpscRing<InputEvent, 256> input_queue;
+
+// The simulation sleeps on this while the board is idle, input wakes it up
+std::mutex sim_wait_mutex;
+std::condition_variable sim_wakeup;
+
+// Headless runs have no event queue, the render thread sleeps on this instead
+std::mutex render_wait_mutex;
+std::condition_variable render_wakeup;
+bool render_pending;
+std::atomic<bool> close_requested;
+bool headless;		// --headless, null backend and no window
+bool hidden_window;	// the context is only used offscreen, nothing is shown
+int bench_frames;	// --frames, draw that many frames back to back and report, 0 runs until the game closes
+bool use_vulkan;	// --vulkan, draw through the Vulkan backend
+
+/* Render-on-demand policy, a frame is drawn only for a new snapshot or a window event */
+struct FrameScheduler {
+	int swap_interval;	// passed to glfwSwapInterval, 0 disables vsync
+	double max_fps;		// 0 for no cap beyond vsync
+	double last_frame;
+	bool dirty;		// window resized or exposed
+} frame = { 1, 0, 0, true };
+int render_width, render_height;	// size the scene is drawn at this frame
+
+/* --gl-stats, GL calls per frame averaged over a second */
+struct GLStats {
+	bool enabled;
+	int frames;
+	long calls, filtered;
+	double since;
+} gl_stats;
+std::atomic<bool> sim_running;
+std::thread sim_thread;
 
 void updateScore(){
 	score+=(int)(1000000/(moves[current_level]*timer[current_level]));
@@ -338,7 +1036,7 @@ changeview();
 		timer[current_level]=0;
 		right_move=false;
 	}
-	if(current_level>2){
+	if(current_level>=(int)levels.size()){
 			game_over=true;
 			return;
 		}
@@ -346,23 +1044,26 @@ changeview();
 	dom=0;
 	cube[dom].pos = levels[current_level].cube0_pos;
 	cube[1-dom].pos = levels[current_level].cube1_pos;
-	for(int i=0;i<dim;i++){
-		for(int j=0;j<dim;j++){
-			boardMatrix[i][j] = levels[current_level].levelMatrix[i][j];
-		}
-	}
 	for(vector<switch_struct>::iterator it=levels[current_level].switches.begin();it<levels[current_level].switches.end();it++)
-	{
 		it->used=false;
-		boardMatrix[(int)it->place.x][(int)it->place.y]=8;
-	}
-	for(vector<cross_struct>::iterator it=levels[current_level].crosses.begin();it<levels[current_level].crosses.end();it++)
-	{
-		boardMatrix[(int)it->place.x][(int)it->place.y]=7;
-	}
+
+	// The next level is normally preloaded during the fall, restarts prepare it here
+	if(level_preload.valid())
+		level_preload.get();
+	if(next_level->level != current_level)
+		prepareLevel(next_level, current_level);
+	std::swap(active_level, next_level);
+	next_level->level = -1;
+	dim = active_level->dim;
+	boardMatrix = active_level->board;
+	switch_cells.swap(active_level->switch_cells);
+	cross_cells.swap(active_level->cross_cells);
+	board_version++;
 	merged=1;
 	toppling=0;
 	falling=0;
+	move_queue_head=move_queue_count=0;
+	rules_pending=true;
 	timer[current_level]=1;
 	cube[0].theta.x=cube[0].ori.x=-45;
 	cube[0].theta.y=cube[0].ori.y=-45;
@@ -764,7 +1465,7 @@ void CubeActivateTopple(int dir){
 	if(toppling !=0)
 		return;
 	moves[current_level]++;
-	system("aplay -q ./sounds/button.wav &");
+	playSound("button.wav");
 
 	if(dir==1){
 		if(merged==1){
@@ -883,41 +1584,46 @@ void CubeActivateTopple(int dir){
 		}
 	}
 }
-/* Executed for character input (like in text boxes) */
+/* Start a move now, or buffer it until the running topple finishes and the rules have run */
+void queueMove(int dir){
+	if(toppling == 0 && !rules_pending){
+		CubeActivateTopple(dir);
+		return;
+	}
+	if(move_queue_count == MOVE_QUEUE_SIZE)
+		return;
+	move_queue[(move_queue_head + move_queue_count) % MOVE_QUEUE_SIZE] = dir;
+	move_queue_count++;
+}
 
-/* Executed when a mouse button is pressed/released */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
-{
-	// Function is called first on GLFW_PRESS.
+int popMove(){
+	int dir = move_queue[move_queue_head];
+	move_queue_head = (move_queue_head + 1) % MOVE_QUEUE_SIZE;
+	move_queue_count--;
+	return dir;
+}
+
+/* Direction of a held arrow key, 0 when none is held */
+int heldMove(){
+	if(keys_down[GLFW_KEY_UP])
+		return 1;
+	if(keys_down[GLFW_KEY_DOWN])
+		return 2;
+	if(keys_down[GLFW_KEY_LEFT])
+		return 3;
+	if(keys_down[GLFW_KEY_RIGHT])
+		return 4;
+	return 0;
+}
 
+/* Apply one key event on the simulation thread */
+void handleKey (int key, int action)
+{
 	if (action == GLFW_RELEASE) {
 				changeview();
 
+		keys_down.reset(key);
 		switch (key) {
-			case GLFW_KEY_LEFT:
-				buttons["LEFT"]=false;
-				break;
-			case GLFW_KEY_RIGHT:
-				buttons["RIGHT"]=false;
-				break;
-			case GLFW_KEY_UP:
-				buttons["UP"]=false;
-				break;
-			case GLFW_KEY_DOWN:
-				buttons["DOWN"]=false;
-				break;
-			case GLFW_KEY_W:
-				buttons["W"]=false;
-				break;
-			case GLFW_KEY_S:
-				buttons["S"]=false;
-				break;
-			case GLFW_KEY_A:
-				buttons["A"]=false;
-				break;
-			case GLFW_KEY_D:
-				buttons["D"]=false;
-				break;
 			case GLFW_KEY_SPACE:
 				chosen = 1-chosen;
 				// do something ..
@@ -927,46 +1633,19 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 		}
 	}
 	else if (action == GLFW_PRESS) {
+		keys_down.set(key);
 		switch (key) {
-			case GLFW_KEY_ESCAPE:
-				quit(window);
-				break;
-				if(buttons["LEFT"])
-	// 		CubeActivateTopple(3);
-	// if(buttons["RIGHT"])
-	// 		CubeActivateTopple(4);
-	// if(buttons["UP"])
-	// 		CubeActivateTopple(1);
-	// if(buttons["DOWN"])
-	// 		CubeActivateTopple(2);
 			case GLFW_KEY_LEFT:
-			CubeActivateTopple(3);
-
-				// buttons["LEFT"]=true;
+			queueMove(3);
 				break;
 			case GLFW_KEY_RIGHT:
-			CubeActivateTopple(4);
-				// buttons["RIGHT"]=true;
+			queueMove(4);
 				break;
 			case GLFW_KEY_UP:
-			CubeActivateTopple(1);
-				// buttons["UP"]=true;
+			queueMove(1);
 				break;
 			case GLFW_KEY_DOWN:
-			CubeActivateTopple(2);
-				// buttons["DOWN"]=true;
-				break;
-			case GLFW_KEY_W:
-				buttons["W"]=true;
-				break;
-			case GLFW_KEY_S:
-				buttons["S"]=true;
-				break;
-			case GLFW_KEY_A:
-				buttons["A"]=true;
-				break;
-			case GLFW_KEY_D:
-				buttons["D"]=true;
+			queueMove(2);
 				break;
 			default:
 				break;
@@ -974,14 +1653,10 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	}
 }
 
-void keyboardChar (GLFWwindow* window, unsigned int key)
+/* Apply one character event on the simulation thread */
+void handleChar (unsigned int key)
 {
 	switch (key) {
-		case 'Q':
-		case 'q':
-			quit(window);
-			break;
-		
 		case 'w':
 			camera_rotation_angle_y-=10;
 
@@ -1018,6 +1693,12 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 		case 'p':
 			paused=!paused;
 			break;
+		case 'm':
+			split_view=!split_view;
+			break;
+		case 'n':
+			minimap=!minimap;
+			break;
 		case 'v':
 			choice=(choice+1)%4;
 			changeview();
@@ -1035,31 +1716,102 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 	}
 }
 
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* Seconds on the clock shared by input timestamps and simulation ticks */
+double inputClock ()
 {
-	switch (button) {
-		case GLFW_MOUSE_BUTTON_RIGHT:
-			if (action == GLFW_RELEASE) {
-				rectangle_rot_dir *= -1;
-			}
-			break;
-		default:
-			break;
-	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+void pushInput (int type, int code, int action)
 {
-	int fbwidth=width, fbheight=height;
-	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+	InputEvent ev;
+	ev.time = inputClock();
+	ev.code = code;
+	ev.type = type;
+	ev.action = action;
+	// A full ring means the simulation is stalled, dropping is better than blocking the callback
+	if(!input_queue.push(ev))
+		cerr << "Input queue full, event dropped" << endl;
+}
 
-	GLfloat fov = M_PI/2;
+/* Apply every event queued before this tick started */
+void processInput (double tick_time)
+{
+	const InputEvent* ev;
+	while((ev = input_queue.front()) != NULL && ev->time <= tick_time){
+		if(ev->type == INPUT_KEY)
+			handleKey(ev->code, ev->action);
+		else
+			handleChar(ev->code);
+		input_queue.pop();
+	}
+}
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+void wakeSimulation ()
+{
+	// Taking the lock makes sure the wakeup cannot slip in before the simulation waits
+	{
+		std::lock_guard<std::mutex> lock(sim_wait_mutex);
+	}
+	sim_wakeup.notify_one();
+}
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Only quitting is handled here, the rest is queued for the simulation thread */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+		quit(window);
+	if (key < 0 || key > GLFW_KEY_LAST || action == GLFW_REPEAT)
+		return;
+	pushInput(INPUT_KEY, key, action);
+	wakeSimulation();
+}
+
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	if (key == 'Q' || key == 'q')
+		quit(window);
+	pushInput(INPUT_CHAR, key, GLFW_PRESS);
+	wakeSimulation();
+}
+
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+	switch (button) {
+		case GLFW_MOUSE_BUTTON_RIGHT:
+			if (action == GLFW_RELEASE) {
+				rectangle_rot_dir *= -1;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* Executed when the window contents are damaged and must be redrawn */
+void refreshWindow (GLFWwindow*)
+{
+	frame.dirty = true;
+}
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+	frame.dirty = true;
+
+	int fbwidth=width, fbheight=height;
+	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+
+	GLfloat fov = M_PI/2;
+
+	// sets the viewport of openGL renderer
+	if(!use_vulkan)
+		glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
 
 	// Store the projection matrix in a variable for future use
 	// Perspective projection for 3D views
@@ -1069,11 +1821,57 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	//Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 }
 
-VAO *rectangle, *cam, *floor_vao, *rectangle_grey, *rectangle_orange, *rectangle_grey_line;
-
-// Creates the rectangle object used in this sample code
+ArenaMesh cube_mesh, cam_mesh, floor_mesh;
+glm::vec3 line_color;
+
+// GL3 accepts only Triangles. Quads are not supported
+// Unit cube shared by the blocks and the tiles, the software renderer draws it too
+static const GLfloat cube_vertex_buffer_data[] = {
+	-1.0f,-1.0f,-1.0f, // triangle 1 : begin
+	-1.0f,-1.0f, 1.0f,
+	-1.0f, 1.0f, 1.0f, // triangle 1 : end
+	1.0f, 1.0f,-1.0f, // triangle 2 : begin
+	-1.0f,-1.0f,-1.0f,
+	-1.0f, 1.0f,-1.0f, // triangle 2 : end
+	1.0f,-1.0f, 1.0f,
+	-1.0f,-1.0f,-1.0f,
+	1.0f,-1.0f,-1.0f,
+	1.0f, 1.0f,-1.0f,
+	1.0f,-1.0f,-1.0f,
+	-1.0f,-1.0f,-1.0f,
+	-1.0f,-1.0f,-1.0f,
+	-1.0f, 1.0f, 1.0f,
+	-1.0f, 1.0f,-1.0f,
+	1.0f,-1.0f, 1.0f,
+	-1.0f,-1.0f, 1.0f,
+	-1.0f,-1.0f,-1.0f,
+	-1.0f, 1.0f, 1.0f,
+	-1.0f,-1.0f, 1.0f,
+	1.0f,-1.0f, 1.0f,
+	1.0f, 1.0f, 1.0f,
+	1.0f,-1.0f,-1.0f,
+	1.0f, 1.0f,-1.0f,
+	1.0f,-1.0f,-1.0f,
+	1.0f, 1.0f, 1.0f,
+	1.0f,-1.0f, 1.0f,
+	1.0f, 1.0f, 1.0f,
+	1.0f, 1.0f,-1.0f,
+	-1.0f, 1.0f,-1.0f,
+	1.0f, 1.0f, 1.0f,
+	-1.0f, 1.0f,-1.0f,
+	-1.0f, 1.0f, 1.0f,
+	1.0f, 1.0f, 1.0f,
+	-1.0f, 1.0f, 1.0f,
+	1.0f,-1.0f, 1.0f
+};
+static const GLfloat cam_vertex_buffer_data [] = {
+	-0.1, 0, 0,
+	0.1, 0, 0, 
+	0, 0.1, 0,
+};
 
-void createRectangle ()
+/* Sizes, start positions and colours of the shapes, no GL needed */
+void initShapes ()
 {
 	floor_grey.pos = floor_orange.pos = glm::vec3(0,0,0);
 	floor_grey.scale = floor_orange.scale = glm::vec3(0.5,0.5,0.1);
@@ -1086,366 +1884,25 @@ void createRectangle ()
 	cube[1].pos = cube[1].pos = glm::vec3(1,0,floor_grey.scale.z+cube[1].scale.z);
 	cube[1].speed =	 10;
 
-	// GL3 accepts only Triangles. Quads are not supported
-	static const GLfloat vertex_buffer_data[] = {
-		-1.0f,-1.0f,-1.0f, // triangle 1 : begin
-		-1.0f,-1.0f, 1.0f,
-		-1.0f, 1.0f, 1.0f, // triangle 1 : end
-		1.0f, 1.0f,-1.0f, // triangle 2 : begin
-		-1.0f,-1.0f,-1.0f,
-		-1.0f, 1.0f,-1.0f, // triangle 2 : end
-		1.0f,-1.0f, 1.0f,
-		-1.0f,-1.0f,-1.0f,
-		1.0f,-1.0f,-1.0f,
-		1.0f, 1.0f,-1.0f,
-		1.0f,-1.0f,-1.0f,
-		-1.0f,-1.0f,-1.0f,
-		-1.0f,-1.0f,-1.0f,
-		-1.0f, 1.0f, 1.0f,
-		-1.0f, 1.0f,-1.0f,
-		1.0f,-1.0f, 1.0f,
-		-1.0f,-1.0f, 1.0f,
-		-1.0f,-1.0f,-1.0f,
-		-1.0f, 1.0f, 1.0f,
-		-1.0f,-1.0f, 1.0f,
-		1.0f,-1.0f, 1.0f,
-		1.0f, 1.0f, 1.0f,
-		1.0f,-1.0f,-1.0f,
-		1.0f, 1.0f,-1.0f,
-		1.0f,-1.0f,-1.0f,
-		1.0f, 1.0f, 1.0f,
-		1.0f,-1.0f, 1.0f,
-		1.0f, 1.0f, 1.0f,
-		1.0f, 1.0f,-1.0f,
-		-1.0f, 1.0f,-1.0f,
-		1.0f, 1.0f, 1.0f,
-		-1.0f, 1.0f,-1.0f,
-		-1.0f, 1.0f, 1.0f,
-		1.0f, 1.0f, 1.0f,
-		-1.0f, 1.0f, 1.0f,
-		1.0f,-1.0f, 1.0f
-	};
-	float grey=(float)112/255;
 	float line=(float)50/255;
-	float b=(float)112/255;
-	COLOR orange,green, red;
-	orange.r=1;
-	orange.g=162.0f/255.0f;
-	orange.b=0;
-	green.r = (float)144/255;
-	green.g = (float)238 /255;
-	green.b = (float)144/255;
-	red.r = (float)1;
-	red.g = (float)0 /255;
-	red.b = (float)0/255;
-	static const GLfloat color_buffer_data_grey[] = {
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey,
-		grey,  grey,  grey
-	};
-	static const GLfloat color_buffer_data_green[] = {
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b,
-		green.r,  green.g,  green.b
-	};
-	static const GLfloat color_buffer_data_red[] = {
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b,
-		red.r,  red.g,  red.b
-	};
-	float black=(float)0/255;
-	static const GLfloat color_buffer_data_black[] = {
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black,
-		black,  black,  black
-	};
-	static const GLfloat color_buffer_data_orange[] = {
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b,
-		orange.r,  orange.g,  orange.b
-	};
+	line_color = glm::vec3(line, line, line);
 	cube[1].color.r = cube[0].color.r=1;
 	cube[1].color.g = cube[0].color.g=162.0f/255.0f;
 	cube[1].color.b = cube[0].color.b=200.0f/255.0f;
-	static const GLfloat color_buffer_data_cube1[] = {
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b,
-		cube[0].color.r,  cube[0].color.g,  cube[0].color.b
-	};
-	static const GLfloat color_buffer_data_line[] = {
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line,
-		line,  line,  line
-	};
-
-
-	// create3DObject creates and returns a handle to a VAO that can be used later
-	floor_grey.object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_grey, GL_FILL);
-
-	floor_black.object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_black, GL_FILL);
-
-	floor_red.object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_red, GL_FILL);
-
-	floor_green.object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_green, GL_FILL);
-
-	floor_black.line = floor_grey.line = floor_orange.line = cube[1].line =cube[0].line = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_line, GL_LINE);
-
-	floor_orange.object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_orange, GL_FILL);
-
-	cube[0].object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_cube1, GL_FILL);
-
-	cube[1].object = create3DObject(GL_TRIANGLES, 13*3, vertex_buffer_data, color_buffer_data_cube1, GL_FILL);
+}
 
+// Creates the rectangle object used in this sample code
+void createRectangle ()
+{
+	initShapes();
 
+	// One cube in the mesh arena serves both blocks, fill and edges in one draw
+	cube_mesh = arenaAddMesh(cube_vertex_buffer_data, 12*3);
 }
 void createCam ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
-	static const GLfloat vertex_buffer_data [] = {
-		-0.1, 0, 0,
-		0.1, 0, 0, 
-		0, 0.1, 0,
-	};
-
-	static const GLfloat color_buffer_data [] = {
-		1, 1, 1,
-		1, 1, 1,
-		1, 1, 1,
-	};
-
-	// create3DObject creates and returns a handle to a VAO that can be used later
-	cam = create3DObject(GL_TRIANGLES, 1*3, vertex_buffer_data, color_buffer_data, GL_LINE);
+	// Drawn as white edges only
+	cam_mesh = arenaAddMesh(cam_vertex_buffer_data, 1*3);
 }
 void createFloor ()
 {
@@ -1459,228 +1916,3325 @@ void createFloor ()
 		2, -1, -2,
 	};
 
-	static const GLfloat color_buffer_data [] = {
-		0.65, 0.165, 0.165,
-		0.65, 0.165, 0.165,
-		0.65, 0.165, 0.165,
-		0.65, 0.165, 0.165,
-		0.65, 0.165, 0.165,
-		0.65, 0.165, 0.165,
-	};
-
-	// create3DObject creates and returns a handle to a VAO that can be used later
-	floor_vao = create3DObject(GL_TRIANGLES, 2*3, vertex_buffer_data, color_buffer_data, GL_FILL);
+	floor_mesh = arenaAddMesh(vertex_buffer_data, 2*3);
 }
 
+/* Board chunks - tiles grouped in CHUNK_SIZE x CHUNK_SIZE blocks for culling, LOD and meshing */
+#define CHUNK_SIZE 8
+#define MAX_CHUNKS (((MAX_DIM + CHUNK_SIZE - 1)/CHUNK_SIZE)*((MAX_DIM + CHUNK_SIZE - 1)/CHUNK_SIZE))
+// Every tile a separate cube, the most a chunk's mesh can take
+#define CHUNK_VERTICES (CHUNK_SIZE*CHUNK_SIZE*36)
+
+struct Chunk {
+	int x0, y0, x1, y1;	// tile range [x0,x1) x [y0,y1)
+	glm::vec3 min, max;	// bounding box of the non-empty tiles
+	int tiles;		// number of non-empty tiles
+	int first;		// start of the chunk's region in the board vertex buffer
+	int count, top_count;	// vertices of the mesh, the top faces come first
+};
+typedef struct Chunk Chunk;
 
+/* Board mesh vertex, the texture repeats once per tile across a merged face */
+struct BoardVertex {
+	GLfloat position[3];
+	GLfloat texCoord[3];	// tile units along the face, atlas layer
+};
+typedef struct BoardVertex BoardVertex;
 
+/* Ranges of the board vertex buffer to draw, laid out for glMultiDrawArrays */
+struct ChunkDraws {
+	vector<GLint> first;
+	vector<GLsizei> count;
+};
+typedef struct ChunkDraws ChunkDraws;
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw (GLFWwindow* window, float x, float y, float w, float h, int doM, int doV, int doP)
+struct Frustum {
+	glm::vec4 planes[6];
+};
+typedef struct Frustum Frustum;
+
+vector<Chunk> chunks;
+int chunks_version = -1;
+float lod_distance = 25.0f;
+int meshed_board[MAX_DIM][MAX_DIM];	// board the uploaded chunk meshes were built from
+int meshed_dim = -1;
+
+glm::vec3 getTileColor (int type)
 {
-	int fbwidth, fbheight;
-	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
-	glViewport((int)(x*fbwidth), (int)(y*fbheight), (int)(w*fbwidth), (int)(h*fbheight));
+	if(type==2)
+		return glm::vec3(1, 162.0f/255.0f, 0);
+	if(type==8)
+		return glm::vec3(144.0f/255.0f, 238.0f/255.0f, 144.0f/255.0f);
+	if(type==7)
+		return glm::vec3(1, 0, 0);
+	if(type==9)
+		return glm::vec3(0, 0, 0);
+	return glm::vec3(112.0f/255.0f, 112.0f/255.0f, 112.0f/255.0f);
+}
 
+/* Extract the clipping planes from a view-projection matrix (Gribb/Hartmann) */
+Frustum extractFrustum (const glm::mat4& VP)
+{
+	Frustum f;
+	glm::vec4 row[4];
+	for(int i=0;i<4;i++)
+		row[i] = glm::vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+	f.planes[0] = row[3] + row[0];	// left
+	f.planes[1] = row[3] - row[0];	// right
+	f.planes[2] = row[3] + row[1];	// bottom
+	f.planes[3] = row[3] - row[1];	// top
+	f.planes[4] = row[3] + row[2];	// near
+	f.planes[5] = row[3] - row[2];	// far
+	return f;
+}
 
-	// use the loaded shader program
-	// Don't change unless you know what you are doing
-	glUseProgram(programID);
+/* An AABB is outside if its corner furthest along a plane normal is behind the plane */
+bool boxInFrustum (const Frustum& f, const glm::vec3& lo, const glm::vec3& hi)
+{
+	for(int i=0;i<6;i++){
+		const glm::vec4& p = f.planes[i];
+		glm::vec3 far_corner(p.x>=0 ? hi.x : lo.x, p.y>=0 ? hi.y : lo.y, p.z>=0 ? hi.z : lo.z);
+		if(p.x*far_corner.x + p.y*far_corner.y + p.z*far_corner.z + p.w < 0)
+			return false;
+	}
+	return true;
+}
 
-	glm::vec3 eye (eye_vec.x,eye_vec.y,eye_vec.z );
-	// Target - Where is the camera looking at.  Don't change unless you are sure!!
-	glm::vec3 target (target_vec.x, target_vec.y, target_vec.z);
-	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-	glm::vec3 up (up_vec.x, up_vec.y, up_vec.z);
+float distanceToBox (const glm::vec3& point, const glm::vec3& lo, const glm::vec3& hi)
+{
+	glm::vec3 closest = glm::min(glm::max(point, lo), hi);
+	return glm::distance(point, closest);
+}
 
-	// Compute Camera matrix (view)
-	if(doV)
-		Matrices.view = glm::lookAt(eye, target, up); // Fixed camera for 2D (ortho) in XY plane
-	else
-		Matrices.view = glm::mat4(1.0f);
 
-	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-	glm::mat4 VP;
-	if (doP)
-		VP = Matrices.projection * Matrices.view;
-	else
-		VP = Matrices.view;
-	glm::mat4 MVP;	// MVP = Projection * View * Model
+/* Tile materials - every tile type is one layer of a mipmapped texture array atlas */
+#define ATLAS_FILE "tiles.atlas"
+#define ATLAS_TILE_SIZE 64
+#define ATLAS_LAYERS 5
+#define ATLAS_MAX_SIZE 4096	// largest tile a loaded atlas may claim
 
-	// Send our transformation to the currently bound shader, in the "MVP" uniform
-	// For each model you render, since the MVP will be different (at least the M part)
-	for(int i=0;i<dim;i++){
-		for(int j=0;j<dim;j++){
+struct AtlasImage {
+	int size, layers, levels;
+	vector<size_t> offsets;		// start of each mip level in bytes, all layers of a level are contiguous
+	vector<unsigned char> pixels;	// RGBA8
+};
+typedef struct AtlasImage AtlasImage;
 
+/* Greedy board mesh, one fixed region of CHUNK_VERTICES per chunk */
+struct BoardMesh {
+	GpuHandle VertexArray;
+	GpuHandle VertexBuffer;
+};
+typedef struct BoardMesh BoardMesh;
 
-			// Load identity to model matrix
-			Matrices.model = glm::mat4(1.0f);
+struct TileProgram {
+	GLuint id;
+	GLuint VP, worldSpace, lineColor, texSampler;
+};
+typedef struct TileProgram TileProgram;
+
+BoardMesh board_mesh;
+GpuHandle atlas_texture;
+TileProgram tile_program, tile_multiview_program;
+ChunkDraws chunk_draws;
+
+/* GPU-driven board: the chunk table lives in a shader storage buffer and a compute pass culls
+   every chunk, writing one indirect command each, so the CPU cost stays the same for any board
+   size. Needs GL 4.3, the CPU chunk path is used otherwise */
+struct DrawArraysIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint first;
+	GLuint baseInstance;
+};
+typedef struct DrawArraysIndirectCommand DrawArraysIndirectCommand;
 
-			glm::mat4 translateRectangle = glm::translate (glm::vec3(floor_grey.pos.x+i, floor_grey.pos.y+j, floor_grey.pos.z));        // glTranslatef
-			glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));
-			glm::mat4 myScalingMatrix = glm::scale(glm::mat4(1.0f),floor_grey.scale);
-			Matrices.model *= (translateRectangle * rotateRectangle * myScalingMatrix);
-			MVP = VP * Matrices.model;
-			glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Chunk as the compute shader reads it, std430 layout */
+struct GpuChunk {
+	GLfloat lo[4], hi[4];
+	GLuint first, count, top_count, pad;
+};
+typedef struct GpuChunk GpuChunk;
+
+struct BoardCompute {
+	GLuint program;
+	GLint numChunks, views, cull, planes, eyes, lodDistance;
+	GpuHandle table;	// GpuChunk per chunk
+	GpuHandle commands;	// DrawArraysIndirectCommand per chunk
+	int chunks;		// entries in the uploaded table
+	int table_version;
+	BoardCompute() : program(0), chunks(0), table_version(-1) {}
+} board_compute;
+bool cpu_board;		// --cpu-board, keep culling on the CPU
+
+int getTileLayer (int type)
+{
+	if(type==2)
+		return 1;
+	if(type==8)
+		return 2;
+	if(type==7)
+		return 3;
+	if(type==9)
+		return 4;
+	return 0;
+}
 
-			// draw3DObject draws the VAO given to it using current MVP matrix
-			if(boardMatrix[i][j]==1)
-				draw3DObject(floor_grey.object);
-			else if(boardMatrix[i][j]==2)
-				draw3DObject(floor_orange.object);
-			else if(boardMatrix[i][j]==8)
-				draw3DObject(floor_green.object);
-			else if(boardMatrix[i][j]==7)
-				draw3DObject(floor_red.object);
-			else if(boardMatrix[i][j]==9)
-				draw3DObject(floor_black.object);
-			if(boardMatrix[i][j]!=0)
-				draw3DObject(floor_grey.line);
+/* Procedural tile face: the tile colour with a bevelled rim and a little grain */
+void paintTile (unsigned char* dst, int size, glm::vec3 color)
+{
+	for(int y=0;y<size;y++){
+		for(int x=0;x<size;x++){
+			int edge = min(min(x, y), min(size-1-x, size-1-y));
+			float shade = 1.0f;
+			if(edge < size/16)
+				shade = (x < y) ? 1.25f : 0.7f;
+			unsigned hash = (x*73856093u) ^ (y*19349663u);
+			shade *= 0.94f + 0.12f*((hash >> 8) % 256)/255.0f;
+			glm::vec3 c = color*shade + glm::vec3(0.04f, 0.04f, 0.04f);
+			unsigned char* px = dst + 4*(y*size + x);
+			px[0] = (unsigned char)(255*glm::clamp(c.r, 0.0f, 1.0f));
+			px[1] = (unsigned char)(255*glm::clamp(c.g, 0.0f, 1.0f));
+			px[2] = (unsigned char)(255*glm::clamp(c.b, 0.0f, 1.0f));
+			px[3] = 255;
 		}
 	}
+}
 
-	// Load identity to model matrix
-	Matrices.model = glm::mat4(1.0f);
-
-	glm::mat4 translateCam = glm::translate(eye);
-	glm::mat4 rotateCamX = glm::rotate((float)((90 - camera_rotation_angle_x)*M_PI/180.0f), glm::vec3(0,1,0));
-	glm::mat4 rotateCamY = glm::rotate((float)((90 - camera_rotation_angle_y)*M_PI/180.0f), glm::vec3(0,1,0));
-	Matrices.model *= (translateCam * rotateCamX*rotateCamY);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(cam);
-
-	Matrices.model = glm::mat4(1.0f);
-
-	glm::mat4 translateCube1 = glm::translate (cube[0].pos);        // glTranslatef
-	glm::mat4 rotateCube1X = glm::rotate((float)(-(cube[0].theta.x+45)*M_PI/180.0f), glm::vec3(0,-1,0));
-	glm::mat4 rotateCube1Y = glm::rotate((float)(-(cube[0].theta.y+45)*M_PI/180.0f), glm::vec3(1,0,0));
-	glm::mat4 myScalingMatrix2 = glm::scale(glm::mat4(1.0f),cube[0].scale);
-	Matrices.model *= (translateCube1 * rotateCube1X * rotateCube1Y * myScalingMatrix2);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
+/* Build the full mip chain on the CPU, layer images may come from files */
+AtlasImage bakeAtlas (char** layer_files, int layer_file_count)
+{
+	static const int types[ATLAS_LAYERS] = { 1, 2, 8, 7, 9 };
+	AtlasImage atlas;
+	atlas.size = ATLAS_TILE_SIZE;
+	atlas.layers = ATLAS_LAYERS;
+	atlas.levels = 0;
+	size_t total = 0;
+	for(int size=atlas.size;size>=1;size/=2){
+		atlas.offsets.push_back(total);
+		total += (size_t)4*size*size*atlas.layers;
+		atlas.levels++;
+	}
+	atlas.pixels.resize(total);
+
+	size_t layer_bytes = (size_t)4*atlas.size*atlas.size;
+	for(int l=0;l<atlas.layers;l++){
+		unsigned char* dst = &atlas.pixels[l*layer_bytes];
+		int w, h, channels;
+		unsigned char* image = l < layer_file_count ? SOIL_load_image(layer_files[l], &w, &h, &channels, SOIL_LOAD_RGBA) : NULL;
+		if(image == NULL){
+			if(l < layer_file_count)
+				cerr << "Could not load " << layer_files[l] << ", using the plain tile colour" << endl;
+			paintTile(dst, atlas.size, getTileColor(types[l]));
+			continue;
+		}
+		// Nearest resample into the tile size
+		for(int y=0;y<atlas.size;y++)
+			for(int x=0;x<atlas.size;x++)
+				memcpy(dst + 4*(y*atlas.size + x), image + 4*((y*h/atlas.size)*w + x*w/atlas.size), 4);
+		SOIL_free_image_data(image);
+	}
 
-	draw3DObject(cube[0].object);
-	draw3DObject(cube[0].line);
+	// 2x2 box filter, each layer on its own so colours never bleed between tile types
+	for(int level=1, size=atlas.size/2;level<atlas.levels;level++, size/=2){
+		for(int l=0;l<atlas.layers;l++){
+			const unsigned char* src = &atlas.pixels[atlas.offsets[level-1] + (size_t)4*(2*size)*(2*size)*l];
+			unsigned char* dst = &atlas.pixels[atlas.offsets[level] + (size_t)4*size*size*l];
+			for(int y=0;y<size;y++)
+				for(int x=0;x<size;x++)
+					for(int c=0;c<4;c++){
+						int sum = src[4*((2*y)*(2*size) + 2*x) + c] + src[4*((2*y)*(2*size) + 2*x+1) + c]
+							+ src[4*((2*y+1)*(2*size) + 2*x) + c] + src[4*((2*y+1)*(2*size) + 2*x+1) + c];
+						dst[4*(y*size + x) + c] = (unsigned char)((sum + 2)/4);
+					}
+		}
+	}
+	return atlas;
+}
 
+/* Atlas file: "BXAT", size, layers, levels, then every level back to back */
+bool saveAtlas (const char* path, const AtlasImage& atlas)
+{
+	FILE* f = fopen(path, "wb");
+	if(f == NULL)
+		return false;
+	int header[4] = { 0x54415842, atlas.size, atlas.layers, atlas.levels };
+	bool ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(&atlas.pixels[0], atlas.pixels.size(), 1, f) == 1;
+	fclose(f);
+	return ok;
+}
 
-	Matrices.model = glm::mat4(1.0f);
+bool loadAtlas (const char* path, AtlasImage& atlas)
+{
+	FILE* f = fopen(path, "rb");
+	if(f == NULL)
+		return false;
+	int header[4];
+	bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == 0x54415842 && header[2] == ATLAS_LAYERS;
+	// A power of two tile with at most the full chain down to 1x1, checked before anything is sized from it
+	int max_levels = 1;
+	for(int size=header[1];size>1;size/=2)
+		max_levels++;
+	ok = ok && header[1] > 0 && header[1] <= ATLAS_MAX_SIZE && (header[1] & (header[1]-1)) == 0
+		&& header[3] >= 1 && header[3] <= max_levels;
+	if(ok){
+		atlas.size = header[1];
+		atlas.layers = header[2];
+		atlas.levels = header[3];
+		atlas.offsets.clear();
+		size_t total = 0;
+		for(int level=0, size=atlas.size;level<atlas.levels;level++, size/=2){
+			atlas.offsets.push_back(total);
+			total += (size_t)4*size*size*atlas.layers;
+		}
+		// The pixels must fill the rest of the file exactly
+		long start = ftell(f);
+		ok = fseek(f, 0, SEEK_END) == 0 && ftell(f) - start == (long)total && fseek(f, start, SEEK_SET) == 0;
+		if(ok){
+			atlas.pixels.resize(total);
+			ok = fread(&atlas.pixels[0], total, 1, f) == 1;
+		}
+	}
+	fclose(f);
+	return ok;
+}
 
-	glm::mat4 translateCube2 = glm::translate (cube[1].pos);        // glTranslatef
-	glm::mat4 rotateCube2X = glm::rotate((float)(-(cube[1].theta.x+45)*M_PI/180.0f), glm::vec3(0,-1,0));
-	glm::mat4 rotateCube2Y = glm::rotate((float)(-(cube[1].theta.y+45)*M_PI/180.0f), glm::vec3(1,0,0));
-	glm::mat4 myScalingMatrix = glm::scale(glm::mat4(1.0f),cube[1].scale);
-	Matrices.model *= (translateCube2 * rotateCube2X * rotateCube2Y * myScalingMatrix);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Upload every mip level through a pixel buffer object so the copy runs asynchronously */
+GpuHandle uploadAtlas (const AtlasImage& atlas)
+{
+	GpuHandle texture(GPU_TEXTURE, GPU_TEXTURES);
+	bindTexture2DArray(texture.id);
+	texture.setBytes(atlas.pixels.size());
+
+	GpuHandle pbo(GPU_BUFFER, GPU_STREAMING);
+	pbo.bufferData(GL_PIXEL_UNPACK_BUFFER, atlas.pixels.size(), NULL, GL_STREAM_DRAW);
+	void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, atlas.pixels.size(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	const unsigned char* source = NULL;
+	if(dst != NULL){
+		memcpy(dst, &atlas.pixels[0], atlas.pixels.size());
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	else{
+		// The buffer could not be mapped, upload straight from the pixels instead
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		source = &atlas.pixels[0];
+	}
 
-	// draw3DObject draws the VAO given to it using current MVP matrix
+	// With a PBO bound the data pointer is an offset into the buffer
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(int level=0, size=atlas.size;level<atlas.levels;level++, size/=2)
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, size, size, atlas.layers, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+			source ? (const void*)(source + atlas.offsets[level]) : (const void*)atlas.offsets[level]);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, atlas.levels-1);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// The driver keeps the storage alive until the transfer has finished, pbo is deleted here
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return texture;
+}
 
-	draw3DObject(cube[1].object);
-	draw3DObject(cube[1].line);
+/* Startup assets: files are read and decoded on worker threads while the window and
+   context come up, initGL only turns the results into GL objects */
+#define LEVEL_PACK_FILE "levels.txt"
 
+struct StartupAssets {
+	vector<unsigned char> font;	// must outlive the FTFont created from it
+	map<string,string> shaders;
+	vector<Level_struct> levels;	// empty if there is no level pack
+	AtlasImage atlas;
+};
+typedef struct StartupAssets StartupAssets;
 
-	static int fontScale = 0;
-	float fontScaleValue = 0.75 + 0.25*sinf(fontScale*M_PI/180.0f);
-	glm::vec3 fontColor = getRGBfromHue (fontScale);
+std::future< vector<unsigned char> > font_loader;
+std::future< map<string,string> > shader_loader;
+std::future< vector<Level_struct> > level_loader;
+std::future< AtlasImage > atlas_loader;
+StartupAssets assets;
 
+bool readFile (const char* path, vector<unsigned char>& data)
+{
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if(!file.is_open())
+		return false;
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
 
+map<string,string> readShaders ()
+{
+	static const char* files[] = {
+		"Sample_GL.vert", "Sample_GL.frag", "MultiView.vert", "MultiView.geom",
+		"TextureRender.vert", "TextureRender.frag", "TextureMultiView.geom", "BoardCull.comp",
+		"fontrender.vert", "fontrender.frag"
+	};
+	map<string,string> sources;
+	for(size_t i=0;i<sizeof(files)/sizeof(files[0]);i++)
+		sources[files[i]] = readShaderFile(files[i]);
+	return sources;
+}
 
-	// Use font Shaders for next part of code
-	glUseProgram(fontProgramID);
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+/* Level pack, one block per level:
+	level
+	start x0 y0 x1 y1
+	row t t t ...		one line per board row
+	switch x y  x y ...	switch cell followed by the cells it toggles
+	cross x y  x y		teleport cell and its destination
+	end
+   Heights are filled in by placeLevel once the tile sizes are known */
+struct LevelPackReader {
+	std::ifstream file;
+	const char* path;
+	int line_no;
+	int rows;		// of the level being read
+	bool bad;		// the level being read has an error, dropped at its `end'
+	int skipped;	// levels dropped so far
+};
+typedef struct LevelPackReader LevelPackReader;
 
+bool openLevelPack (LevelPackReader& reader, const char* path)
+{
+	reader.file.open(path, std::ios::in);
+	reader.path = path;
+	reader.line_no = reader.rows = reader.skipped = 0;
+	reader.bad = false;
+	return reader.file.is_open();
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateText = glm::translate(glm::vec3(-2,-1.5f,0));
-	glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-	Matrices.model *= (translateText * scaleText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	// send font's MVP and font color to fond shaders
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
+/* Reports the first error of a level at the current line, the level is dropped at its `end' */
+void rejectLevel (LevelPackReader& reader, const string& why)
+{
+	if(reader.bad)
+		return;
+	cerr << reader.path << ":" << reader.line_no << ": " << why << ", skipping level" << endl;
+	reader.bad = true;
+}
 
-	// Render font
-	char to_render[] = {'S','C','O','R','E',' ',':',' ','\0'};
-	char score_string[100];
+/* Checks what prepareLevel writes into the board, which trusts the pack */
+void checkLevel (LevelPackReader& reader, const Level_struct& level)
+{
+	if(level.dim == 0){
+		rejectLevel(reader, "level has no rows");
+		return;
+	}
+	if(cellKey(level.cube0_pos, level.dim) < 0 || cellKey(level.cube1_pos, level.dim) < 0)
+		rejectLevel(reader, "start is off the board");
+	for(size_t i=0;i<level.switches.size();i++){
+		const switch_struct& sw = level.switches[i];
+		bool inside = cellKey(sw.place, level.dim) >= 0;
+		for(size_t j=0;j<sw.locations.size();j++)
+			inside = inside && cellKey(sw.locations[j], level.dim) >= 0;
+		if(!inside)
+			rejectLevel(reader, "switch is off the board");
+	}
+	for(size_t i=0;i<level.crosses.size();i++)
+		if(cellKey(level.crosses[i].place, level.dim) < 0 || cellKey(level.crosses[i].other, level.dim) < 0)
+			rejectLevel(reader, "cross is off the board");
+}
 
-	string hol1 = to_string(score);
+/* Reads up to the next valid `end', false once the file is exhausted.
+   Packs of any size stream through one Level_struct, bad levels are skipped */
+bool readLevel (LevelPackReader& reader, Level_struct& level)
+{
+	std::string line;
+	while(getline(reader.file, line)){
+		reader.line_no++;
+		std::istringstream in(line);
+		std::string word;
+		if(!(in >> word) || word[0] == '#')
+			continue;
+		if(word == "level"){
+			level = Level_struct();
+			memset(level.levelMatrix, 0, sizeof(level.levelMatrix));
+			level.dim = reader.rows = 0;
+			reader.bad = false;
+		}
+		else if(word == "start"){
+			in >> level.cube0_pos.x >> level.cube0_pos.y >> level.cube1_pos.x >> level.cube1_pos.y;
+		}
+		else if(word == "row"){
+			if(reader.rows == MAX_DIM){
+				rejectLevel(reader, "more than " + to_string(MAX_DIM) + " rows");
+				continue;
+			}
+			int cols = 0, tile;
+			while(cols < MAX_DIM && in >> tile)
+				level.levelMatrix[reader.rows][cols++] = tile;
+			if(in >> tile)
+				rejectLevel(reader, "more than " + to_string(MAX_DIM) + " columns");
+			level.dim = max(level.dim, max(++reader.rows, cols));
+		}
+		else if(word == "switch"){
+			switch_struct sw;
+			sw.used = false;
+			in >> sw.place.x >> sw.place.y;
+			glm::vec3 cell(0,0,0);
+			while(in >> cell.x >> cell.y)
+				sw.locations.push_back(cell);
+			level.switches.push_back(sw);
+		}
+		else if(word == "cross"){
+			cross_struct cw;
+			cw.used = false;
+			in >> cw.place.x >> cw.place.y >> cw.other.x >> cw.other.y;
+			level.crosses.push_back(cw);
+		}
+		else if(word == "end"){
+			checkLevel(reader, level);
+			if(!reader.bad)
+				return true;
+			reader.skipped++;
+			reader.bad = false;
+		}
+		else
+			cerr << reader.path << ":" << reader.line_no << ": unknown keyword `" << word << "'" << endl;
+	}
+	return false;
+}
 
-	for(int i=0;i<hol1.size();i++){
-			if( hol1[i]<='9' && hol1[i]>='0' )
-			score_string[i]=to_string(score)[i];
-			else
+vector<Level_struct> parseLevelPack (const char* path)
+{
+	vector<Level_struct> pack;
+	LevelPackReader reader;
+	if(!openLevelPack(reader, path))
+		return pack;
+
+	Level_struct level;
+	while(readLevel(reader, level)){
+		if(pack.size() == MAX_LEVELS){
+			cerr << path << ":" << reader.line_no << ": more than " << MAX_LEVELS << " levels, ignoring the rest" << endl;
 			break;
+		}
+		pack.push_back(level);
 	}
-	score_string[hol1.size()]='\0';
-
-	strcat(to_render,score_string);
-
-	GL3Font.font->Render(to_render);
-
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateText2 = glm::translate(glm::vec3(-2,-2,0));
-	glm::mat4 scaleText2 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-	Matrices.model *= (translateText2 * scaleText2);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	char to_render2[] = {'S','T','E','P','S',' ',':',' ','\0'};
-
-	char moves_string[100];
+	return pack;
+}
 
-	hol1 = to_string(moves[current_level]);
+/* Blocks and teleport targets rest on top of the tiles */
+void placeLevel (Level_struct& level)
+{
+	float rest = floor_grey.scale.z + cube[0].scale.z;
+	level.cube0_pos.z = level.cube1_pos.z = rest;
+	for(vector<cross_struct>::iterator it=level.crosses.begin();it<level.crosses.end();it++)
+		it->place.z = it->other.z = rest;
+}
 
-	for(int i=0;i<hol1.size();i++){
-		if( hol1[i]<='9' && hol1[i]>='0' )
-		moves_string[i]=hol1[i];
-		else
-			break;
+AtlasImage readAtlas ()
+{
+	AtlasImage atlas;
+	if(!loadAtlas(ATLAS_FILE, atlas)){
+		cerr << ATLAS_FILE << " missing or damaged, baking it now (run ./sample2D --bake-atlas to do it ahead of time)" << endl;
+		atlas = bakeAtlas(NULL, 0);
 	}
-	moves_string[hol1.size()]='\0';
+	return atlas;
+}
 
-	strcat(to_render2,moves_string);
-	GL3Font.font->Render(to_render2);
+/* Kick off every file read, returns immediately */
+void startAssetLoading ()
+{
+	font_loader = std::async(std::launch::async, [](){
+		vector<unsigned char> data;
+		readFile("arial.ttf", data);
+		return data;
+	});
+	shader_loader = std::async(std::launch::async, readShaders);
+	level_loader = std::async(std::launch::async, parseLevelPack, LEVEL_PACK_FILE);
+	atlas_loader = std::async(std::launch::async, readAtlas);
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateText3 = glm::translate(glm::vec3(-2,-2.5f,0));
-	glm::mat4 scaleText3 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-	Matrices.model *= (translateText3 * scaleText3);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	char to_render3[] = {'T','I','M','E',' ',':',' ','\0'};
-	char time_string[100];
+/* Block until the workers are done, called from the context thread */
+void finishAssetLoading ()
+{
+	// Only the first call waits, a backend that falls back to GL calls it again
+	if(!font_loader.valid())
+		return;
+	assets.font = font_loader.get();
+	assets.shaders = shader_loader.get();
+	assets.levels = level_loader.get();
+	assets.atlas = atlas_loader.get();
+	shader_sources = assets.shaders;
+}
 
-	hol1 = to_string(timer[current_level]);
-	for(int i=0;i<hol1.size();i++){
-		if(hol1[i]<='9'&& hol1[i]>='0')
-		time_string[i]=hol1[i];
-							else
-			break;
+/* Show the window with the background colour before any asset is ready */
+void drawFirstFrame (GLFWwindow* window)
+{
+	glClearColor (0.1f, 0.1f, 0.1f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glfwSwapBuffers(window);
+}
 
-	}
-	time_string[hol1.size()]='\0';
-	strcat(to_render3,time_string);
+/* Texture coordinates of a face come from the two axes the face spans */
+void faceAxes (const GLfloat* tri, int& u, int& v)
+{
+	glm::vec3 a(tri[0], tri[1], tri[2]), b(tri[3], tri[4], tri[5]), c(tri[6], tri[7], tri[8]);
+	glm::vec3 n = glm::abs(glm::cross(b - a, c - a));
+	u = n.x >= n.y && n.x >= n.z ? 1 : 0;
+	v = n.z >= n.x && n.z >= n.y ? 1 : 2;
+}
 
-	GL3Font.font->Render(to_render3);
+void createBoardMesh ()
+{
+	board_mesh.VertexArray = GpuHandle(GPU_VERTEX_ARRAY, GPU_MESHES);
+	board_mesh.VertexBuffer = GpuHandle(GPU_BUFFER, GPU_MESHES);
+	bindVertexArray(board_mesh.VertexArray.id);
 
+	// Room for every chunk at its worst, chunks are then re-meshed in place
+	board_mesh.VertexBuffer.bufferData(GL_ARRAY_BUFFER, MAX_CHUNKS*CHUNK_VERTICES*sizeof(BoardVertex), NULL, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(BoardVertex), (void*)offsetof(BoardVertex, position));
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(BoardVertex), (void*)offsetof(BoardVertex, texCoord));
+	glEnableVertexAttribArray(2);
+	countGLCalls(4);
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateText4= glm::translate(glm::vec3(-2,0,0));
-	glm::mat4 scaleText24 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
-	Matrices.model *= (translateText4 * scaleText24);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	if(paused)
-	GL3Font.font->Render("Paused!");
+	// Nothing uploaded yet, the next frame meshes the whole board
+	chunks_version = -1;
+	meshed_dim = -1;
+}
 
+TileProgram loadTileProgram (GLuint id)
+{
+	TileProgram program;
+	program.id = id;
+	program.VP = glGetUniformLocation(id, "VP");
+	program.worldSpace = glGetUniformLocation(id, "worldSpace");
+	program.lineColor = glGetUniformLocation(id, "lineColor");
+	program.texSampler = glGetUniformLocation(id, "texSampler");
+	return program;
+}
+
+/* Bind the tile program for one or more cameras with the atlas */
+const TileProgram& useTileProgram (const glm::mat4* VPs, int views)
+{
+	const TileProgram& program = views > 1 ? tile_multiview_program : tile_program;
+	useProgram(program.id);
+	glUniformMatrix4fv(program.VP, views, GL_FALSE, &VPs[0][0][0]);
+	glUniform1i(program.worldSpace, views > 1);
+	glUniform3fv(program.lineColor, 1, &line_color[0]);
+	glUniform1i(program.texSampler, 0);
+	countGLCalls(4);
+	bindTexture2DArray(atlas_texture.id);
+	polygonMode(GL_FILL);
+	return program;
+}
+
+/* Replace one chunk's mesh in the board vertex buffer */
+void uploadChunk (int first, const vector<BoardVertex>& vertices)
+{
+	if(vertices.empty())
+		return;
+	bindArrayBuffer(board_mesh.VertexBuffer.id);
+	glBufferSubData(GL_ARRAY_BUFFER, first*sizeof(BoardVertex), vertices.size()*sizeof(BoardVertex), &vertices[0]);
+	countGLCalls();
+}
+
+/* Draw the visible chunks of the board mesh in one call, the tile edges come from the fragment shader */
+void drawBoardMesh (const ChunkDraws& draws, const glm::mat4* VPs, int views)
+{
+	if(draws.first.empty())
+		return;
+	useTileProgram(VPs, views);
+	bindVertexArray(board_mesh.VertexArray.id);
+	glMultiDrawArrays(GL_TRIANGLES, &draws.first[0], &draws.count[0], draws.first.size());
+	countGLCalls();
+}
+
+void createBoardCompute ()
+{
+	BoardCompute& bc = board_compute;
+	bc.program = adoptProgram(LoadComputeShader("BoardCull.comp"));
+	if(bc.program == 0)
+		return;
+	bc.numChunks = glGetUniformLocation(bc.program, "numChunks");
+	bc.views = glGetUniformLocation(bc.program, "views");
+	bc.cull = glGetUniformLocation(bc.program, "cull");
+	bc.planes = glGetUniformLocation(bc.program, "planes");
+	bc.eyes = glGetUniformLocation(bc.program, "eyes");
+	bc.lodDistance = glGetUniformLocation(bc.program, "lodDistance");
+	bc.table = GpuHandle(GPU_BUFFER, GPU_MESHES);
+	bc.commands = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+}
+
+/* Copy the chunk table to the GPU, only when the board changed */
+void uploadChunkTable (const vector<Chunk>& chunks, int version)
+{
+	BoardCompute& bc = board_compute;
+	vector<GpuChunk> table(chunks.size());
+	for(size_t i=0;i<chunks.size();i++){
+		const Chunk& c = chunks[i];
+		GpuChunk& g = table[i];
+		for(int a=0;a<3;a++){
+			g.lo[a] = c.min[a];
+			g.hi[a] = c.max[a];
+		}
+		g.lo[3] = g.hi[3] = 0;
+		g.first = c.first;
+		g.count = c.tiles ? c.count : 0;
+		g.top_count = c.top_count;
+		g.pad = 0;
+	}
+	if(!table.empty())
+		bc.table.bufferData(GL_SHADER_STORAGE_BUFFER, table.size()*sizeof(GpuChunk), &table[0], GL_STATIC_DRAW);
+	if(bc.chunks != (int)table.size()){
+		bc.chunks = table.size();
+		bc.commands.bufferData(GL_DRAW_INDIRECT_BUFFER, bc.chunks*sizeof(DrawArraysIndirectCommand), NULL, GL_DYNAMIC_COPY);
+	}
+	bc.table_version = version;
+}
+
+/* Cull every chunk on the GPU and draw what survives in one multi-draw */
+void drawBoard (const vector<Chunk>& chunks, int version, const glm::mat4* VPs, const glm::vec3* eyes, int views, bool cull)
+{
+	BoardCompute& bc = board_compute;
+	if(bc.table_version != version)
+		uploadChunkTable(chunks, version);
+	if(bc.chunks == 0)
+		return;
+
+	glm::vec4 planes[24];
+	for(int v=0;v<views;v++){
+		Frustum f = extractFrustum(VPs[v]);
+		for(int i=0;i<6;i++)
+			planes[6*v+i] = f.planes[i];
+	}
+	useProgram(bc.program);
+	glUniform1i(bc.numChunks, bc.chunks);
+	glUniform1i(bc.views, views);
+	glUniform1i(bc.cull, cull);
+	glUniform4fv(bc.planes, 6*views, &planes[0][0]);
+	glUniform3fv(bc.eyes, views, &eyes[0][0]);
+	glUniform1f(bc.lodDistance, lod_distance);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, bc.table.id);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, bc.commands.id);
+	glDispatchCompute((bc.chunks + 63)/64, 1, 1);
+	// The draw reads the commands the dispatch wrote
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+	countGLCalls(11);
+
+	useTileProgram(VPs, views);
+	bindVertexArray(board_mesh.VertexArray.id);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, bc.commands.id);
+	glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)0, bc.chunks, 0);
+	countGLCalls(2);
+}
+
+/* Rendering backend - the scene is built on the game side and handed over as board chunks,
+   arena draws and text, only the backend talks to the graphics API */
+class RenderBackend {
+	public:
+		virtual ~RenderBackend() {}
+		/* Views one pass can draw into at once */
+		virtual int maxViews() = 0;
+		/* Start a frame for a window framebuffer of this size, clears the scene target */
+		virtual void beginFrame(int width, int height) = 0;
+		/* Cameras for the following draws, rects are x, y, w, h in fractions of the target */
+		virtual void setViews(const glm::mat4* VPs, const float (*rects)[4], int views) = 0;
+		/* Replace the mesh of the chunk starting at first, kept until the chunk changes again */
+		virtual void uploadChunk(int first, const vector<BoardVertex>& vertices) = 0;
+		virtual void drawChunks(const ChunkDraws& draws) = 0;
+		/* Cull and draw all chunks itself, false leaves it to drawChunks */
+		virtual bool drawBoard(const vector<Chunk>& chunks, int version, const glm::vec3* eyes, bool cull) = 0;
+		virtual void drawMeshes(vector<ArenaQueued>& draws) = 0;
+		/* Copy the cached top-down board into rect, the cache is drawn again from VP only when the
+		   board version changed. false when the backend keeps no cache and the minimap is left out */
+		virtual bool drawMinimap(const vector<Chunk>& chunks, int version, const glm::mat4& VP, const float* rect) = 0;
+		/* Resolve the scene to the window, text goes on top at full resolution */
+		virtual void endScene() = 0;
+		virtual void drawText(const char* text, const glm::mat4& MVP, const glm::vec3& color) = 0;
+		virtual void present() = 0;
+};
+RenderBackend* renderer;
+
+/* Greedy meshing - same-type tiles are merged into the largest rectangles they fill and faces
+   between neighbouring tiles are dropped, a flat run of tiles costs two triangles per side */
+int boardCell (const GameSnapshot& snap, int i, int j)
+{
+	if(i < 0 || j < 0 || i >= snap.dim || j >= snap.dim)
+		return 0;
+	return snap.boardMatrix[i][j];
+}
+
+/* Face of the box over tiles [i0,i1) x [j0,j1) facing side (-1 or 1) along axis */
+void emitBoardFace (vector<BoardVertex>& out, int i0, int j0, int i1, int j1, int axis, int side, int layer)
+{
+	static const int corners[6][2] = { {0,0}, {1,0}, {1,1}, {0,0}, {1,1}, {0,1} };
+	glm::vec3 lo(floor_grey.pos.x+i0-floor_grey.scale.x, floor_grey.pos.y+j0-floor_grey.scale.y, floor_grey.pos.z-floor_grey.scale.z);
+	glm::vec3 hi(floor_grey.pos.x+i1-1+floor_grey.scale.x, floor_grey.pos.y+j1-1+floor_grey.scale.y, floor_grey.pos.z+floor_grey.scale.z);
+	// Same face axes as faceAxes picks for the cube
+	int u = axis == 0 ? 1 : 0, v = axis == 2 ? 1 : 2;
+	for(int k=0;k<6;k++){
+		glm::vec3 p = side > 0 ? hi : lo;
+		p[u] = corners[k][0] ? hi[u] : lo[u];
+		p[v] = corners[k][1] ? hi[v] : lo[v];
+		BoardVertex vertex;
+		for(int a=0;a<3;a++)
+			vertex.position[a] = p[a];
+		vertex.texCoord[0] = (p[u] - floor_grey.pos[u])/(2*floor_grey.scale[u]) + 0.5f;
+		vertex.texCoord[1] = (p[v] - floor_grey.pos[v])/(2*floor_grey.scale[v]) + 0.5f;
+		vertex.texCoord[2] = layer;
+		out.push_back(vertex);
+	}
+}
+
+/* Type of the tile at step k of a line of tiles if its side faces an empty cell, 0 otherwise */
+int exposedSide (const GameSnapshot& snap, int axis, int side, int line, int k)
+{
+	int i = axis == 0 ? line : k, j = axis == 0 ? k : line;
+	int type = snap.boardMatrix[i][j];
+	if(type == 0 || boardCell(snap, i + (axis == 0)*side, j + (axis == 1)*side) != 0)
+		return 0;
+	return type;
+}
+
+/* Mesh one chunk, top faces first so distant chunks can draw just those */
+void meshChunk (const GameSnapshot& snap, Chunk& c, vector<BoardVertex>& out)
+{
+	out.clear();
+
+	// Tops and bottoms: grow a rectangle along y, then along x while the whole row matches
+	for(int side=1;side>=-1;side-=2){
+		bool used[CHUNK_SIZE][CHUNK_SIZE] = {};
+		for(int i=c.x0;i<c.x1;i++){
+			for(int j=c.y0;j<c.y1;j++){
+				int type = snap.boardMatrix[i][j];
+				if(type == 0 || used[i-c.x0][j-c.y0])
+					continue;
+				int j1 = j+1;
+				while(j1 < c.y1 && snap.boardMatrix[i][j1] == type && !used[i-c.x0][j1-c.y0])
+					j1++;
+				int i1 = i+1;
+				for(;i1<c.x1;i1++){
+					int k = j;
+					while(k < j1 && snap.boardMatrix[i1][k] == type && !used[i1-c.x0][k-c.y0])
+						k++;
+					if(k < j1)
+						break;
+				}
+				for(int a=i;a<i1;a++)
+					for(int b=j;b<j1;b++)
+						used[a-c.x0][b-c.y0] = true;
+				emitBoardFace(out, i, j, i1, j1, 2, side, getTileLayer(type));
+			}
+		}
+		if(side > 0)
+			c.top_count = out.size();
+	}
+
+	// Sides only where the neighbour is empty, merged into runs along the edge
+	for(int axis=0;axis<2;axis++){
+		int line0 = axis == 0 ? c.x0 : c.y0, line1 = axis == 0 ? c.x1 : c.y1;
+		int k0 = axis == 0 ? c.y0 : c.x0, k1 = axis == 0 ? c.y1 : c.x1;
+		for(int side=-1;side<=1;side+=2){
+			for(int line=line0;line<line1;line++){
+				for(int k=k0;k<k1;){
+					int type = exposedSide(snap, axis, side, line, k);
+					if(type == 0){
+						k++;
+						continue;
+					}
+					int end = k+1;
+					while(end < k1 && exposedSide(snap, axis, side, line, end) == type)
+						end++;
+					if(axis == 0)
+						emitBoardFace(out, line, k, line+1, end, 0, side, getTileLayer(type));
+					else
+						emitBoardFace(out, k, line, end, line+1, 1, side, getTileLayer(type));
+					k = end;
+				}
+			}
+		}
+	}
+	c.count = out.size();
+}
+
+/* True if a tile of the chunk or one bordering it differs from the meshed board */
+bool chunkChanged (const GameSnapshot& snap, const Chunk& c)
+{
+	for(int i=max(c.x0-1, 0);i<min(c.x1+1, snap.dim);i++)
+		for(int j=max(c.y0-1, 0);j<min(c.y1+1, snap.dim);j++)
+			if(snap.boardMatrix[i][j] != meshed_board[i][j])
+				return true;
+	return false;
+}
+
+/* Bring the chunk meshes up to date with the board, only the chunks around changed tiles
+   are re-meshed, so a switch laying a bridge re-uploads one or two chunks */
+void rebuildChunks (const GameSnapshot& snap)
+{
+	static vector<BoardVertex> vertices;
+	bool all = meshed_dim != snap.dim;
+	if(all){
+		chunks.clear();
+		for(int x0=0;x0<snap.dim;x0+=CHUNK_SIZE){
+			for(int y0=0;y0<snap.dim;y0+=CHUNK_SIZE){
+				Chunk c;
+				c.x0 = x0;
+				c.y0 = y0;
+				c.x1 = min(x0+CHUNK_SIZE, snap.dim);
+				c.y1 = min(y0+CHUNK_SIZE, snap.dim);
+				c.min = c.max = glm::vec3(0, 0, 0);
+				c.first = chunks.size()*CHUNK_VERTICES;
+				chunks.push_back(c);
+			}
+		}
+	}
+
+	for(vector<Chunk>::iterator c=chunks.begin();c<chunks.end();c++){
+		if(!all && !chunkChanged(snap, *c))
+			continue;
+		c->tiles = 0;
+		for(int i=c->x0;i<c->x1;i++){
+			for(int j=c->y0;j<c->y1;j++){
+				if(snap.boardMatrix[i][j]==0)
+					continue;
+				glm::vec3 lo(floor_grey.pos.x+i-floor_grey.scale.x, floor_grey.pos.y+j-floor_grey.scale.y, floor_grey.pos.z-floor_grey.scale.z);
+				glm::vec3 hi(floor_grey.pos.x+i+floor_grey.scale.x, floor_grey.pos.y+j+floor_grey.scale.y, floor_grey.pos.z+floor_grey.scale.z);
+				c->min = c->tiles ? glm::min(c->min, lo) : lo;
+				c->max = c->tiles ? glm::max(c->max, hi) : hi;
+				c->tiles++;
+			}
+		}
+		meshChunk(snap, *c, vertices);
+		renderer->uploadChunk(c->first, vertices);
+	}
+
+	for(int i=0;i<snap.dim;i++)
+		memcpy(meshed_board[i], snap.boardMatrix[i], snap.dim*sizeof(int));
+	meshed_dim = snap.dim;
+	chunks_version = snap.board_version;
+}
+
+/* CPU path for the board: cull whole chunks and hand the surviving ranges to the backend */
+void cullChunks (const glm::mat4* VPs, const glm::vec3* eyes, int views, bool cull)
+{
+	vector<Frustum> frusta;
+	for(int v=0;v<views;v++)
+		frusta.push_back(extractFrustum(VPs[v]));
+
+	chunk_draws.first.clear();
+	chunk_draws.count.clear();
+	for(vector<Chunk>::iterator c=chunks.begin();c<chunks.end();c++){
+		if(c->tiles == 0)
+			continue;
+		// A chunk is kept if any camera sees it and gets full detail if any camera is close
+		bool visible = !cull;
+		float nearest = 0;
+		for(int v=0;v<views && cull;v++){
+			if(!boxInFrustum(frusta[v], c->min, c->max))
+				continue;
+			float d = distanceToBox(eyes[v], c->min, c->max);
+			nearest = visible ? min(nearest, d) : d;
+			visible = true;
+		}
+		if(!visible)
+			continue;
+
+		// Distant chunks only get the top faces
+		chunk_draws.first.push_back(c->first);
+		chunk_draws.count.push_back((cull && nearest > lod_distance) ? c->top_count : c->count);
+	}
+	renderer->drawChunks(chunk_draws);
+}
+
+/* Model matrix of half k of the block */
+glm::mat4 blockModel (const GameSnapshot& snap, int k, const glm::vec3& scale)
+{
+	glm::mat4 translateCube = glm::translate (snap.cube_pos[k]);        // glTranslatef
+	glm::mat4 rotateCubeX = glm::rotate((float)(-(snap.cube_theta[k].x+45)*M_PI/180.0f), glm::vec3(0,-1,0));
+	glm::mat4 rotateCubeY = glm::rotate((float)(-(snap.cube_theta[k].y+45)*M_PI/180.0f), glm::vec3(1,0,0));
+	glm::mat4 myScalingMatrix = glm::scale(glm::mat4(1.0f),scale);
+	return translateCube * rotateCubeX * rotateCubeY * myScalingMatrix;
+}
+
+/* The two halves of the block with the views set last */
+void drawBlocks (const GameSnapshot& snap)
+{
+	for(int k=0;k<2;k++){
+		Matrices.model = blockModel(snap, k, cube[k].scale);
+		arenaDraw(cube_mesh, Matrices.model, glm::vec3(cube[k].color.r, cube[k].color.g, cube[k].color.b), line_color, true);
+	}
+
+	renderer->drawMeshes(arena.queued);
+	arena.queued.clear();
+}
+
+/* Draw the board and the block as seen by one or more cameras */
+/* With several views the backend replicates every triangle into each viewport */
+void drawScene (const GameSnapshot& snap, const glm::mat4* VPs, const glm::vec3* eyes, int views, bool cull)
+{
+	if(chunks_version != snap.board_version)
+		rebuildChunks(snap);
+	if(!renderer->drawBoard(chunks, chunks_version, eyes, cull))
+		cullChunks(VPs, eyes, views, cull);
+
+	// Load identity to model matrix
+	Matrices.model = glm::mat4(1.0f);
+
+	glm::mat4 translateCam = glm::translate(snap.eye[snap.choice]);
+	glm::mat4 rotateCamX = glm::rotate((float)((90 - snap.camera_rotation_angle_x)*M_PI/180.0f), glm::vec3(0,1,0));
+	glm::mat4 rotateCamY = glm::rotate((float)((90 - snap.camera_rotation_angle_y)*M_PI/180.0f), glm::vec3(0,1,0));
+	Matrices.model *= (translateCam * rotateCamX*rotateCamY);
+	arenaDraw(cam_mesh, Matrices.model, glm::vec3(1,1,1), glm::vec3(1,1,1), false);
+
+	drawBlocks(snap);
+}
+
+/* Score, steps, time and pause status, drawn on top of whatever viewport is bound */
+void drawHUD (const GameSnapshot& snap)
+{
+	glm::mat4 MVP;
+
+	static int fontScale = 0;
+	float fontScaleValue = 0.75 + 0.25*sinf(fontScale*M_PI/180.0f);
+	glm::vec3 fontColor = getRGBfromHue (fontScale);
+
+
+
+	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+
+
+	Matrices.model = glm::mat4(1.0f);
+	glm::mat4 translateText = glm::translate(glm::vec3(-2,-1.5f,0));
+	glm::mat4 scaleText = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
+	Matrices.model *= (translateText * scaleText);
+	MVP = Matrices.projection * Matrices.view * Matrices.model;
+
+	// Render font
+	char to_render[] = {'S','C','O','R','E',' ',':',' ','\0'};
+	char score_string[100];
+
+	string hol1 = to_string(snap.score);
+
+	for(int i=0;i<hol1.size();i++){
+			if( hol1[i]<='9' && hol1[i]>='0' )
+			score_string[i]=to_string(snap.score)[i];
+			else
+			break;
+	}
+	score_string[hol1.size()]='\0';
+
+	strcat(to_render,score_string);
+
+	renderer->drawText(to_render, MVP, fontColor);
+
+	Matrices.model = glm::mat4(1.0f);
+	glm::mat4 translateText2 = glm::translate(glm::vec3(-2,-2,0));
+	glm::mat4 scaleText2 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
+	Matrices.model *= (translateText2 * scaleText2);
+	MVP = Matrices.projection * Matrices.view * Matrices.model;
+	char to_render2[] = {'S','T','E','P','S',' ',':',' ','\0'};
+
+	char moves_string[100];
+
+	hol1 = to_string(snap.moves);
+
+	for(int i=0;i<hol1.size();i++){
+		if( hol1[i]<='9' && hol1[i]>='0' )
+		moves_string[i]=hol1[i];
+		else
+			break;
+	}
+	moves_string[hol1.size()]='\0';
+
+	strcat(to_render2,moves_string);
+	renderer->drawText(to_render2, MVP, fontColor);
+
+	Matrices.model = glm::mat4(1.0f);
+	glm::mat4 translateText3 = glm::translate(glm::vec3(-2,-2.5f,0));
+	glm::mat4 scaleText3 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
+	Matrices.model *= (translateText3 * scaleText3);
+	MVP = Matrices.projection * Matrices.view * Matrices.model;
+	char to_render3[] = {'T','I','M','E',' ',':',' ','\0'};
+	char time_string[100];
+
+	hol1 = to_string(snap.timer);
+	for(int i=0;i<hol1.size();i++){
+		if(hol1[i]<='9'&& hol1[i]>='0')
+		time_string[i]=hol1[i];
+							else
+			break;
+
+	}
+	time_string[hol1.size()]='\0';
+	strcat(to_render3,time_string);
+
+	renderer->drawText(to_render3, MVP, fontColor);
+
+
+	Matrices.model = glm::mat4(1.0f);
+	glm::mat4 translateText4= glm::translate(glm::vec3(-2,0,0));
+	glm::mat4 scaleText24 = glm::scale(glm::vec3(fontScaleValue,fontScaleValue,fontScaleValue));
+	Matrices.model *= (translateText4 * scaleText24);
+	MVP = Matrices.projection * Matrices.view * Matrices.model;
+	if(snap.paused)
+	renderer->drawText("Paused!", MVP, fontColor);
+}
+
+/* Render the scene with openGL */
+/* Edit this function according to your assignment */
+void draw (const GameSnapshot& snap, float x, float y, float w, float h, int doV, int doP)
+{
+	glm::vec3 eye = snap.eye[snap.choice];
+	// Target - Where is the camera looking at.  Don't change unless you are sure!!
+	glm::vec3 target = snap.target[snap.choice];
+	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+	glm::vec3 up = snap.up[snap.choice];
+
+	// Compute Camera matrix (view)
+	if(doV)
+		Matrices.view = glm::lookAt(eye, target, up); // Fixed camera for 2D (ortho) in XY plane
+	else
+		Matrices.view = glm::mat4(1.0f);
+
+	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+	glm::mat4 VP;
+	if (doP)
+		VP = Matrices.projection * Matrices.view;
+	else
+		VP = Matrices.view;
+	const float rect[1][4] = { {x, y, w, h} };
+	renderer->setViews(&VP, rect, 1);
+
+	// Cull chunks only when a full camera transform is applied
+	drawScene(snap, &VP, &eye, 1, doV && doP);
+}
+
+/* Tower, Top, Follow-cam and Helicopter views in the four quadrants of the window */
+/* One geometry pass feeds all four viewports when the backend can draw them at once */
+void drawSplit (const GameSnapshot& snap)
+{
+	static const float quadrant[4][4] = { {0,0.5f,0.5f,0.5f}, {0.5f,0.5f,0.5f,0.5f}, {0,0,0.5f,0.5f}, {0.5f,0,0.5f,0.5f} };
+
+	glm::mat4 VPs[4];
+	for(int v=0;v<4;v++)
+		VPs[v] = Matrices.projection * glm::lookAt(snap.eye[v], snap.target[v], snap.up[v]);
+
+	if(renderer->maxViews() >= 4){
+		renderer->setViews(VPs, quadrant, 4);
+		drawScene(snap, VPs, snap.eye, 4, true);
+	}
+	else{
+		for(int v=0;v<4;v++){
+			renderer->setViews(&VPs[v], &quadrant[v], 1);
+			drawScene(snap, &VPs[v], &snap.eye[v], 1, true);
+		}
+	}
+}
+
+/* Minimap - an orthographic Top view of the whole board in the top right corner. The backend
+   keeps the board layer cached, so a frame only copies it and draws the block over it */
+#define MINIMAP_SIZE 256		// texels per side of the cached board layer
+#define MINIMAP_FRACTION 0.3f		// of the shorter side of the window
+#define MINIMAP_MARGIN 8		// pixels to the window edges
+
+void drawMinimap (const GameSnapshot& snap, int fbwidth, int fbheight)
+{
+	float side = MINIMAP_FRACTION*min(fbwidth, fbheight);
+	const float rect[1][4] = { {1 - (side + MINIMAP_MARGIN)/fbwidth, 1 - (side + MINIMAP_MARGIN)/fbheight, side/fbwidth, side/fbheight} };
+
+	// Same extent as the board mesh, looking straight down with y up like the Top view
+	float x0 = floor_grey.pos.x - floor_grey.scale.x, x1 = floor_grey.pos.x + snap.dim - 1 + floor_grey.scale.x;
+	float y0 = floor_grey.pos.y - floor_grey.scale.y, y1 = floor_grey.pos.y + snap.dim - 1 + floor_grey.scale.y;
+	glm::vec3 center((x0 + x1)/2, (y0 + y1)/2, 0);
+	float half = max(x1 - x0, y1 - y0)/2;
+	glm::mat4 VP = glm::ortho(-half, half, -half, half, 0.1f, 50.0f) * glm::lookAt(center + glm::vec3(0,0,20), center, glm::vec3(0,1,0));
+
+	if(!renderer->drawMinimap(chunks, chunks_version, VP, rect[0]))
+		return;
+	renderer->setViews(&VP, rect, 1);
+	drawBlocks(snap);
+}
+
+/* Dynamic resolution - the scene goes to an offscreen target at a fraction of the window size,
+   picked from the measured GPU time of the last frames, then is stretched over the window */
+#define DYNRES_QUERIES 4
+#define DYNRES_MIN_SCALE 0.4f
+
+struct DynamicResolution {
+	bool enabled;
+	double budget;		// milliseconds per frame
+	float scale;		// of the window size, per axis
+	int width, height;	// size the target is allocated at, the window framebuffer
+	GpuHandle framebuffer, color, depth;
+	GpuHandle queries[DYNRES_QUERIES];	// GL_TIME_ELAPSED, read a few frames late to never stall
+	long frames;
+	DynamicResolution() : enabled(false), budget(1000.0/60.0), scale(1), width(0), height(0), frames(0) {}
+} dynres;
+
+/* The target keeps the window size so a new scale never reallocates, only the viewport shrinks */
+void resizeDynamicTarget (int width, int height)
+{
+	dynres.width = width;
+	dynres.height = height;
+	dynres.framebuffer = GpuHandle(GPU_FRAMEBUFFER, GPU_TARGETS);
+	dynres.color = GpuHandle(GPU_RENDERBUFFER, GPU_TARGETS);
+	dynres.depth = GpuHandle(GPU_RENDERBUFFER, GPU_TARGETS);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, dynres.color.id);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	dynres.color.setBytes((size_t)4*width*height);
+	glBindRenderbuffer(GL_RENDERBUFFER, dynres.depth.id);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	dynres.depth.setBytes((size_t)4*width*height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, dynres.framebuffer.id);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dynres.color.id);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynres.depth.id);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+		cerr << "Offscreen target incomplete, dynamic resolution disabled" << endl;
+		dynres.enabled = false;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Move the scale towards the budget, pixel cost goes with the square of the scale */
+void adjustDynamicScale (double ms)
+{
+	float scale = dynres.scale;
+	if(ms > dynres.budget)
+		scale *= sqrt(dynres.budget/ms);
+	else if(ms < 0.8*dynres.budget)
+		scale *= 1.05f;
+	// Coarse steps keep the picture from shimmering on every small change
+	scale = floor(scale*32 + 0.5f)/32;
+	dynres.scale = glm::clamp(scale, DYNRES_MIN_SCALE, 1.0f);
+}
+
+/* Pick the target of this frame and clear it, sets render_width and render_height */
+void beginScene (int fbwidth, int fbheight)
+{
+	render_width = fbwidth;
+	render_height = fbheight;
+	if(dynres.enabled){
+		if(dynres.width != fbwidth || dynres.height != fbheight)
+			resizeDynamicTarget(fbwidth, fbheight);
+	}
+	if(dynres.enabled){
+		GpuHandle& query = dynres.queries[dynres.frames % DYNRES_QUERIES];
+		if(query.id == 0)
+			query = GpuHandle(GPU_QUERY, GPU_TARGETS);
+		else{
+			GLint available = 0;
+			glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available){
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(query.id, GL_QUERY_RESULT, &elapsed);
+				adjustDynamicScale(elapsed/1e6);
+			}
+		}
+		glBeginQuery(GL_TIME_ELAPSED, query.id);
+		glBindFramebuffer(GL_FRAMEBUFFER, dynres.framebuffer.id);
+		render_width = max(1, (int)(fbwidth*dynres.scale));
+		render_height = max(1, (int)(fbheight*dynres.scale));
+		countGLCalls(3);
+	}
+	glViewport(0, 0, render_width, render_height);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	countGLCalls(2);
+}
+
+/* Upscale the offscreen scene to the window, which is left bound at full size for the HUD */
+void endScene (int fbwidth, int fbheight)
+{
+	if(dynres.enabled){
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, dynres.framebuffer.id);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, fbwidth, fbheight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glEndQuery(GL_TIME_ELAPSED);
+		dynres.frames++;
+		// The HUD is depth tested against the window's own depth buffer
+		glClear(GL_DEPTH_BUFFER_BIT);
+		countGLCalls(6);
+	}
+	glViewport(0, 0, fbwidth, fbheight);
+	countGLCalls();
+}
+
+/* Board layer of the minimap, one colour renderbuffer drawn only when the board changes */
+struct MinimapLayer {
+	GpuHandle framebuffer, color;
+	int version;
+	bool failed;
+	MinimapLayer() : version(-1), failed(false) {}
+} minimap_layer;
+
+/* Top faces of every chunk, the only ones seen from straight above. The scene target is bound again after */
+void renderMinimapLayer (const vector<Chunk>& chunks, int version, const glm::mat4& VP)
+{
+	GLint scene = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &scene);
+	if(minimap_layer.framebuffer.id == 0){
+		minimap_layer.framebuffer = GpuHandle(GPU_FRAMEBUFFER, GPU_TARGETS);
+		minimap_layer.color = GpuHandle(GPU_RENDERBUFFER, GPU_TARGETS);
+		glBindRenderbuffer(GL_RENDERBUFFER, minimap_layer.color.id);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, MINIMAP_SIZE, MINIMAP_SIZE);
+		minimap_layer.color.setBytes((size_t)4*MINIMAP_SIZE*MINIMAP_SIZE);
+		glBindFramebuffer(GL_FRAMEBUFFER, minimap_layer.framebuffer.id);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, minimap_layer.color.id);
+		if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+			cerr << "Minimap target incomplete, minimap disabled" << endl;
+			minimap_layer.failed = true;
+		}
+		countGLCalls(5);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, minimap_layer.framebuffer.id);
+	glViewport(0, 0, MINIMAP_SIZE, MINIMAP_SIZE);
+	// A lighter background than the scene sets the minimap apart
+	glClearColor(0.2f, 0.2f, 0.25f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(0.1f, 0.1f, 0.1f, 0.0f);
+	countGLCalls(6);
+
+	ChunkDraws draws;
+	for(size_t i=0;i<chunks.size();i++)
+		if(chunks[i].top_count > 0){
+			draws.first.push_back(chunks[i].first);
+			draws.count.push_back(chunks[i].top_count);
+		}
+	drawBoardMesh(draws, &VP, 1);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, scene);
+	countGLCalls();
+	minimap_layer.version = version;
+}
+
+/* Stretch the cached layer over rect of the scene target and clear the depth under it for the block */
+void blitMinimap (const float* rect)
+{
+	GLint scene = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &scene);
+	int x = (int)(rect[0]*render_width), y = (int)(rect[1]*render_height);
+	int w = (int)(rect[2]*render_width), h = (int)(rect[3]*render_height);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, minimap_layer.framebuffer.id);
+	glBlitFramebuffer(0, 0, MINIMAP_SIZE, MINIMAP_SIZE, x, y, x + w, y + h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, scene);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(x, y, w, h);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+	countGLCalls(8);
+}
+
+/* Backend drawing through the GL context set up by initGL */
+class GLBackend : public RenderBackend {
+	public:
+		GLFWwindow* window;
+
+		GLBackend() : window(NULL), views(1), width(0), height(0) {}
+
+		int maxViews() { return multiview_supported ? 4 : 1; }
+
+		void beginFrame(int fbwidth, int fbheight) {
+			width = fbwidth;
+			height = fbheight;
+			beginScene(fbwidth, fbheight);
+		}
+
+		void setViews(const glm::mat4* VPs, const float (*rects)[4], int count) {
+			views = count;
+			for(int v=0;v<count;v++){
+				view_projections[v] = VPs[v];
+				float x = rects[v][0]*render_width, y = rects[v][1]*render_height;
+				float w = rects[v][2]*render_width, h = rects[v][3]*render_height;
+				if(count > 1)
+					glViewportIndexedf(v, x, y, w, h);
+				else
+					glViewport((int)x, (int)y, (int)w, (int)h);
+			}
+			countGLCalls(count);
+		}
+
+		void uploadChunk(int first, const vector<BoardVertex>& vertices) {
+			::uploadChunk(first, vertices);
+		}
+
+		void drawChunks(const ChunkDraws& draws) {
+			drawBoardMesh(draws, view_projections, views);
+		}
+
+		bool drawBoard(const vector<Chunk>& chunks, int version, const glm::vec3* eyes, bool cull) {
+			if(board_compute.program == 0)
+				return false;
+			::drawBoard(chunks, version, view_projections, eyes, views, cull);
+			return true;
+		}
+
+		void drawMeshes(vector<ArenaQueued>& draws) {
+			// Flat colour program for the blocks, the multiview one replicates into every viewport
+			useProgram(views > 1 ? multiviewProgramID : programID);
+			glUniformMatrix4fv(views > 1 ? Matrices.ViewProjectionID : Matrices.MatrixID, views, GL_FALSE, &view_projections[0][0][0]);
+			countGLCalls();
+			// All of the draws in one VAO bind and one multi-draw
+			flushArena(draws);
+		}
+
+		bool drawMinimap(const vector<Chunk>& chunks, int version, const glm::mat4& VP, const float* rect) {
+			if(minimap_layer.version != version && !minimap_layer.failed)
+				renderMinimapLayer(chunks, version, VP);
+			if(minimap_layer.failed)
+				return false;
+			blitMinimap(rect);
+			return true;
+		}
+
+		void endScene() {
+			// glViewport resets every viewport of the array back to the full window
+			::endScene(width, height);
+		}
+
+		void drawText(const char* text, const glm::mat4& MVP, const glm::vec3& color) {
+			useProgram(fontProgramID);
+			polygonMode(GL_FILL);
+			glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
+			glUniform3fv(GL3Font.fontColorID, 1, &color[0]);
+			GL3Font.font->Render(text);
+			// FTGL binds its own buffers behind the cache, each Render counts as one call
+			invalidateGLState();
+			countGLCalls(3);
+		}
+
+		void present() {
+			// Swap Frame Buffer in double buffering
+			glfwSwapBuffers(window);
+			countGLCalls();
+
+			double now = glfwGetTime();
+			gl_stats.frames++;
+			gl_stats.calls += gl_state.calls;
+			gl_stats.filtered += gl_state.filtered;
+			gl_state.calls = gl_state.filtered = 0;
+			if(gl_stats.enabled && now - gl_stats.since >= 1){
+				cout << "GL calls per frame: " << gl_stats.calls/gl_stats.frames << " (" << gl_stats.filtered/gl_stats.frames << " redundant filtered)" << endl;
+				gl_stats.frames = 0;
+				gl_stats.calls = gl_stats.filtered = 0;
+				gl_stats.since = now;
+			}
+		}
+
+	private:
+		glm::mat4 view_projections[4];
+		int views;
+		int width, height;	// of the window framebuffer
+};
+
+/* Commands handed to the null backend, nothing else is kept */
+struct RenderCounts {
+	long frames, views;
+	long board_draws, board_vertices;
+	long chunk_uploads, uploaded_vertices;
+	long mesh_draws, texts;
+	long minimaps, minimap_layers;
+};
+typedef struct RenderCounts RenderCounts;
+
+/* Backend that only counts, the whole game loop runs without a context */
+class NullBackend : public RenderBackend {
+	public:
+		RenderCounts counts;
+
+		NullBackend() : minimap_version(-1) { memset(&counts, 0, sizeof(counts)); }
+
+		int maxViews() { return 4; }
+
+		void beginFrame(int width, int height) {
+			render_width = width;
+			render_height = height;
+			counts.frames++;
+		}
+
+		void setViews(const glm::mat4*, const float (*)[4], int views) {
+			counts.views += views;
+		}
+
+		void uploadChunk(int, const vector<BoardVertex>& vertices) {
+			counts.chunk_uploads++;
+			counts.uploaded_vertices += vertices.size();
+		}
+
+		void drawChunks(const ChunkDraws& draws) {
+			counts.board_draws += !draws.first.empty();
+			for(size_t i=0;i<draws.count.size();i++)
+				counts.board_vertices += draws.count[i];
+		}
+
+		bool drawBoard(const vector<Chunk>&, int, const glm::vec3*, bool) {
+			return false;
+		}
+
+		void drawMeshes(vector<ArenaQueued>& draws) {
+			counts.mesh_draws += draws.size();
+		}
+
+		bool drawMinimap(const vector<Chunk>&, int version, const glm::mat4&, const float*) {
+			counts.minimaps++;
+			if(minimap_version != version)
+				counts.minimap_layers++;
+			minimap_version = version;
+			return true;
+		}
+
+		void endScene() {}
+
+		void drawText(const char*, const glm::mat4&, const glm::vec3&) {
+			counts.texts++;
+		}
+
+		void present() {}
+
+	private:
+		int minimap_version;
+};
+
+GLBackend gl_backend;
+NullBackend null_backend;
+
+/* Software renderer - draws the frame of draw() and drawHUD() on the CPU, for batch jobs on
+   machines without a GL stack. Triangles are binned into SOFT_BIN x SOFT_BIN screen tiles,
+   every core takes whole bins and tests four pixels at a time against the edge functions */
+#define SOFT_BIN 32
+
+struct SoftVertex {
+	glm::vec4 clip;
+	float u, v;
+	bool edge;	// the edge to the next vertex of the polygon is a mesh edge
+};
+typedef struct SoftVertex SoftVertex;
+
+struct SoftTriangle {
+	float A[3], B[3], C[3];	// edge function of the edge opposite each corner, A*x + B*y + C
+	float edge_scale[3];	// 1/length of that edge, turns the edge function into pixels
+	float edge_bias[3];	// pushes clipping edges out of reach of the wireframe
+	float inv_area;
+	float z[3];		// window depth
+	float w[3];		// 1/clip w, for perspective correct texture coordinates
+	float u[3], v[3];	// divided by clip w
+	int minx, miny, maxx, maxy;	// inclusive pixel bounds
+	unsigned color, edge_color;
+	int edges;	// 0 none, 1 blended over the fill, 2 edges only
+	int layer;	// atlas layer, -1 for the flat colour
+	int level;	// atlas mip level, picked once per triangle
+};
+typedef struct SoftTriangle SoftTriangle;
+
+struct SoftRenderer {
+	int width, height, stride;	// stride is the width rounded up to whole SSE groups
+	vector<unsigned> color;		// 0xAABBGGRR
+	vector<float> depth;
+	unsigned clear_color;
+	int viewport[4];		// x, y from the bottom left like glViewport
+	const AtlasImage* atlas;
+
+	vector<SoftTriangle> triangles;
+	int bins_x, bins_y;
+	vector< vector<int> > bins;	// triangle indices per bin, in submission order
+
+	vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	int generation, running;
+	bool stop;
+	std::atomic<int> next_bin;
+};
+typedef struct SoftRenderer SoftRenderer;
+
+unsigned softPack (const glm::vec3& c)
+{
+	unsigned r = (unsigned)(255*glm::clamp(c.r, 0.0f, 1.0f) + 0.5f);
+	unsigned g = (unsigned)(255*glm::clamp(c.g, 0.0f, 1.0f) + 0.5f);
+	unsigned b = (unsigned)(255*glm::clamp(c.b, 0.0f, 1.0f) + 0.5f);
+	return 0xff000000u | (b << 16) | (g << 8) | r;
+}
+
+unsigned softMix (unsigned a, unsigned b, float t)
+{
+	unsigned out = 0xff000000u;
+	for(int shift=0;shift<24;shift+=8){
+		float ca = (a >> shift) & 0xff, cb = (b >> shift) & 0xff;
+		out |= (unsigned)(ca + (cb - ca)*t + 0.5f) << shift;
+	}
+	return out;
+}
+
+/* Nearest texel of one atlas layer at a fixed mip level */
+unsigned softSample (const AtlasImage& atlas, int layer, int level, float u, float v)
+{
+	int size = max(1, atlas.size >> level);
+	int x = glm::clamp((int)(u*size), 0, size-1);
+	int y = glm::clamp((int)(v*size), 0, size-1);
+	const unsigned char* px = &atlas.pixels[atlas.offsets[level] + (size_t)4*(layer*size*size + y*size + x)];
+	return 0xff000000u | (px[2] << 16) | (px[1] << 8) | px[0];
+}
+
+/* Depth test and shade one covered pixel, e holds its three edge functions */
+inline void softShade (SoftRenderer& sr, const SoftTriangle& t, int x, int y, const float* e)
+{
+	size_t idx = (size_t)y*sr.stride + x;
+	float b0 = e[0]*t.inv_area, b1 = e[1]*t.inv_area, b2 = e[2]*t.inv_area;
+	float z = b0*t.z[0] + b1*t.z[1] + b2*t.z[2];
+	if(z > sr.depth[idx])
+		return;
+
+	// Same edge ramp as the fragment shaders, the edge functions are already in pixels
+	float edge = 0;
+	if(t.edges){
+		float d = min(min(e[0]*t.edge_scale[0] + t.edge_bias[0], e[1]*t.edge_scale[1] + t.edge_bias[1]), e[2]*t.edge_scale[2] + t.edge_bias[2]);
+		edge = 1 - glm::clamp(d - 0.5f, 0.0f, 1.0f);
+		if(t.edges == 2 && edge < 0.5f)
+			return;
+	}
+
+	unsigned c = t.color;
+	if(t.layer >= 0){
+		float w = b0*t.w[0] + b1*t.w[1] + b2*t.w[2];
+		float u = (b0*t.u[0] + b1*t.u[1] + b2*t.u[2])/w;
+		float v = (b0*t.v[0] + b1*t.v[1] + b2*t.v[2])/w;
+		c = softSample(*sr.atlas, t.layer, t.level, u, v);
+	}
+	if(t.edges)
+		c = softMix(c, t.edge_color, t.edges == 2 ? 1.0f : edge);
+	sr.color[idx] = c;
+	sr.depth[idx] = z;
+}
+
+/* Clear one bin and draw every triangle binned into it */
+void softRasterizeBin (SoftRenderer& sr, int bin)
+{
+	int bx0 = (bin % sr.bins_x)*SOFT_BIN, by0 = (bin / sr.bins_x)*SOFT_BIN;
+	int bx1 = min(bx0 + SOFT_BIN, sr.width) - 1, by1 = min(by0 + SOFT_BIN, sr.height) - 1;
+	for(int y=by0;y<=by1;y++){
+		std::fill(&sr.color[(size_t)y*sr.stride + bx0], &sr.color[(size_t)y*sr.stride + bx1] + 1, sr.clear_color);
+		std::fill(&sr.depth[(size_t)y*sr.stride + bx0], &sr.depth[(size_t)y*sr.stride + bx1] + 1, 1.0f);
+	}
+
+	const vector<int>& list = sr.bins[bin];
+	for(size_t n=0;n<list.size();n++){
+		const SoftTriangle& t = sr.triangles[list[n]];
+		int x0 = max(t.minx, bx0) & ~3, x1 = min(t.maxx, bx1);
+		int y0 = max(t.miny, by0), y1 = min(t.maxy, by1);
+		for(int y=y0;y<=y1;y++){
+			float py = y + 0.5f;
+#ifdef __SSE2__
+			// Four pixels per step, lanes past the bounds are masked off
+			__m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+			__m128 e[3], de[3];
+			for(int i=0;i<3;i++){
+				e[i] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.A[i]), _mm_add_ps(_mm_set1_ps((float)x0), step)), _mm_set1_ps(t.B[i]*py + t.C[i]));
+				de[i] = _mm_set1_ps(4*t.A[i]);
+			}
+			for(int x=x0;x<=x1;x+=4){
+				__m128 zero = _mm_setzero_ps();
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+				int mask = _mm_movemask_ps(inside);
+				if(mask){
+					float lanes[3][4];
+					for(int i=0;i<3;i++)
+						_mm_storeu_ps(lanes[i], e[i]);
+					for(int l=0;l<4;l++){
+						if(!(mask & (1 << l)) || x+l < t.minx || x+l > x1)
+							continue;
+						float el[3] = { lanes[0][l], lanes[1][l], lanes[2][l] };
+						softShade(sr, t, x+l, y, el);
+					}
+				}
+				for(int i=0;i<3;i++)
+					e[i] = _mm_add_ps(e[i], de[i]);
+			}
+#else
+			for(int x=max(x0, t.minx);x<=x1;x++){
+				float px = x + 0.5f;
+				float el[3];
+				for(int i=0;i<3;i++)
+					el[i] = t.A[i]*px + t.B[i]*py + t.C[i];
+				if(el[0] >= 0 && el[1] >= 0 && el[2] >= 0)
+					softShade(sr, t, x, y, el);
+			}
+#endif
+		}
+	}
+}
+
+/* Take bins until none are left, run by every worker and the calling thread */
+void softRunBins (SoftRenderer& sr)
+{
+	int total = sr.bins_x*sr.bins_y;
+	for(int bin=sr.next_bin++;bin<total;bin=sr.next_bin++)
+		softRasterizeBin(sr, bin);
+}
+
+void softWorker (SoftRenderer* sr)
+{
+	int seen = 0;
+	for(;;){
+		{
+			std::unique_lock<std::mutex> lock(sr->mutex);
+			sr->wake.wait(lock, [&] { return sr->stop || sr->generation != seen; });
+			if(sr->stop)
+				return;
+			seen = sr->generation;
+		}
+		softRunBins(*sr);
+		std::lock_guard<std::mutex> lock(sr->mutex);
+		if(--sr->running == 0)
+			sr->finished.notify_one();
+	}
+}
+
+/* threads counts the calling thread, 0 uses every core */
+void softInit (SoftRenderer& sr, int width, int height, int threads, const AtlasImage* atlas)
+{
+	sr.width = width;
+	sr.height = height;
+	sr.stride = (width + 3) & ~3;
+	sr.color.assign((size_t)sr.stride*height, 0);
+	sr.depth.assign((size_t)sr.stride*height, 1.0f);
+	sr.clear_color = softPack(glm::vec3(0.1f, 0.1f, 0.1f));
+	sr.viewport[0] = sr.viewport[1] = 0;
+	sr.viewport[2] = width;
+	sr.viewport[3] = height;
+	sr.atlas = atlas;
+	sr.bins_x = (width + SOFT_BIN - 1)/SOFT_BIN;
+	sr.bins_y = (height + SOFT_BIN - 1)/SOFT_BIN;
+	sr.bins.assign(sr.bins_x*sr.bins_y, vector<int>());
+	sr.generation = sr.running = 0;
+	sr.stop = false;
+	if(threads <= 0)
+		threads = max(1u, std::thread::hardware_concurrency());
+	for(int i=1;i<threads;i++)
+		sr.workers.push_back(std::thread(softWorker, &sr));
+}
+
+void softShutdown (SoftRenderer& sr)
+{
+	{
+		std::lock_guard<std::mutex> lock(sr.mutex);
+		sr.stop = true;
+	}
+	sr.wake.notify_all();
+	for(size_t i=0;i<sr.workers.size();i++)
+		sr.workers[i].join();
+	sr.workers.clear();
+}
+
+/* Viewport transform and triangle setup, then bin by the bounding box */
+void softSetup (SoftRenderer& sr, const SoftVertex* v, const bool* edge, const SoftTriangle& style)
+{
+	SoftTriangle t = style;
+	float x[3], y[3];
+	for(int k=0;k<3;k++){
+		float inv_w = 1/v[k].clip.w;
+		x[k] = sr.viewport[0] + (v[k].clip.x*inv_w + 1)*0.5f*sr.viewport[2];
+		y[k] = sr.height - (sr.viewport[1] + (v[k].clip.y*inv_w + 1)*0.5f*sr.viewport[3]);
+		t.z[k] = v[k].clip.z*inv_w*0.5f + 0.5f;
+		t.w[k] = inv_w;
+		t.u[k] = v[k].u*inv_w;
+		t.v[k] = v[k].v*inv_w;
+	}
+	float area = (x[1]-x[0])*(y[2]-y[0]) - (y[1]-y[0])*(x[2]-x[0]);
+	if(fabsf(area) < 1e-8f)
+		return;
+	// Both windings are drawn, like the GL path without face culling
+	float sign = area > 0 ? 1 : -1;
+	t.inv_area = 1/fabsf(area);
+	for(int i=0;i<3;i++){
+		int j = (i+1)%3, k = (i+2)%3;
+		t.A[i] = -sign*(y[k]-y[j]);
+		t.B[i] = sign*(x[k]-x[j]);
+		t.C[i] = sign*((y[k]-y[j])*x[j] - (x[k]-x[j])*y[j]);
+		float length = sqrtf(t.A[i]*t.A[i] + t.B[i]*t.B[i]);
+		t.edge_scale[i] = length > 0 ? 1/length : 0;
+		t.edge_bias[i] = edge[i] ? 0 : 1e9f;
+	}
+
+	// One texel per pixel picks the mip level, the same for the whole triangle
+	t.level = 0;
+	if(t.layer >= 0){
+		float du1 = v[1].u-v[0].u, dv1 = v[1].v-v[0].v, du2 = v[2].u-v[0].u, dv2 = v[2].v-v[0].v;
+		float texels = fabsf(du1*dv2 - dv1*du2)*sr.atlas->size*sr.atlas->size;
+		if(texels > fabsf(area))
+			t.level = min(sr.atlas->levels-1, (int)(0.5f*log2f(texels/fabsf(area)) + 0.5f));
+	}
+
+	int vx0 = sr.viewport[0], vx1 = sr.viewport[0] + sr.viewport[2] - 1;
+	int vy0 = sr.height - sr.viewport[1] - sr.viewport[3], vy1 = sr.height - sr.viewport[1] - 1;
+	t.minx = max(vx0, max(0, (int)floorf(min(x[0], min(x[1], x[2])))));
+	t.maxx = min(vx1, min(sr.width-1, (int)ceilf(max(x[0], max(x[1], x[2])))));
+	t.miny = max(vy0, max(0, (int)floorf(min(y[0], min(y[1], y[2])))));
+	t.maxy = min(vy1, min(sr.height-1, (int)ceilf(max(y[0], max(y[1], y[2])))));
+	if(t.minx > t.maxx || t.miny > t.maxy)
+		return;
+
+	int index = sr.triangles.size();
+	sr.triangles.push_back(t);
+	for(int by=t.miny/SOFT_BIN;by<=t.maxy/SOFT_BIN;by++)
+		for(int bx=t.minx/SOFT_BIN;bx<=t.maxx/SOFT_BIN;bx++)
+			sr.bins[by*sr.bins_x + bx].push_back(index);
+}
+
+/* Clip against the near plane, the new edge along the plane never gets a wireframe line */
+void softTriangle (SoftRenderer& sr, const SoftVertex* in, const SoftTriangle& style)
+{
+	SoftVertex poly[4];
+	int n = 0;
+	for(int k=0;k<3;k++){
+		const SoftVertex& a = in[k];
+		const SoftVertex& b = in[(k+1)%3];
+		float da = a.clip.z + a.clip.w, db = b.clip.z + b.clip.w;
+		if(da >= 0)
+			poly[n++] = a;
+		if((da >= 0) != (db >= 0)){
+			float s = da/(da - db);
+			SoftVertex& cut = poly[n++];
+			cut.clip = a.clip + (b.clip - a.clip)*s;
+			cut.u = a.u + (b.u - a.u)*s;
+			cut.v = a.v + (b.v - a.v)*s;
+			cut.edge = da >= 0 ? false : a.edge;
+		}
+	}
+
+	// Fan out of the clipped polygon, edge i of a triangle is opposite corner i
+	for(int i=1;i+1<n;i++){
+		SoftVertex tri[3] = { poly[0], poly[i], poly[i+1] };
+		bool edge[3] = { poly[i].edge, i+1 == n-1 && poly[n-1].edge, i == 1 && poly[0].edge };
+		softSetup(sr, tri, edge, style);
+	}
+}
+
+/* Submit a triangle list, layer >= 0 textures it from the atlas with the tile coordinates */
+void softDrawMesh (SoftRenderer& sr, const GLfloat* vertex_buffer_data, int numVertices, const glm::mat4& MVP, unsigned color, unsigned edge_color, int edges, int layer)
+{
+	SoftTriangle style;
+	style.color = color;
+	style.edge_color = edge_color;
+	style.edges = edges;
+	style.layer = layer;
+	for(int t=0;t<numVertices/3;t++){
+		const GLfloat* tri = vertex_buffer_data + 9*t;
+		int u = 0, v = 1;
+		if(layer >= 0)
+			faceAxes(tri, u, v);
+		SoftVertex in[3];
+		for(int k=0;k<3;k++){
+			in[k].clip = MVP*glm::vec4(tri[3*k], tri[3*k+1], tri[3*k+2], 1);
+			in[k].u = (tri[3*k+u] + 1)/2;
+			in[k].v = (tri[3*k+v] + 1)/2;
+			in[k].edge = true;
+		}
+		softTriangle(sr, in, style);
+	}
+}
+
+/* Clear, then rasterize everything submitted since the last call on every core */
+void softRasterize (SoftRenderer& sr)
+{
+	sr.next_bin = 0;
+	{
+		std::lock_guard<std::mutex> lock(sr.mutex);
+		sr.running = sr.workers.size();
+		sr.generation++;
+	}
+	sr.wake.notify_all();
+	softRunBins(sr);
+	std::unique_lock<std::mutex> lock(sr.mutex);
+	sr.finished.wait(lock, [&] { return sr.running == 0; });
+	lock.unlock();
+
+	sr.triangles.clear();
+	for(size_t b=0;b<sr.bins.size();b++)
+		sr.bins[b].clear();
+}
+
+/* Built-in 5x7 font for the HUD, lower case is drawn with the capitals */
+static const char soft_font_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ!-.:";
+static const unsigned char soft_font[][7] = {
+	{0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}, {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E},
+	{0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}, {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E},
+	{0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}, {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E},
+	{0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}, {0x1F,0x01,0x02,0x04,0x08,0x08,0x08},
+	{0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}, {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C},
+	{0x0E,0x11,0x11,0x11,0x1F,0x11,0x11}, {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E},
+	{0x0E,0x11,0x10,0x10,0x10,0x11,0x0E}, {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C},
+	{0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F}, {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10},
+	{0x0E,0x11,0x10,0x17,0x11,0x11,0x0F}, {0x11,0x11,0x11,0x1F,0x11,0x11,0x11},
+	{0x0E,0x04,0x04,0x04,0x04,0x04,0x0E}, {0x07,0x02,0x02,0x02,0x02,0x12,0x0C},
+	{0x11,0x12,0x14,0x18,0x14,0x12,0x11}, {0x10,0x10,0x10,0x10,0x10,0x10,0x1F},
+	{0x11,0x1B,0x15,0x15,0x11,0x11,0x11}, {0x11,0x11,0x19,0x15,0x13,0x11,0x11},
+	{0x0E,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10},
+	{0x0E,0x11,0x11,0x11,0x15,0x12,0x0D}, {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11},
+	{0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E}, {0x1F,0x04,0x04,0x04,0x04,0x04,0x04},
+	{0x11,0x11,0x11,0x11,0x11,0x11,0x0E}, {0x11,0x11,0x11,0x11,0x11,0x0A,0x04},
+	{0x11,0x11,0x11,0x15,0x15,0x15,0x0A}, {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11},
+	{0x11,0x11,0x11,0x0A,0x04,0x04,0x04}, {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F},
+	{0x04,0x04,0x04,0x04,0x04,0x00,0x04}, {0x00,0x00,0x00,0x1F,0x00,0x00,0x00},
+	{0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}, {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}
+};
+
+/* Text with its baseline starting at pixel x, y (y down), dot is the size of one font pixel */
+void softDrawText (SoftRenderer& sr, float x, float y, float dot, const char* text, unsigned color)
+{
+	for(;*text;text++, x+=6*dot){
+		const char* found = strchr(soft_font_chars, toupper(*text));
+		if(*text == ' ' || found == NULL)
+			continue;
+		const unsigned char* glyph = soft_font[found - soft_font_chars];
+		for(int row=0;row<7;row++){
+			for(int col=0;col<5;col++){
+				if(!(glyph[row] & (0x10 >> col)))
+					continue;
+				int px0 = max(0, (int)(x + col*dot)), px1 = min(sr.width, (int)(x + (col+1)*dot));
+				int py0 = max(0, (int)(y + (row-7)*dot)), py1 = min(sr.height, (int)(y + (row-6)*dot));
+				for(int py=py0;py<py1;py++)
+					for(int px=px0;px<px1;px++)
+						sr.color[(size_t)py*sr.stride + px] = color;
+			}
+		}
+	}
+}
+
+/* The board, the camera marker and both blocks through one camera, as drawScene does */
+void softDrawScene (SoftRenderer& sr, const GameSnapshot& snap, const glm::mat4& VP)
+{
+	unsigned line = softPack(line_color);
+	glm::mat4 tileScale = glm::scale(glm::mat4(1.0f), floor_grey.scale);
+	for(int i=0;i<snap.dim;i++){
+		for(int j=0;j<snap.dim;j++){
+			if(snap.boardMatrix[i][j]==0)
+				continue;
+			glm::mat4 model = glm::translate(glm::vec3(floor_grey.pos.x+i, floor_grey.pos.y+j, floor_grey.pos.z))*tileScale;
+			softDrawMesh(sr, cube_vertex_buffer_data, 12*3, VP*model, 0, line, 1, getTileLayer(snap.boardMatrix[i][j]));
+		}
+	}
+
+	glm::mat4 translateCam = glm::translate(snap.eye[snap.choice]);
+	glm::mat4 rotateCamX = glm::rotate((float)((90 - snap.camera_rotation_angle_x)*M_PI/180.0f), glm::vec3(0,1,0));
+	glm::mat4 rotateCamY = glm::rotate((float)((90 - snap.camera_rotation_angle_y)*M_PI/180.0f), glm::vec3(0,1,0));
+	softDrawMesh(sr, cam_vertex_buffer_data, 1*3, VP*translateCam*rotateCamX*rotateCamY, 0, softPack(glm::vec3(1,1,1)), 2, -1);
+
+	for(int k=0;k<2;k++){
+		glm::mat4 translateCube = glm::translate (snap.cube_pos[k]);
+		glm::mat4 rotateCubeX = glm::rotate((float)(-(snap.cube_theta[k].x+45)*M_PI/180.0f), glm::vec3(0,-1,0));
+		glm::mat4 rotateCubeY = glm::rotate((float)(-(snap.cube_theta[k].y+45)*M_PI/180.0f), glm::vec3(1,0,0));
+		glm::mat4 myScalingMatrix = glm::scale(glm::mat4(1.0f),cube[k].scale);
+		glm::vec3 color(cube[k].color.r, cube[k].color.g, cube[k].color.b);
+		softDrawMesh(sr, cube_vertex_buffer_data, 12*3, VP*translateCube*rotateCubeX*rotateCubeY*myScalingMatrix, softPack(color), line, 1, -1);
+	}
+}
+
+/* Score, steps, time and pause status where drawHUD puts them */
+void softDrawHUD (SoftRenderer& sr, const GameSnapshot& snap)
+{
+	// drawHUD lays the text out at z=0 in front of a camera 3 units away with a 90 degree fov,
+	// the glyphs are sized to fit the half unit between its lines
+	float aspect = (float)sr.width/sr.height;
+	float dot = 0.5f/3*0.5f*sr.height/9;
+	unsigned color = softPack(getRGBfromHue(0));
+	static const float rows[3] = { -1.5f, -2, -2.5f };
+	int values[3] = { snap.score, snap.moves, snap.timer };
+	static const char* labels[3] = { "SCORE : ", "STEPS : ", "TIME : " };
+	for(int r=0;r<3;r++){
+		string text = labels[r] + to_string(values[r]);
+		softDrawText(sr, (-2/(3*aspect) + 1)*0.5f*sr.width, (1 - rows[r]/3)*0.5f*sr.height, dot, text.c_str(), color);
+	}
+	if(snap.paused)
+		softDrawText(sr, (-2/(3*aspect) + 1)*0.5f*sr.width, 0.5f*sr.height, dot, "Paused!", color);
+}
+
+/* One complete frame, the four views of the split screen when it is on */
+void softDrawFrame (SoftRenderer& sr, const GameSnapshot& snap)
+{
+	glm::mat4 projection = glm::perspective((float)(M_PI/2), (float)sr.width/sr.height, 0.1f, 500.0f);
+	if(snap.split_view){
+		static const int quadrant[4][2] = { {0,1}, {1,1}, {0,0}, {1,0} };
+		int hw = sr.width/2, hh = sr.height/2;
+		for(int v=0;v<4;v++){
+			sr.viewport[0] = quadrant[v][0]*hw;
+			sr.viewport[1] = quadrant[v][1]*hh;
+			sr.viewport[2] = hw;
+			sr.viewport[3] = hh;
+			softDrawScene(sr, snap, projection*glm::lookAt(snap.eye[v], snap.target[v], snap.up[v]));
+		}
+		sr.viewport[0] = sr.viewport[1] = 0;
+		sr.viewport[2] = sr.width;
+		sr.viewport[3] = sr.height;
+	}
+	else
+		softDrawScene(sr, snap, projection*glm::lookAt(snap.eye[snap.choice], snap.target[snap.choice], snap.up[snap.choice]));
+	softRasterize(sr);
+	softDrawHUD(sr, snap);
+}
+
+bool softWritePPM (const SoftRenderer& sr, const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if(f == NULL)
+		return false;
+	fprintf(f, "P6\n%d %d\n255\n", sr.width, sr.height);
+	vector<unsigned char> row(3*sr.width);
+	bool ok = true;
+	for(int y=0;y<sr.height && ok;y++){
+		for(int x=0;x<sr.width;x++){
+			unsigned c = sr.color[(size_t)y*sr.stride + x];
+			row[3*x] = c & 0xff;
+			row[3*x+1] = (c >> 8) & 0xff;
+			row[3*x+2] = (c >> 16) & 0xff;
+		}
+		ok = fwrite(&row[0], row.size(), 1, f) == 1;
+	}
+	fclose(f);
+	return ok;
+}
+
+#ifdef USE_VULKAN
+/* Vulkan backend - the same scene as the GL backend with far less driver work per frame.
+   The static board is recorded once into a secondary command buffer per frame slot and view,
+   the blocks and text are push constants in one per-frame command buffer, and the descriptor
+   layout is made once. Everything lives in host-visible memory, all there is on lavapipe */
+#define VK_FRAMES 2		// frames in flight
+#define VK_VIEWS 4		// views per frame, the split screen has four
+#define VK_TEXT_VERTICES 16384	// per frame
+#define VK_TEXT_DOT 0.1f	// font pixel in FTGL units, close to Arial at face size 1
+#define VK_TRY(call) if((call) != VK_SUCCESS){ cerr << #call << " failed" << endl; return false; }
+
+/* Frame block of VulkanBoard.vert, written once per frame */
+struct VulkanFrameUniforms {
+	glm::mat4 VP[VK_VIEWS];
+	glm::vec4 lineColor;
+};
+typedef struct VulkanFrameUniforms VulkanFrameUniforms;
+
+/* Push constants of VulkanMesh.vert, one set per block, marker or text */
+struct VulkanDrawConstants {
+	glm::mat4 MVP;
+	glm::vec4 color;
+	glm::vec4 edge;		// alpha 0 draws the edges only
+};
+typedef struct VulkanDrawConstants VulkanDrawConstants;
+
+struct VulkanBuffer {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	void* mapped;		// stays mapped for the buffer's lifetime
+};
+typedef struct VulkanBuffer VulkanBuffer;
+
+/* Board draw of one view, recorded again only when the board or the view's rectangle changes */
+struct VulkanBoardCommands {
+	VkCommandBuffer commands;
+	int version;		// chunks_version it holds, -1 to record again
+	float rect[4];
+};
+typedef struct VulkanBoardCommands VulkanBoardCommands;
+
+struct VulkanContext {
+	VkInstance instance;
+	VkSurfaceKHR surface;
+	VkPhysicalDevice gpu;
+	VkDevice device;
+	uint32_t queue_family;
+	VkQueue queue;
+
+	VkSwapchainKHR swapchain;
+	VkFormat format;
+	VkColorSpaceKHR color_space;
+	VkExtent2D extent;
+	int window_width, window_height;	// framebuffer size the swapchain was made for
+	vector<VkImage> images;
+	vector<VkImageView> image_views;
+	vector<VkFramebuffer> framebuffers;
+	VkImage depth;
+	VkDeviceMemory depth_memory;
+	VkImageView depth_view;
+	VkRenderPass render_pass;
+
+	VkDescriptorSetLayout set_layout;
+	VkDescriptorPool descriptor_pool;
+	VkDescriptorSet sets[VK_FRAMES];
+	VkPipelineLayout board_layout, mesh_layout;
+	VkPipeline board_pipeline, mesh_pipeline;
+
+	VkImage atlas;
+	VkDeviceMemory atlas_memory;
+	VkImageView atlas_view;
+	VkSampler sampler;
+
+	VulkanBuffer board[VK_FRAMES];	// CHUNK_VERTICES per chunk as the GL board mesh, one copy per frame slot
+	vector<BoardVertex> board_vertices;	// what every copy should hold
+	vector<std::pair<int,int> > board_pending[VK_FRAMES];	// first and count of chunks a copy has missed
+	VulkanBuffer meshes;		// arena vertices, then its indices
+	VkDeviceSize mesh_indices;	// offset of the indices
+	VulkanBuffer uniforms[VK_FRAMES];
+	VulkanBuffer text[VK_FRAMES];
+
+	VkCommandPool pool;
+	VkCommandBuffer primary[VK_FRAMES], scene[VK_FRAMES];
+	VulkanBoardCommands board_commands[VK_FRAMES][VK_VIEWS];
+	VkSemaphore acquired[VK_FRAMES], rendered[VK_FRAMES];
+	VkFence done[VK_FRAMES];
+
+	int frame;			// slot of the frame being built
+	uint32_t image;			// swapchain image it goes to
+	bool recording;			// false when the frame was skipped
+	bool stale;			// the swapchain no longer matches the window
+	int view;			// views set so far this frame, the current one is view-1
+	float rect[4];			// of the current view
+	glm::mat4 VP;			// of the current view, in Vulkan clip space
+	int text_vertices;		// used this frame
+	vector<VkCommandBuffer> executes;	// board commands of this frame, then the scene
+} vkc;
+
+/* GL clip space to Vulkan: y points down and depth runs from 0 to 1 */
+const glm::mat4 vulkan_clip(glm::vec4(1,0,0,0), glm::vec4(0,-1,0,0), glm::vec4(0,0,0.5f,0), glm::vec4(0,0,0.5f,1));
+
+int vulkanMemoryType (uint32_t type_bits, VkMemoryPropertyFlags flags)
+{
+	VkPhysicalDeviceMemoryProperties props;
+	vkGetPhysicalDeviceMemoryProperties(vkc.gpu, &props);
+	for(uint32_t i=0;i<props.memoryTypeCount;i++)
+		if((type_bits & (1u << i)) && (props.memoryTypes[i].propertyFlags & flags) == flags)
+			return i;
+	return -1;
+}
+
+bool vulkanAllocate (const VkMemoryRequirements& req, VkMemoryPropertyFlags flags, VkDeviceMemory& memory)
+{
+	int type = vulkanMemoryType(req.memoryTypeBits, flags);
+	if(type < 0){
+		cerr << "No Vulkan memory type with flags " << flags << endl;
+		return false;
+	}
+	VkMemoryAllocateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	info.allocationSize = req.size;
+	info.memoryTypeIndex = type;
+	VK_TRY(vkAllocateMemory(vkc.device, &info, NULL, &memory));
+	return true;
+}
+
+/* Host-visible, coherent and mapped */
+bool vulkanCreateBuffer (VulkanBuffer& b, VkDeviceSize size, VkBufferUsageFlags usage)
+{
+	VkBufferCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	info.size = size;
+	info.usage = usage;
+	info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	VK_TRY(vkCreateBuffer(vkc.device, &info, NULL, &b.buffer));
+	VkMemoryRequirements req;
+	vkGetBufferMemoryRequirements(vkc.device, b.buffer, &req);
+	if(!vulkanAllocate(req, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, b.memory))
+		return false;
+	VK_TRY(vkBindBufferMemory(vkc.device, b.buffer, b.memory, 0));
+	VK_TRY(vkMapMemory(vkc.device, b.memory, 0, VK_WHOLE_SIZE, 0, &b.mapped));
+	return true;
+}
+
+void vulkanDestroyBuffer (VulkanBuffer& b)
+{
+	vkDestroyBuffer(vkc.device, b.buffer, NULL);
+	vkFreeMemory(vkc.device, b.memory, NULL);
+	b = VulkanBuffer();
+}
+
+bool vulkanCreateImage (const VkImageCreateInfo& info, VkImage& image, VkDeviceMemory& memory)
+{
+	VK_TRY(vkCreateImage(vkc.device, &info, NULL, &image));
+	VkMemoryRequirements req;
+	vkGetImageMemoryRequirements(vkc.device, image, &req);
+	if(!vulkanAllocate(req, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, memory))
+		return false;
+	VK_TRY(vkBindImageMemory(vkc.device, image, memory, 0));
+	return true;
+}
+
+VkImageView vulkanCreateView (VkImage image, VkImageViewType type, VkFormat format, VkImageAspectFlags aspect, uint32_t levels, uint32_t layers)
+{
+	VkImageViewCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	info.image = image;
+	info.viewType = type;
+	info.format = format;
+	info.subresourceRange.aspectMask = aspect;
+	info.subresourceRange.levelCount = levels;
+	info.subresourceRange.layerCount = layers;
+	VkImageView view = VK_NULL_HANDLE;
+	if(vkCreateImageView(vkc.device, &info, NULL, &view) != VK_SUCCESS)
+		cerr << "vkCreateImageView failed" << endl;
+	return view;
+}
+
+/* Instance, window surface and the first device with a queue that draws and presents.
+   VK_ICD_FILENAMES picks the driver, lavapipe included */
+bool vulkanCreateDevice (GLFWwindow* window)
+{
+	if(!glfwVulkanSupported()){
+		cerr << "GLFW found no Vulkan loader" << endl;
+		return false;
+	}
+	VkApplicationInfo app = {};
+	app.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	app.pApplicationName = "sample2D";
+	app.apiVersion = VK_API_VERSION_1_0;
+	uint32_t extension_count = 0;
+	const char** extensions = glfwGetRequiredInstanceExtensions(&extension_count);
+	VkInstanceCreateInfo instance = {};
+	instance.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instance.pApplicationInfo = &app;
+	instance.enabledExtensionCount = extension_count;
+	instance.ppEnabledExtensionNames = extensions;
+	VK_TRY(vkCreateInstance(&instance, NULL, &vkc.instance));
+	VK_TRY(glfwCreateWindowSurface(vkc.instance, window, NULL, &vkc.surface));
+
+	uint32_t count = 0;
+	vkEnumeratePhysicalDevices(vkc.instance, &count, NULL);
+	vector<VkPhysicalDevice> gpus(count);
+	if(count)
+		vkEnumeratePhysicalDevices(vkc.instance, &count, &gpus[0]);
+	for(size_t d=0;d<gpus.size() && vkc.gpu == VK_NULL_HANDLE;d++){
+		uint32_t families = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(gpus[d], &families, NULL);
+		vector<VkQueueFamilyProperties> props(families);
+		if(families)
+			vkGetPhysicalDeviceQueueFamilyProperties(gpus[d], &families, &props[0]);
+		for(uint32_t q=0;q<families;q++){
+			VkBool32 present = VK_FALSE;
+			vkGetPhysicalDeviceSurfaceSupportKHR(gpus[d], q, vkc.surface, &present);
+			if((props[q].queueFlags & VK_QUEUE_GRAPHICS_BIT) && present){
+				vkc.gpu = gpus[d];
+				vkc.queue_family = q;
+				break;
+			}
+		}
+	}
+	if(vkc.gpu == VK_NULL_HANDLE){
+		cerr << "No Vulkan device can draw to the window" << endl;
+		return false;
+	}
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(vkc.gpu, &props);
+	cout << "Vulkan device: " << props.deviceName << endl;
+
+	float priority = 1;
+	VkDeviceQueueCreateInfo queue = {};
+	queue.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queue.queueFamilyIndex = vkc.queue_family;
+	queue.queueCount = 1;
+	queue.pQueuePriorities = &priority;
+	const char* swapchain_extension = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+	VkDeviceCreateInfo device = {};
+	device.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	device.queueCreateInfoCount = 1;
+	device.pQueueCreateInfos = &queue;
+	device.enabledExtensionCount = 1;
+	device.ppEnabledExtensionNames = &swapchain_extension;
+	VK_TRY(vkCreateDevice(vkc.gpu, &device, NULL, &vkc.device));
+	vkGetDeviceQueue(vkc.device, vkc.queue_family, 0, &vkc.queue);
+
+	// BGRA8 when the surface has it, the first format otherwise
+	uint32_t formats = 0;
+	vkGetPhysicalDeviceSurfaceFormatsKHR(vkc.gpu, vkc.surface, &formats, NULL);
+	vector<VkSurfaceFormatKHR> list(formats);
+	if(formats == 0)
+		return false;
+	vkGetPhysicalDeviceSurfaceFormatsKHR(vkc.gpu, vkc.surface, &formats, &list[0]);
+	VkSurfaceFormatKHR chosen = list[0];
+	for(size_t f=0;f<list.size();f++)
+		if(list[f].format == VK_FORMAT_B8G8R8A8_UNORM)
+			chosen = list[f];
+	vkc.format = chosen.format == VK_FORMAT_UNDEFINED ? VK_FORMAT_B8G8R8A8_UNORM : chosen.format;
+	vkc.color_space = chosen.colorSpace;
+	return true;
+}
+
+/* One pass: clear, the board and blocks from secondary command buffers, the HUD on top */
+bool vulkanCreateRenderPass ()
+{
+	VkAttachmentDescription attachments[2] = {};
+	attachments[0].format = vkc.format;
+	attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	attachments[1] = attachments[0];
+	attachments[1].format = VK_FORMAT_D32_SFLOAT;
+	attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	VkAttachmentReference color = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+	VkAttachmentReference depth = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &color;
+	subpass.pDepthStencilAttachment = &depth;
+	// Nothing is written before the acquired image is free
+	VkSubpassDependency dependency = {};
+	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependency.dstSubpass = 0;
+	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependency.dstStageMask = dependency.srcStageMask;
+	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	VkRenderPassCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	info.attachmentCount = 2;
+	info.pAttachments = attachments;
+	info.subpassCount = 1;
+	info.pSubpasses = &subpass;
+	info.dependencyCount = 1;
+	info.pDependencies = &dependency;
+	VK_TRY(vkCreateRenderPass(vkc.device, &info, NULL, &vkc.render_pass));
+	return true;
+}
+
+void vulkanDestroyTargets ()
+{
+	for(size_t i=0;i<vkc.framebuffers.size();i++)
+		vkDestroyFramebuffer(vkc.device, vkc.framebuffers[i], NULL);
+	for(size_t i=0;i<vkc.image_views.size();i++)
+		vkDestroyImageView(vkc.device, vkc.image_views[i], NULL);
+	vkc.framebuffers.clear();
+	vkc.image_views.clear();
+	vkDestroyImageView(vkc.device, vkc.depth_view, NULL);
+	vkDestroyImage(vkc.device, vkc.depth, NULL);
+	vkFreeMemory(vkc.device, vkc.depth_memory, NULL);
+	vkc.depth_view = VK_NULL_HANDLE;
+	vkc.depth = VK_NULL_HANDLE;
+	vkc.depth_memory = VK_NULL_HANDLE;
+}
+
+/* Swapchain, depth buffer and framebuffers for a window framebuffer of this size,
+   false while the window is minimised */
+bool vulkanCreateSwapchain (int width, int height)
+{
+	vkc.window_width = width;
+	vkc.window_height = height;
+	VkSurfaceCapabilitiesKHR caps;
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vkc.gpu, vkc.surface, &caps);
+	vkc.extent = caps.currentExtent;
+	if(caps.currentExtent.width == 0xFFFFFFFF){
+		vkc.extent.width = max(caps.minImageExtent.width, min((uint32_t)width, caps.maxImageExtent.width));
+		vkc.extent.height = max(caps.minImageExtent.height, min((uint32_t)height, caps.maxImageExtent.height));
+	}
+	if(vkc.extent.width == 0 || vkc.extent.height == 0)
+		return false;
+
+	// --swap-interval 0 asks for a mode that does not wait for vblank, FIFO is always there
+	VkPresentModeKHR mode = VK_PRESENT_MODE_FIFO_KHR;
+	uint32_t modes = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(vkc.gpu, vkc.surface, &modes, NULL);
+	vector<VkPresentModeKHR> available(modes);
+	if(modes)
+		vkGetPhysicalDeviceSurfacePresentModesKHR(vkc.gpu, vkc.surface, &modes, &available[0]);
+	for(size_t m=0;m<available.size() && frame.swap_interval == 0;m++)
+		if(available[m] == VK_PRESENT_MODE_IMMEDIATE_KHR || (available[m] == VK_PRESENT_MODE_MAILBOX_KHR && mode == VK_PRESENT_MODE_FIFO_KHR))
+			mode = available[m];
+
+	VkCompositeAlphaFlagBitsKHR alpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+	while(!(caps.supportedCompositeAlpha & alpha) && alpha < VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR)
+		alpha = (VkCompositeAlphaFlagBitsKHR)(alpha << 1);
+
+	VkSwapchainKHR old = vkc.swapchain;
+	VkSwapchainCreateInfoKHR info = {};
+	info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+	info.surface = vkc.surface;
+	info.minImageCount = caps.maxImageCount ? min(caps.minImageCount + 1, caps.maxImageCount) : caps.minImageCount + 1;
+	info.imageFormat = vkc.format;
+	info.imageColorSpace = vkc.color_space;
+	info.imageExtent = vkc.extent;
+	info.imageArrayLayers = 1;
+	info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	info.preTransform = caps.currentTransform;
+	info.compositeAlpha = alpha;
+	info.presentMode = mode;
+	info.clipped = VK_TRUE;
+	info.oldSwapchain = old;
+	VK_TRY(vkCreateSwapchainKHR(vkc.device, &info, NULL, &vkc.swapchain));
+	vkDestroySwapchainKHR(vkc.device, old, NULL);
+
+	uint32_t count = 0;
+	vkGetSwapchainImagesKHR(vkc.device, vkc.swapchain, &count, NULL);
+	vkc.images.resize(count);
+	vkGetSwapchainImagesKHR(vkc.device, vkc.swapchain, &count, &vkc.images[0]);
+
+	VkImageCreateInfo depth = {};
+	depth.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	depth.imageType = VK_IMAGE_TYPE_2D;
+	depth.format = VK_FORMAT_D32_SFLOAT;
+	depth.extent.width = vkc.extent.width;
+	depth.extent.height = vkc.extent.height;
+	depth.extent.depth = 1;
+	depth.mipLevels = 1;
+	depth.arrayLayers = 1;
+	depth.samples = VK_SAMPLE_COUNT_1_BIT;
+	depth.tiling = VK_IMAGE_TILING_OPTIMAL;
+	depth.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+	if(!vulkanCreateImage(depth, vkc.depth, vkc.depth_memory))
+		return false;
+	vkc.depth_view = vulkanCreateView(vkc.depth, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_D32_SFLOAT, VK_IMAGE_ASPECT_DEPTH_BIT, 1, 1);
+
+	for(uint32_t i=0;i<count;i++){
+		vkc.image_views.push_back(vulkanCreateView(vkc.images[i], VK_IMAGE_VIEW_TYPE_2D, vkc.format, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1));
+		VkImageView attachments[2] = { vkc.image_views[i], vkc.depth_view };
+		VkFramebufferCreateInfo fb = {};
+		fb.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		fb.renderPass = vkc.render_pass;
+		fb.attachmentCount = 2;
+		fb.pAttachments = attachments;
+		fb.width = vkc.extent.width;
+		fb.height = vkc.extent.height;
+		fb.layers = 1;
+		VkFramebuffer framebuffer;
+		VK_TRY(vkCreateFramebuffer(vkc.device, &fb, NULL, &framebuffer));
+		vkc.framebuffers.push_back(framebuffer);
+	}
+	vkc.stale = false;
+	return true;
+}
+
+bool vulkanRecreateSwapchain (int width, int height)
+{
+	vkDeviceWaitIdle(vkc.device);
+	vulkanDestroyTargets();
+	// The board commands hold viewports in pixels of the old size
+	for(int f=0;f<VK_FRAMES;f++)
+		for(int v=0;v<VK_VIEWS;v++)
+			vkc.board_commands[f][v].version = -1;
+	return vulkanCreateSwapchain(width, height);
+}
+
+/* Record, submit and wait for a one-off command buffer, used for uploads at startup */
+VkCommandBuffer vulkanBeginOneOff ()
+{
+	VkCommandBufferAllocateInfo alloc = {};
+	alloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	alloc.commandPool = vkc.pool;
+	alloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	alloc.commandBufferCount = 1;
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	vkAllocateCommandBuffers(vkc.device, &alloc, &cmd);
+	VkCommandBufferBeginInfo begin = {};
+	begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(cmd, &begin);
+	return cmd;
+}
+
+void vulkanEndOneOff (VkCommandBuffer cmd)
+{
+	vkEndCommandBuffer(cmd);
+	VkSubmitInfo submit = {};
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &cmd;
+	vkQueueSubmit(vkc.queue, 1, &submit, VK_NULL_HANDLE);
+	vkQueueWaitIdle(vkc.queue);
+	vkFreeCommandBuffers(vkc.device, vkc.pool, 1, &cmd);
+}
+
+void vulkanImageBarrier (VkCommandBuffer cmd, VkImage image, uint32_t levels, uint32_t layers, VkImageLayout from, VkImageLayout to,
+		VkAccessFlags src_access, VkAccessFlags dst_access, VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage)
+{
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = src_access;
+	barrier.dstAccessMask = dst_access;
+	barrier.oldLayout = from;
+	barrier.newLayout = to;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.levelCount = levels;
+	barrier.subresourceRange.layerCount = layers;
+	vkCmdPipelineBarrier(cmd, src_stage, dst_stage, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+/* The tile atlas as a 2D array image with its baked mip chain */
+bool vulkanUploadAtlas (const AtlasImage& atlas)
+{
+	VkImageCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	info.imageType = VK_IMAGE_TYPE_2D;
+	info.format = VK_FORMAT_R8G8B8A8_UNORM;
+	info.extent.width = atlas.size;
+	info.extent.height = atlas.size;
+	info.extent.depth = 1;
+	info.mipLevels = atlas.levels;
+	info.arrayLayers = atlas.layers;
+	info.samples = VK_SAMPLE_COUNT_1_BIT;
+	info.tiling = VK_IMAGE_TILING_OPTIMAL;
+	info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	if(!vulkanCreateImage(info, vkc.atlas, vkc.atlas_memory))
+		return false;
+
+	VulkanBuffer staging = VulkanBuffer();
+	if(!vulkanCreateBuffer(staging, atlas.pixels.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT))
+		return false;
+	memcpy(staging.mapped, &atlas.pixels[0], atlas.pixels.size());
+
+	// The layers of a level are contiguous, one copy per level
+	vector<VkBufferImageCopy> copies(atlas.levels);
+	for(int l=0;l<atlas.levels;l++){
+		VkBufferImageCopy& copy = copies[l];
+		copy = VkBufferImageCopy();
+		copy.bufferOffset = atlas.offsets[l];
+		copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copy.imageSubresource.mipLevel = l;
+		copy.imageSubresource.layerCount = atlas.layers;
+		copy.imageExtent.width = max(1, atlas.size >> l);
+		copy.imageExtent.height = max(1, atlas.size >> l);
+		copy.imageExtent.depth = 1;
+	}
+	VkCommandBuffer cmd = vulkanBeginOneOff();
+	vulkanImageBarrier(cmd, vkc.atlas, atlas.levels, atlas.layers, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	vkCmdCopyBufferToImage(cmd, staging.buffer, vkc.atlas, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, copies.size(), &copies[0]);
+	vulkanImageBarrier(cmd, vkc.atlas, atlas.levels, atlas.layers, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	vulkanEndOneOff(cmd);
+	vulkanDestroyBuffer(staging);
+
+	vkc.atlas_view = vulkanCreateView(vkc.atlas, VK_IMAGE_VIEW_TYPE_2D_ARRAY, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT, atlas.levels, atlas.layers);
+	VkSamplerCreateInfo sampler = {};
+	sampler.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	sampler.magFilter = VK_FILTER_LINEAR;
+	sampler.minFilter = VK_FILTER_LINEAR;
+	sampler.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	sampler.addressModeU = sampler.addressModeV = sampler.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	sampler.maxLod = atlas.levels;
+	VK_TRY(vkCreateSampler(vkc.device, &sampler, NULL, &vkc.sampler));
+	return true;
+}
+
+/* The descriptor layout never changes: the frame's uniforms and the atlas, one set per frame slot */
+bool vulkanCreateLayouts ()
+{
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	VkDescriptorSetLayoutCreateInfo set = {};
+	set.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	set.bindingCount = 2;
+	set.pBindings = bindings;
+	VK_TRY(vkCreateDescriptorSetLayout(vkc.device, &set, NULL, &vkc.set_layout));
+
+	// The board only pushes the view it draws, the meshes a whole VulkanDrawConstants
+	VkPushConstantRange view = { VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GLint) };
+	VkPipelineLayoutCreateInfo board = {};
+	board.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	board.setLayoutCount = 1;
+	board.pSetLayouts = &vkc.set_layout;
+	board.pushConstantRangeCount = 1;
+	board.pPushConstantRanges = &view;
+	VK_TRY(vkCreatePipelineLayout(vkc.device, &board, NULL, &vkc.board_layout));
+	VkPushConstantRange draw = { VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(VulkanDrawConstants) };
+	VkPipelineLayoutCreateInfo mesh = {};
+	mesh.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	mesh.pushConstantRangeCount = 1;
+	mesh.pPushConstantRanges = &draw;
+	VK_TRY(vkCreatePipelineLayout(vkc.device, &mesh, NULL, &vkc.mesh_layout));
+
+	VkDescriptorPoolSize sizes[2] = { { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_FRAMES }, { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_FRAMES } };
+	VkDescriptorPoolCreateInfo pool = {};
+	pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	pool.maxSets = VK_FRAMES;
+	pool.poolSizeCount = 2;
+	pool.pPoolSizes = sizes;
+	VK_TRY(vkCreateDescriptorPool(vkc.device, &pool, NULL, &vkc.descriptor_pool));
+	VkDescriptorSetLayout layouts[VK_FRAMES];
+	for(int f=0;f<VK_FRAMES;f++)
+		layouts[f] = vkc.set_layout;
+	VkDescriptorSetAllocateInfo alloc = {};
+	alloc.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	alloc.descriptorPool = vkc.descriptor_pool;
+	alloc.descriptorSetCount = VK_FRAMES;
+	alloc.pSetLayouts = layouts;
+	VK_TRY(vkAllocateDescriptorSets(vkc.device, &alloc, vkc.sets));
+
+	for(int f=0;f<VK_FRAMES;f++){
+		VkDescriptorBufferInfo uniforms = { vkc.uniforms[f].buffer, 0, sizeof(VulkanFrameUniforms) };
+		VkDescriptorImageInfo atlas = { vkc.sampler, vkc.atlas_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		VkWriteDescriptorSet writes[2] = {};
+		for(int w=0;w<2;w++){
+			writes[w].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writes[w].dstSet = vkc.sets[f];
+			writes[w].dstBinding = w;
+			writes[w].descriptorCount = 1;
+			writes[w].descriptorType = bindings[w].descriptorType;
+		}
+		writes[0].pBufferInfo = &uniforms;
+		writes[1].pImageInfo = &atlas;
+		vkUpdateDescriptorSets(vkc.device, 2, writes, 0, NULL);
+	}
+	return true;
+}
+
+VkShaderModule vulkanLoadShader (const char* path)
+{
+	vector<unsigned char> code;
+	if(!readFile(path, code) || code.empty() || code.size() % 4){
+		cerr << "Could not read " << path << ", make VULKAN=1 compiles it" << endl;
+		return VK_NULL_HANDLE;
+	}
+	VkShaderModuleCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	info.codeSize = code.size();
+	info.pCode = (const uint32_t*)&code[0];
+	VkShaderModule module = VK_NULL_HANDLE;
+	if(vkCreateShaderModule(vkc.device, &info, NULL, &module) != VK_SUCCESS)
+		cerr << "Could not load " << path << endl;
+	return module;
+}
+
+/* Depth-tested triangle lists from one vertex buffer, viewport and scissor are set per view */
+VkPipeline vulkanCreatePipeline (const char* vert, const char* frag, VkPipelineLayout layout,
+		const VkVertexInputAttributeDescription* attributes, int attribute_count, uint32_t stride)
+{
+	VkShaderModule modules[2] = { vulkanLoadShader(vert), vulkanLoadShader(frag) };
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	if(modules[0] && modules[1]){
+		VkPipelineShaderStageCreateInfo stages[2] = {};
+		for(int s=0;s<2;s++){
+			stages[s].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+			stages[s].stage = s ? VK_SHADER_STAGE_FRAGMENT_BIT : VK_SHADER_STAGE_VERTEX_BIT;
+			stages[s].module = modules[s];
+			stages[s].pName = "main";
+		}
+		VkVertexInputBindingDescription binding = { 0, stride, VK_VERTEX_INPUT_RATE_VERTEX };
+		VkPipelineVertexInputStateCreateInfo input = {};
+		input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+		input.vertexBindingDescriptionCount = 1;
+		input.pVertexBindingDescriptions = &binding;
+		input.vertexAttributeDescriptionCount = attribute_count;
+		input.pVertexAttributeDescriptions = attributes;
+		VkPipelineInputAssemblyStateCreateInfo assembly = {};
+		assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+		assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		VkPipelineViewportStateCreateInfo viewport = {};
+		viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+		viewport.viewportCount = 1;
+		viewport.scissorCount = 1;
+		VkPipelineRasterizationStateCreateInfo raster = {};
+		raster.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+		raster.polygonMode = VK_POLYGON_MODE_FILL;
+		raster.cullMode = VK_CULL_MODE_NONE;
+		raster.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+		raster.lineWidth = 1;
+		VkPipelineMultisampleStateCreateInfo multisample = {};
+		multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+		multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+		VkPipelineDepthStencilStateCreateInfo depth = {};
+		depth.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+		depth.depthTestEnable = VK_TRUE;
+		depth.depthWriteEnable = VK_TRUE;
+		depth.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+		VkPipelineColorBlendAttachmentState blend = {};
+		blend.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+		VkPipelineColorBlendStateCreateInfo blending = {};
+		blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+		blending.attachmentCount = 1;
+		blending.pAttachments = &blend;
+		VkDynamicState states[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+		VkPipelineDynamicStateCreateInfo dynamic = {};
+		dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+		dynamic.dynamicStateCount = 2;
+		dynamic.pDynamicStates = states;
+		VkGraphicsPipelineCreateInfo info = {};
+		info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+		info.stageCount = 2;
+		info.pStages = stages;
+		info.pVertexInputState = &input;
+		info.pInputAssemblyState = &assembly;
+		info.pViewportState = &viewport;
+		info.pRasterizationState = &raster;
+		info.pMultisampleState = &multisample;
+		info.pDepthStencilState = &depth;
+		info.pColorBlendState = &blending;
+		info.pDynamicState = &dynamic;
+		info.layout = layout;
+		info.renderPass = vkc.render_pass;
+		if(vkCreateGraphicsPipelines(vkc.device, VK_NULL_HANDLE, 1, &info, NULL, &pipeline) != VK_SUCCESS){
+			cerr << "Could not create the pipeline for " << vert << endl;
+			pipeline = VK_NULL_HANDLE;
+		}
+	}
+	for(int s=0;s<2;s++)
+		vkDestroyShaderModule(vkc.device, modules[s], NULL);
+	return pipeline;
+}
+
+/* Everything the backend needs, the arena meshes and the atlas are taken from the CPU side */
+bool vulkanInit (GLFWwindow* window, int width, int height)
+{
+	vkc.frame = 0;
+	if(!vulkanCreateDevice(window) || !vulkanCreateRenderPass() || !vulkanCreateSwapchain(width, height))
+		return false;
+
+	VkCommandPoolCreateInfo pool = {};
+	pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	pool.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	pool.queueFamilyIndex = vkc.queue_family;
+	VK_TRY(vkCreateCommandPool(vkc.device, &pool, NULL, &vkc.pool));
+	if(!vulkanUploadAtlas(assets.atlas))
+		return false;
+
+	// Same meshes as the GL arena, uploaded once with the indices after the vertices
+	createRectangle();
+	createCam();
+	createFloor();
+	size_t vertex_bytes = arena.vertices.size()*sizeof(GLfloat), index_bytes = arena.indices.size()*sizeof(GLuint);
+	if(!vulkanCreateBuffer(vkc.meshes, vertex_bytes + index_bytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT))
+		return false;
+	memcpy(vkc.meshes.mapped, &arena.vertices[0], vertex_bytes);
+	memcpy((char*)vkc.meshes.mapped + vertex_bytes, &arena.indices[0], index_bytes);
+	vkc.mesh_indices = vertex_bytes;
+	arena.vertices.clear();
+	arena.indices.clear();
+
+	vkc.board_vertices.assign(MAX_CHUNKS*CHUNK_VERTICES, BoardVertex());
+	for(int f=0;f<VK_FRAMES;f++){
+		if(!vulkanCreateBuffer(vkc.board[f], MAX_CHUNKS*CHUNK_VERTICES*sizeof(BoardVertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
+				|| !vulkanCreateBuffer(vkc.uniforms[f], sizeof(VulkanFrameUniforms), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+				|| !vulkanCreateBuffer(vkc.text[f], VK_TEXT_VERTICES*ARENA_VERTEX_FLOATS*sizeof(GLfloat), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT))
+			return false;
+		((VulkanFrameUniforms*)vkc.uniforms[f].mapped)->lineColor = glm::vec4(line_color, 1);
+	}
+	if(!vulkanCreateLayouts())
+		return false;
+
+	VkVertexInputAttributeDescription board[2] = {
+		{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, (uint32_t)offsetof(BoardVertex, position) },
+		{ 1, 0, VK_FORMAT_R32G32B32_SFLOAT, (uint32_t)offsetof(BoardVertex, texCoord) }
+	};
+	VkVertexInputAttributeDescription mesh[2] = {
+		{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
+		{ 1, 0, VK_FORMAT_R32G32B32_SFLOAT, 3*sizeof(GLfloat) }
+	};
+	vkc.board_pipeline = vulkanCreatePipeline("VulkanBoard.vert.spv", "VulkanBoard.frag.spv", vkc.board_layout, board, 2, sizeof(BoardVertex));
+	vkc.mesh_pipeline = vulkanCreatePipeline("VulkanMesh.vert.spv", "VulkanMesh.frag.spv", vkc.mesh_layout, mesh, 2, ARENA_VERTEX_FLOATS*sizeof(GLfloat));
+	if(!vkc.board_pipeline || !vkc.mesh_pipeline)
+		return false;
+
+	VkCommandBufferAllocateInfo alloc = {};
+	alloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	alloc.commandPool = vkc.pool;
+	alloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	alloc.commandBufferCount = VK_FRAMES;
+	VK_TRY(vkAllocateCommandBuffers(vkc.device, &alloc, vkc.primary));
+	alloc.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+	VK_TRY(vkAllocateCommandBuffers(vkc.device, &alloc, vkc.scene));
+	alloc.commandBufferCount = 1;
+	for(int f=0;f<VK_FRAMES;f++){
+		for(int v=0;v<VK_VIEWS;v++){
+			VK_TRY(vkAllocateCommandBuffers(vkc.device, &alloc, &vkc.board_commands[f][v].commands));
+			vkc.board_commands[f][v].version = -1;
+		}
+	}
+
+	VkSemaphoreCreateInfo semaphore = {};
+	semaphore.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	VkFenceCreateInfo fence = {};
+	fence.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fence.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	for(int f=0;f<VK_FRAMES;f++){
+		VK_TRY(vkCreateSemaphore(vkc.device, &semaphore, NULL, &vkc.acquired[f]));
+		VK_TRY(vkCreateSemaphore(vkc.device, &semaphore, NULL, &vkc.rendered[f]));
+		VK_TRY(vkCreateFence(vkc.device, &fence, NULL, &vkc.done[f]));
+	}
+	assets.atlas = AtlasImage();
+	return true;
+}
+
+/* Also cleans up after a failed vulkanInit, so the GL path can start over */
+void vulkanShutdown ()
+{
+	if(vkc.device){
+		vkDeviceWaitIdle(vkc.device);
+		for(int f=0;f<VK_FRAMES;f++){
+			vkDestroySemaphore(vkc.device, vkc.acquired[f], NULL);
+			vkDestroySemaphore(vkc.device, vkc.rendered[f], NULL);
+			vkDestroyFence(vkc.device, vkc.done[f], NULL);
+			vulkanDestroyBuffer(vkc.board[f]);
+			vulkanDestroyBuffer(vkc.uniforms[f]);
+			vulkanDestroyBuffer(vkc.text[f]);
+		}
+		vkDestroyCommandPool(vkc.device, vkc.pool, NULL);
+		vkDestroyPipeline(vkc.device, vkc.board_pipeline, NULL);
+		vkDestroyPipeline(vkc.device, vkc.mesh_pipeline, NULL);
+		vkDestroyPipelineLayout(vkc.device, vkc.board_layout, NULL);
+		vkDestroyPipelineLayout(vkc.device, vkc.mesh_layout, NULL);
+		vkDestroyDescriptorPool(vkc.device, vkc.descriptor_pool, NULL);
+		vkDestroyDescriptorSetLayout(vkc.device, vkc.set_layout, NULL);
+		vkDestroySampler(vkc.device, vkc.sampler, NULL);
+		vkDestroyImageView(vkc.device, vkc.atlas_view, NULL);
+		vkDestroyImage(vkc.device, vkc.atlas, NULL);
+		vkFreeMemory(vkc.device, vkc.atlas_memory, NULL);
+		vulkanDestroyBuffer(vkc.meshes);
+		vulkanDestroyTargets();
+		vkDestroySwapchainKHR(vkc.device, vkc.swapchain, NULL);
+		vkDestroyRenderPass(vkc.device, vkc.render_pass, NULL);
+		vkDestroyDevice(vkc.device, NULL);
+	}
+	if(vkc.instance){
+		vkDestroySurfaceKHR(vkc.instance, vkc.surface, NULL);
+		vkDestroyInstance(vkc.instance, NULL);
+	}
+	vkc = VulkanContext();
+	arena = MeshArena();
+}
+
+/* Viewport and scissor of a view, rects are fractions of the target with y up as in GL */
+void vulkanSetRect (VkCommandBuffer cmd, const float* rect)
+{
+	VkViewport viewport;
+	viewport.x = rect[0]*vkc.extent.width;
+	viewport.y = (1 - rect[1] - rect[3])*vkc.extent.height;
+	viewport.width = rect[2]*vkc.extent.width;
+	viewport.height = rect[3]*vkc.extent.height;
+	viewport.minDepth = 0;
+	viewport.maxDepth = 1;
+	VkRect2D scissor;
+	scissor.offset.x = (int32_t)viewport.x;
+	scissor.offset.y = (int32_t)viewport.y;
+	scissor.extent.width = (uint32_t)viewport.width;
+	scissor.extent.height = (uint32_t)viewport.height;
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+void vulkanBeginSecondary (VkCommandBuffer cmd, VkCommandBufferUsageFlags flags, VkFramebuffer framebuffer)
+{
+	VkCommandBufferInheritanceInfo inheritance = {};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.renderPass = vkc.render_pass;
+	inheritance.framebuffer = framebuffer;
+	VkCommandBufferBeginInfo begin = {};
+	begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | flags;
+	begin.pInheritanceInfo = &inheritance;
+	vkResetCommandBuffer(cmd, 0);
+	vkBeginCommandBuffer(cmd, &begin);
+}
+
+/* Board draws of one view. The whole board goes in: it is a few greedy-meshed chunks, and
+   drawing them all is what lets the commands stay the same from frame to frame */
+void vulkanRecordBoard (VulkanBoardCommands& b, int view, const vector<Chunk>& chunks, int version)
+{
+	VkCommandBuffer cmd = b.commands;
+	vulkanBeginSecondary(cmd, 0, VK_NULL_HANDLE);
+	vulkanSetRect(cmd, vkc.rect);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.board_pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.board_layout, 0, 1, &vkc.sets[vkc.frame], 0, NULL);
+	GLint slot = view;
+	vkCmdPushConstants(cmd, vkc.board_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(slot), &slot);
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vkc.board[vkc.frame].buffer, &offset);
+	for(size_t c=0;c<chunks.size();c++)
+		if(chunks[c].tiles && chunks[c].count)
+			vkCmdDraw(cmd, chunks[c].count, 1, chunks[c].first, 0);
+	vkEndCommandBuffer(cmd);
+	b.version = version;
+	memcpy(b.rect, vkc.rect, sizeof(b.rect));
+}
+
+/* Wait for the slot's last frame, take a swapchain image and start the scene commands */
+bool vulkanBeginFrame (int width, int height)
+{
+	vkc.recording = false;
+	if(vkc.stale || vkc.framebuffers.empty() || width != vkc.window_width || height != vkc.window_height)
+		if(!vulkanRecreateSwapchain(width, height))
+			return false;
+
+	vkWaitForFences(vkc.device, 1, &vkc.done[vkc.frame], VK_TRUE, UINT64_MAX);
+	VkResult acquired = vkAcquireNextImageKHR(vkc.device, vkc.swapchain, UINT64_MAX, vkc.acquired[vkc.frame], VK_NULL_HANDLE, &vkc.image);
+	if(acquired != VK_SUCCESS && acquired != VK_SUBOPTIMAL_KHR){
+		// Out of date, try again with a new swapchain
+		vkc.stale = true;
+		frame.dirty = true;
+		return false;
+	}
+	vkResetFences(vkc.device, 1, &vkc.done[vkc.frame]);
+
+	// The slot's board copy is free now, bring over the chunks other frames re-meshed
+	vector<std::pair<int,int> >& pending = vkc.board_pending[vkc.frame];
+	for(size_t i=0;i<pending.size();i++)
+		memcpy((BoardVertex*)vkc.board[vkc.frame].mapped + pending[i].first, &vkc.board_vertices[pending[i].first], pending[i].second*sizeof(BoardVertex));
+	pending.clear();
+
+	vulkanBeginSecondary(vkc.scene[vkc.frame], VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, vkc.framebuffers[vkc.image]);
+	vkc.view = 0;
+	vkc.text_vertices = 0;
+	vkc.executes.clear();
+	vkc.recording = true;
+	return true;
+}
+
+void vulkanSetViews (const glm::mat4* VPs, const float (*rects)[4], int views)
+{
+	VulkanFrameUniforms* uniforms = (VulkanFrameUniforms*)vkc.uniforms[vkc.frame].mapped;
+	for(int v=0;v<views && vkc.view<VK_VIEWS;v++){
+		vkc.VP = vulkan_clip*VPs[v];
+		uniforms->VP[vkc.view++] = vkc.VP;
+		memcpy(vkc.rect, rects[v], sizeof(vkc.rect));
+		vulkanSetRect(vkc.scene[vkc.frame], vkc.rect);
+	}
+}
+
+/* Older frames may still read their board copies, only the copy of the frame being built is
+   written now. The others pick the chunk up once their own fence has been waited for */
+void vulkanUploadChunk (int first, const vector<BoardVertex>& vertices)
+{
+	if(vertices.empty())
+		return;
+	std::copy(vertices.begin(), vertices.end(), vkc.board_vertices.begin() + first);
+	for(int f=0;f<VK_FRAMES;f++){
+		if(f == vkc.frame && vkc.recording)
+			memcpy((BoardVertex*)vkc.board[f].mapped + first, &vertices[0], vertices.size()*sizeof(BoardVertex));
+		else
+			vkc.board_pending[f].push_back(std::make_pair(first, (int)vertices.size()));
+	}
+}
+
+void vulkanDrawBoard (const vector<Chunk>& chunks, int version)
+{
+	int view = vkc.view - 1;
+	if(view < 0)
+		return;
+	VulkanBoardCommands& b = vkc.board_commands[vkc.frame][view];
+	if(b.version != version || memcmp(b.rect, vkc.rect, sizeof(b.rect)))
+		vulkanRecordBoard(b, view, chunks, version);
+	vkc.executes.push_back(b.commands);
+}
+
+/* Chunk ranges straight into the scene commands, for callers that cull on the CPU */
+void vulkanDrawChunks (const ChunkDraws& draws)
+{
+	VkCommandBuffer cmd = vkc.scene[vkc.frame];
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.board_pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.board_layout, 0, 1, &vkc.sets[vkc.frame], 0, NULL);
+	GLint slot = max(0, vkc.view - 1);
+	vkCmdPushConstants(cmd, vkc.board_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(slot), &slot);
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vkc.board[vkc.frame].buffer, &offset);
+	for(size_t i=0;i<draws.first.size();i++)
+		vkCmdDraw(cmd, draws.count[i], 1, draws.first[i], 0);
+}
+
+void vulkanPushDraw (VkCommandBuffer cmd, const glm::mat4& MVP, const glm::vec4& color, const glm::vec4& edge)
+{
+	VulkanDrawConstants constants;
+	constants.MVP = MVP;
+	constants.color = color;
+	constants.edge = edge;
+	vkCmdPushConstants(cmd, vkc.mesh_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants), &constants);
+}
+
+/* The blocks and the camera marker, one push and one indexed draw each */
+void vulkanDrawMeshes (const vector<ArenaQueued>& draws)
+{
+	if(draws.empty())
+		return;
+	VkCommandBuffer cmd = vkc.scene[vkc.frame];
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.mesh_pipeline);
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vkc.meshes.buffer, &offset);
+	vkCmdBindIndexBuffer(cmd, vkc.meshes.buffer, vkc.mesh_indices, VK_INDEX_TYPE_UINT32);
+	for(size_t i=0;i<draws.size();i++){
+		const ArenaDraw& d = draws[i].draw;
+		glm::mat4 model;
+		memcpy(&model[0][0], d.model, sizeof(d.model));
+		vulkanPushDraw(cmd, vkc.VP*model, glm::vec4(d.color[0], d.color[1], d.color[2], 1), glm::vec4(d.edge[0], d.edge[1], d.edge[2], d.edge[3]));
+		vkCmdDrawIndexed(cmd, draws[i].mesh.indexCount, 1, draws[i].mesh.firstIndex, draws[i].mesh.baseVertex, 0);
+	}
+}
+
+/* The HUD gets a fresh depth buffer and the whole window */
+void vulkanEndScene ()
+{
+	VkCommandBuffer cmd = vkc.scene[vkc.frame];
+	VkClearAttachment clear = {};
+	clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	clear.clearValue.depthStencil.depth = 1;
+	VkClearRect rect = {};
+	rect.rect.extent = vkc.extent;
+	rect.layerCount = 1;
+	vkCmdClearAttachments(cmd, 1, &clear, 1, &rect);
+	static const float full[4] = { 0, 0, 1, 1 };
+	vulkanSetRect(cmd, full);
+}
+
+/* Text from the software renderer's bitmap font, one quad per font pixel, through the mesh pipeline */
+void vulkanDrawText (const char* text, const glm::mat4& MVP, const glm::vec3& color)
+{
+	GLfloat* out = (GLfloat*)vkc.text[vkc.frame].mapped;
+	int first = vkc.text_vertices;
+	static const int corners[6][2] = { {0,0}, {1,0}, {1,1}, {0,0}, {1,1}, {0,1} };
+	for(float x=0;*text;text++, x+=6*VK_TEXT_DOT){
+		const char* found = strchr(soft_font_chars, toupper(*text));
+		if(*text == ' ' || found == NULL)
+			continue;
+		const unsigned char* glyph = soft_font[found - soft_font_chars];
+		for(int row=0;row<7;row++){
+			for(int col=0;col<5 && vkc.text_vertices+6<=VK_TEXT_VERTICES;col++){
+				if(!(glyph[row] & (0x10 >> col)))
+					continue;
+				for(int k=0;k<6;k++){
+					// Barycentrics of 1 keep the edge term away, the quads are plain fill
+					GLfloat v[ARENA_VERTEX_FLOATS] = { x + (col + corners[k][0])*VK_TEXT_DOT, (6 - row + corners[k][1])*VK_TEXT_DOT, 0, 1, 1, 1 };
+					memcpy(out + ARENA_VERTEX_FLOATS*vkc.text_vertices++, v, sizeof(v));
+				}
+			}
+		}
+	}
+	if(vkc.text_vertices == first)
+		return;
+	VkCommandBuffer cmd = vkc.scene[vkc.frame];
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vkc.mesh_pipeline);
+	VkDeviceSize offset = 0;
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vkc.text[vkc.frame].buffer, &offset);
+	vulkanPushDraw(cmd, vulkan_clip*MVP, glm::vec4(color, 1), glm::vec4(color, 1));
+	vkCmdDraw(cmd, vkc.text_vertices - first, 1, first, 0);
+}
+
+/* Run the board commands and the scene in one render pass, submit and present */
+void vulkanPresent ()
+{
+	VkCommandBuffer scene = vkc.scene[vkc.frame], cmd = vkc.primary[vkc.frame];
+	vkEndCommandBuffer(scene);
+	vkc.executes.push_back(scene);
+
+	VkCommandBufferBeginInfo begin = {};
+	begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkResetCommandBuffer(cmd, 0);
+	vkBeginCommandBuffer(cmd, &begin);
+	VkClearValue clears[2];
+	clears[0].color.float32[0] = clears[0].color.float32[1] = clears[0].color.float32[2] = 0.1f;
+	clears[0].color.float32[3] = 0;
+	clears[1].depthStencil.depth = 1;
+	clears[1].depthStencil.stencil = 0;
+	VkRenderPassBeginInfo pass = {};
+	pass.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	pass.renderPass = vkc.render_pass;
+	pass.framebuffer = vkc.framebuffers[vkc.image];
+	pass.renderArea.extent = vkc.extent;
+	pass.clearValueCount = 2;
+	pass.pClearValues = clears;
+	vkCmdBeginRenderPass(cmd, &pass, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	vkCmdExecuteCommands(cmd, vkc.executes.size(), &vkc.executes[0]);
+	vkCmdEndRenderPass(cmd);
+	vkEndCommandBuffer(cmd);
+
+	VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	VkSubmitInfo submit = {};
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.waitSemaphoreCount = 1;
+	submit.pWaitSemaphores = &vkc.acquired[vkc.frame];
+	submit.pWaitDstStageMask = &wait_stage;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &cmd;
+	submit.signalSemaphoreCount = 1;
+	submit.pSignalSemaphores = &vkc.rendered[vkc.frame];
+	vkQueueSubmit(vkc.queue, 1, &submit, vkc.done[vkc.frame]);
+
+	VkPresentInfoKHR present = {};
+	present.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	present.waitSemaphoreCount = 1;
+	present.pWaitSemaphores = &vkc.rendered[vkc.frame];
+	present.swapchainCount = 1;
+	present.pSwapchains = &vkc.swapchain;
+	present.pImageIndices = &vkc.image;
+	VkResult result = vkQueuePresentKHR(vkc.queue, &present);
+	if(result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+		vkc.stale = true;
+	vkc.frame = (vkc.frame + 1) % VK_FRAMES;
+	vkc.recording = false;
+}
+
+/* Backend on the Vulkan device set up by vulkanInit, a skipped frame makes every call a no-op */
+class VulkanBackend : public RenderBackend {
+	public:
+		int maxViews() { return 1; }
+
+		void beginFrame(int width, int height) {
+			render_width = width;
+			render_height = height;
+			vulkanBeginFrame(width, height);
+		}
+
+		void setViews(const glm::mat4* VPs, const float (*rects)[4], int views) {
+			if(vkc.recording)
+				vulkanSetViews(VPs, rects, views);
+		}
+
+		void uploadChunk(int first, const vector<BoardVertex>& vertices) {
+			vulkanUploadChunk(first, vertices);
+		}
+
+		void drawChunks(const ChunkDraws& draws) {
+			if(vkc.recording)
+				vulkanDrawChunks(draws);
+		}
+
+		bool drawBoard(const vector<Chunk>& chunks, int version, const glm::vec3*, bool) {
+			if(vkc.recording)
+				vulkanDrawBoard(chunks, version);
+			return true;
+		}
+
+		void drawMeshes(vector<ArenaQueued>& draws) {
+			if(vkc.recording)
+				vulkanDrawMeshes(draws);
+		}
+
+		/* No cached layer yet, the minimap is left out */
+		bool drawMinimap(const vector<Chunk>&, int, const glm::mat4&, const float*) {
+			return false;
+		}
+
+		void endScene() {
+			if(vkc.recording)
+				vulkanEndScene();
+		}
+
+		void drawText(const char* text, const glm::mat4& MVP, const glm::vec3& color) {
+			if(vkc.recording)
+				vulkanDrawText(text, MVP, color);
+		}
+
+		void present() {
+			if(vkc.recording)
+				vulkanPresent();
+		}
+} vulkan_backend;
+#endif
+
+/* Wall renderer - the boards and blocks of every session on the wall are instances of the
+   arena's cube in one draw, each instance names its session. Wall.vert picks that session's
+   camera and cell of the window from a uniform block and clips to the cell, so one draw
+   covers the whole grid. The HUDs are one instanced draw of the software renderer's font */
+#define WALL_MAX_SESSIONS 64	// also the array size of the Sessions block in Wall.vert
+#define WALL_GAP 2		// pixels between neighbouring cells
+
+// The arena's per-draw data, attribute 4 adds the session
+struct WallInstance {
+	ArenaDraw draw;
+	GLfloat session;
+};
+typedef struct WallInstance WallInstance;
+
+struct WallGlyph {
+	GLfloat rect[4];	// x, y, width, height in normalized device coordinates
+	GLfloat glyph;		// index in soft_font
+};
+typedef struct WallGlyph WallGlyph;
+
+// std140 layout of the Sessions block
+struct WallSessionBlock {
+	GLfloat VP[WALL_MAX_SESSIONS][16];
+	GLfloat cell[WALL_MAX_SESSIONS][4];	// scale in x and y, then the centre, in normalized device coordinates
+};
+typedef struct WallSessionBlock WallSessionBlock;
+
+struct WallRenderer {
+	GLuint program, text_program;
+	GLint text_color;
+	GpuHandle VertexArray, InstanceBuffer, SessionBuffer;
+	GpuHandle TextArray, TextBuffer;
+	vector<WallInstance> instances;	// both block halves of every session, then the tiles of every board
+	vector<int> board_versions;	// of the tiles in instances, per session
+	vector<WallGlyph> glyphs;
+	glm::vec3 block_scale[2], block_color[2];	// the simulation thread swaps cube, so they are copied first
+	WallRenderer() : program(0), text_program(0), text_color(-1) {}
+} wall;
+
+/* Programs and buffers of the wall, after initGL. False when the shaders do not build */
+bool createWallRenderer (int sessions)
+{
+	wall.program = adoptProgram(LoadShaders( "Wall.vert", "Sample_GL.frag" ));
+	wall.text_program = adoptProgram(LoadShaders( "WallText.vert", "WallText.frag" ));
+	if(wall.program == 0 || wall.text_program == 0)
+		return false;
+	wall.board_versions.assign(sessions, -1);
+	for(int k=0;k<2;k++){
+		wall.block_scale[k] = cube[k].scale;
+		wall.block_color[k] = glm::vec3(cube[k].color.r, cube[k].color.g, cube[k].color.b);
+	}
+
+	glUniformBlockBinding(wall.program, glGetUniformBlockIndex(wall.program, "Sessions"), 0);
+	wall.SessionBuffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+	wall.SessionBuffer.bufferData(GL_UNIFORM_BUFFER, sizeof(WallSessionBlock), NULL, GL_STREAM_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, wall.SessionBuffer.id);
+	countGLCalls(3);
+
+	// Rows 0-3 of a glyph in x and 4-6 in y, the way WallText.frag unpacks them
+	int glyphs = sizeof(soft_font)/sizeof(soft_font[0]);
+	vector<GLint> font(2*glyphs, 0);
+	for(int g=0;g<glyphs;g++)
+		for(int row=0;row<7;row++)
+			font[2*g + row/4] |= soft_font[g][row] << 5*(row%4);
+	useProgram(wall.text_program);
+	glUniform2iv(glGetUniformLocation(wall.text_program, "font"), glyphs, &font[0]);
+	wall.text_color = glGetUniformLocation(wall.text_program, "textColor");
+	countGLCalls(3);
+
+	// The cube comes from the arena's buffers, the instances from the wall's own
+	wall.VertexArray = GpuHandle(GPU_VERTEX_ARRAY, GPU_MESHES);
+	bindVertexArray(wall.VertexArray.id);
+	bindArrayBuffer(arena.VertexBuffer.id);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, ARENA_VERTEX_FLOATS*sizeof(GLfloat), (void*)0);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, ARENA_VERTEX_FLOATS*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.IndexBuffer.id);
+	wall.InstanceBuffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+	bindArrayBuffer(wall.InstanceBuffer.id);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(WallInstance), (void*)(offsetof(WallInstance, draw) + offsetof(ArenaDraw, color)));
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(WallInstance), (void*)(offsetof(WallInstance, draw) + offsetof(ArenaDraw, edge)));
+	glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(WallInstance), (void*)offsetof(WallInstance, session));
+	for(int c=0;c<4;c++)
+		glVertexAttribPointer(5+c, 4, GL_FLOAT, GL_FALSE, sizeof(WallInstance), (void*)(offsetof(WallInstance, draw) + offsetof(ArenaDraw, model) + 4*c*sizeof(GLfloat)));
+	static const int per_instance[] = { 1, 2, 4, 5, 6, 7, 8 };
+	for(int a=0;a<7;a++){
+		glEnableVertexAttribArray(per_instance[a]);
+		glVertexAttribDivisor(per_instance[a], 1);
+	}
+	countGLCalls(26);
+
+	wall.TextArray = GpuHandle(GPU_VERTEX_ARRAY, GPU_MESHES);
+	bindVertexArray(wall.TextArray.id);
+	wall.TextBuffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+	bindArrayBuffer(wall.TextBuffer.id);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(WallGlyph), (void*)offsetof(WallGlyph, rect));
+	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(WallGlyph), (void*)offsetof(WallGlyph, glyph));
+	for(int a=0;a<2;a++){
+		glEnableVertexAttribArray(a);
+		glVertexAttribDivisor(a, 1);
+	}
+	countGLCalls(6);
+	return true;
+}
+
+WallInstance wallInstance (const glm::mat4& model, const glm::vec3& color, int session)
+{
+	WallInstance instance;
+	memcpy(instance.draw.color, &color[0], sizeof(instance.draw.color));
+	memcpy(instance.draw.edge, &line_color[0], 3*sizeof(GLfloat));
+	instance.draw.edge[3] = 1;
+	memcpy(instance.draw.model, &model[0][0], sizeof(instance.draw.model));
+	instance.session = session;
+	return instance;
+}
+
+/* Text with the top left corner at pixel x, y (y up), dot is the size of one font pixel */
+void wallText (float x, float y, float dot, const char* text, int fbwidth, int fbheight)
+{
+	for(;*text;text++, x+=6*dot){
+		const char* found = strchr(soft_font_chars, toupper(*text));
+		if(*text == ' ' || found == NULL)
+			continue;
+		WallGlyph g = { { 2*x/fbwidth - 1, 2*(y - 7*dot)/fbheight - 1, 10*dot/fbwidth, 14*dot/fbheight }, (GLfloat)(found - soft_font_chars) };
+		wall.glyphs.push_back(g);
+	}
+}
+
+/* The sessions' latest snapshots in a grid filling the window, row by row from the top left */
+void drawWall (const GameSnapshot* const* snaps, int count, int fbwidth, int fbheight)
+{
+	int columns = (int)ceil(sqrt((double)count)), rows = (count + columns - 1)/columns;
+	float cell_width = (float)fbwidth/columns, cell_height = (float)fbheight/rows;
+	float w = max(1.0f, cell_width - WALL_GAP), h = max(1.0f, cell_height - WALL_GAP);
+	glm::mat4 projection = glm::perspective((float)(M_PI/2), w/h, 0.1f, 500.0f);
+	float dot = max(1.0f, floorf(cell_height/90));
+
+	static WallSessionBlock block;
+	bool boards_changed = false;
+	if(wall.instances.size() < (size_t)2*count)
+		wall.instances.resize(2*count);
+	wall.glyphs.clear();
+	for(int s=0;s<count;s++){
+		const GameSnapshot& snap = *snaps[s];
+		boards_changed |= snap.board_version != wall.board_versions[s];
+
+		glm::mat4 VP = projection * glm::lookAt(snap.eye[snap.choice], snap.target[snap.choice], snap.up[snap.choice]);
+		memcpy(block.VP[s], &VP[0][0], sizeof(block.VP[s]));
+		float x = (s % columns)*cell_width + WALL_GAP/2.0f, y = fbheight - (s/columns + 1)*cell_height + WALL_GAP/2.0f;
+		block.cell[s][0] = w/fbwidth;
+		block.cell[s][1] = h/fbheight;
+		block.cell[s][2] = (2*x + w)/fbwidth - 1;
+		block.cell[s][3] = (2*y + h)/fbheight - 1;
+
+		for(int k=0;k<2;k++)
+			wall.instances[2*s+k] = wallInstance(blockModel(snap, k, wall.block_scale[k]), wall.block_color[k], s);
+
+		char line[64];
+		snprintf(line, sizeof(line), "SCORE %d", snap.score);
+		wallText(x + 2*dot, y + h - 2*dot, dot, line, fbwidth, fbheight);
+		snprintf(line, sizeof(line), "STEPS %d TIME %d%s", snap.moves, snap.timer, snap.game_over ? " DONE" : "");
+		wallText(x + 2*dot, y + h - 11*dot, dot, line, fbwidth, fbheight);
+	}
+
+	// Tiles only change with a board, the block halves in front of them are rewritten every frame
+	if(boards_changed){
+		wall.instances.resize(2*count);
+		glm::mat4 tileScale = glm::scale(glm::mat4(1.0f), floor_grey.scale);
+		for(int s=0;s<count;s++){
+			const GameSnapshot& snap = *snaps[s];
+			for(int i=0;i<snap.dim;i++)
+				for(int j=0;j<snap.dim;j++)
+					if(snap.boardMatrix[i][j] != 0){
+						glm::mat4 model = glm::translate(glm::vec3(floor_grey.pos.x+i, floor_grey.pos.y+j, floor_grey.pos.z))*tileScale;
+						wall.instances.push_back(wallInstance(model, getTileColor(snap.boardMatrix[i][j]), s));
+					}
+			wall.board_versions[s] = snap.board_version;
+		}
+		wall.InstanceBuffer.bufferData(GL_ARRAY_BUFFER, wall.instances.size()*sizeof(WallInstance), &wall.instances[0], GL_DYNAMIC_DRAW);
+	}
+	else{
+		bindArrayBuffer(wall.InstanceBuffer.id);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, 2*count*sizeof(WallInstance), &wall.instances[0]);
+		countGLCalls();
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, wall.SessionBuffer.id);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+
+	glViewport(0, 0, fbwidth, fbheight);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	for(int p=0;p<4;p++)
+		glEnable(GL_CLIP_DISTANCE0 + p);
+	useProgram(wall.program);
+	bindVertexArray(wall.VertexArray.id);
+	polygonMode(GL_FILL);
+	// Only the faces turned towards each camera are rasterized, which is most of the cost with thousands of cubes
+	glEnable(GL_CULL_FACE);
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, cube_mesh.indexCount, GL_UNSIGNED_INT, (void*)(cube_mesh.firstIndex*sizeof(GLuint)), wall.instances.size(), cube_mesh.baseVertex);
+	glDisable(GL_CULL_FACE);
+	for(int p=0;p<4;p++)
+		glDisable(GL_CLIP_DISTANCE0 + p);
+	countGLCalls(15);
+
+	if(wall.glyphs.empty())
+		return;
+	// Text goes over the boards
+	glDisable(GL_DEPTH_TEST);
+	useProgram(wall.text_program);
+	glm::vec3 color = getRGBfromHue(0);
+	glUniform3fv(wall.text_color, 1, &color[0]);
+	bindVertexArray(wall.TextArray.id);
+	wall.TextBuffer.bufferData(GL_ARRAY_BUFFER, wall.glyphs.size()*sizeof(WallGlyph), &wall.glyphs[0], GL_STREAM_DRAW);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, wall.glyphs.size());
+	glEnable(GL_DEPTH_TEST);
+	countGLCalls(4);
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1688,434 +5242,1905 @@ void draw (GLFWwindow* window, float x, float y, float w, float h, int doM, int
 GLFWwindow* initGLFW (int width, int height){
 	GLFWwindow* window; // window desciptor/handle
 
-	glfwSetErrorCallback(error_callback);
-	if (!glfwInit()) {
-		exit(EXIT_FAILURE);
+	glfwSetErrorCallback(error_callback);
+	if (!glfwInit()) {
+		exit(EXIT_FAILURE);
+	}
+
+	glfwDefaultWindowHints();
+	if(use_vulkan){
+		// The Vulkan backend makes its own swapchain, the window gets no GL context
+		glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+	}
+	else{
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	}
+
+	if(hidden_window)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+
+	if (!window) {
+		exit(EXIT_FAILURE);
+		glfwTerminate();
+	}
+
+	if(!use_vulkan){
+		glfwMakeContextCurrent(window);
+		//    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+		glfwSwapInterval( frame.swap_interval );
+	}
+	glfwSetFramebufferSizeCallback(window, reshapeWindow);
+	glfwSetWindowSizeCallback(window, reshapeWindow);
+	glfwSetWindowCloseCallback(window, quit);
+	glfwSetKeyCallback(window, keyboard);      // general keyboard input
+	glfwSetCharCallback(window, keyboardChar);  // simpler specific character handling
+	glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+	glfwSetWindowRefreshCallback(window, refreshWindow);  // window exposed, contents need a redraw
+
+	return window;
+}
+
+/* Initialize the OpenGL rendering properties */
+/* Add all the models to be created here */
+void releaseGpuResources ()
+{
+	delete GL3Font.font;
+	GL3Font.font = NULL;
+	board_mesh = BoardMesh();
+	board_compute = BoardCompute();
+	atlas_texture.reset();
+	dynres = DynamicResolution();
+	minimap_layer = MinimapLayer();
+	wall = WallRenderer();
+	arena = MeshArena();
+	gpu_vaos.clear();
+	gpu_programs.clear();
+	programID = fontProgramID = textureProgramID = multiviewProgramID = 0;
+}
+
+void initGL (GLFWwindow* window, int width, int height)
+{
+	finishAssetLoading();
+
+	/* Objects should be created before any other gl function and shaders */
+	// Create the models
+	createRectangle ();
+	createCam();
+	createFloor();
+	uploadArena();
+	// Vertex buffer the greedy board mesh is uploaded into, chunk by chunk
+	createBoardMesh();
+
+	// Create and compile our GLSL program from the shaders
+	programID = adoptProgram(LoadShaders( "Sample_GL.vert", "Sample_GL.frag" ));
+	// Get a handle for our "MVP" uniform
+	Matrices.MatrixID = glGetUniformLocation(programID, "VP");
+
+	// Split view program, geometry shader invocations need GL 4.0 and viewport arrays GL 4.1
+	if(GLEW_VERSION_4_1)
+		multiviewProgramID = adoptProgram(LoadShaders( "MultiView.vert", "MultiView.geom", "Sample_GL.frag" ));
+	multiview_supported = multiviewProgramID != 0;
+
+	// Textured board mesh
+	textureProgramID = adoptProgram(LoadShaders( "TextureRender.vert", "TextureRender.frag" ));
+	tile_program = loadTileProgram(textureProgramID);
+	if(multiview_supported)
+		tile_multiview_program = loadTileProgram(adoptProgram(LoadShaders( "TextureRender.vert", "TextureMultiView.geom", "TextureRender.frag" )));
+
+	atlas_texture = uploadAtlas(assets.atlas);
+	assets.atlas = AtlasImage();
+
+	// Board culling in a compute shader, storage buffers and multi-draw indirect need GL 4.3
+	if(GLEW_VERSION_4_3 && !cpu_board)
+		createBoardCompute();
+	if(multiview_supported){
+		Matrices.ViewProjectionID = glGetUniformLocation(multiviewProgramID, "VP");
+	}
+
+
+	reshapeWindow (window, width, height);
+
+	// Background color of the scene
+	glClearColor (0.1f, 0.1f, 0.1f, 0.0f); // R, G, B, A
+	glClearDepth (1.0f);
+
+	glEnable (GL_DEPTH_TEST);
+	glDepthFunc (GL_LEQUAL);
+	// glEnable(GL_BLEND);
+	// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// Initialise FTGL stuff, the font file was read into memory by the loader
+	const char* fontfile = "arial.ttf";
+	GL3Font.font = new FTExtrudeFont(assets.font.empty() ? NULL : &assets.font[0], assets.font.size()); // 3D extrude style rendering
+
+	if(assets.font.empty() || GL3Font.font->Error())
+	{
+		cout << "Error: Could not load font `" << fontfile << "'" << endl;
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
+
+	// Create and compile our GLSL program from the font shaders
+	fontProgramID = adoptProgram(LoadShaders( "fontrender.vert", "fontrender.frag" ));
+	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
+	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
+	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
+	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
+	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
+	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
+
+	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
+	GL3Font.font->FaceSize(1);
+	GL3Font.font->Depth(0);
+	GL3Font.font->Outset(0, 0);
+	GL3Font.font->CharMap(ft_encoding_unicode);
+	// FTGL set up its own objects
+	invalidateGLState();
+
+	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
+	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
+	cout << "VERSION: " << glGetString(GL_VERSION) << endl;
+	cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+}
+int fall_checker(){
+	if(boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==0 || (int)cube[0].pos.y>=dim ||(int)cube[0].pos.y<0 
+		||  (int)cube[0].pos.x>=dim || (int)cube[0].pos.x<0   )
+	{
+		playSound("pin.wav");
+		return 0;
+	}
+	if(boardMatrix[(int)cube[1].pos.x][(int)cube[1].pos.y]==0 || (int)cube[1].pos.y>=dim ||(int)cube[1].pos.y<0 
+		||  (int)cube[1].pos.x>=dim || (int)cube[1].pos.x<0  )
+
+		{
+			playSound("pin.wav");
+			return 1;
+		}
+	return -1;	
+}
+int hola,other;
+void merge_checker(){
+	if((abs((int)cube[0].pos.y - (int)cube[1].pos.y)==1&&abs((int)cube[0].pos.x - (int)cube[1].pos.x)==0) || (abs((int)cube[0].pos.y - (int)cube[1].pos.y)==0 &&abs((int)cube[0].pos.x - (int)cube[1].pos.x)==1) ){
+		if(merged==0 && toppling==0 && falling==0){
+			merged=1;
+		}
+	}
+}
+void black_checker(){
+	if(cube[0].pos.y==cube[1].pos.y && cube[0].pos.x ==cube[1].pos.x && abs(cube[0].pos.z-cube[1].pos.z)==1 && merged==1 && falling ==0 && boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==9){
+		falling = 1;
+		hola=0;
+		other=1;
+		right_move=true;
+		playSound("pin.wav");
+		startLevelPreload(current_level+1);
+
+	}
+}
+void orange_checker(){
+	if(cube[0].pos.y==cube[1].pos.y && cube[0].pos.x ==cube[1].pos.x && abs(cube[0].pos.z-cube[1].pos.z)==1&& toppling ==0 && merged==1 && falling ==0 && boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==2){
+		falling = 1;
+		hola=0;
+		other=1;
+	}
+}
+void cross_checker(){
+	if(!(merged==1 && falling ==0 && toppling ==0 &&
+		cube[0].pos.y==cube[1].pos.y && 
+		cube[0].pos.x==cube[1].pos.x))
+		return;
+	unordered_map<int,int>::iterator found = cross_cells.find(cellKey(cube[0].pos));
+	if(found == cross_cells.end())
+		return;
+	cross_struct& cw = levels[current_level].crosses[found->second];
+	cube[0].pos = cw.place;
+	cube[1].pos = cw.other;
+	merged=0;
+	chosen=0;
+	// The halves landed somewhere new, look at them again next tick
+	rules_pending=true;
+}
+void press_switch(int key){
+	unordered_map<int,vector<int> >::iterator found = switch_cells.find(key);
+	if(found == switch_cells.end())
+		return;
+	for(size_t i=0;i<found->second.size();i++){
+		switch_struct& sw = levels[current_level].switches[found->second[i]];
+		if(sw.used==false){
+			sw.used=true;
+			for(vector<glm::vec3>::iterator it2 = sw.locations.begin();it2< sw.locations.end();it2++){
+				boardMatrix[(int)it2->x][(int)it2->y]=1;
+			}
+			board_version++;
+		}
+	}
+}
+void switch_checker(){
+	if(falling !=0 || toppling !=0)
+		return;
+	int key0 = cellKey(cube[0].pos), key1 = cellKey(cube[1].pos);
+	press_switch(key0);
+	if(key1 != key0)
+		press_switch(key1);
+}
+void fall_rule(){
+	//faller
+	int fallen = fall_checker();
+	if(fallen!=-1 && toppling==0 && falling == 0){
+		hola = fallen;
+		other = 1-hola;
+		if(merged==1){
+			if(cube[other].pos.x == cube[hola].pos.x && cube[other].pos.y != cube[hola].pos.y){
+				int temp=1;
+			}
+			else if(cube[other].pos.y == cube[hola].pos.y && cube[other].pos.x != cube[hola].pos.x){
+				int temp=1;
+			}
+			else{
+				cube[other].pos.x = cube[hola].pos.x;
+				cube[other].pos.y = cube[hola].pos.y;
+				cube[other].pos.z = floor_grey.scale.z + cube[other].scale.z; 
+				cube[ hola].pos.z = floor_grey.scale.z + 3*cube[other].scale.z;
+			}
+		
+		}
+		toppling = 0;
+		falling  = 1;
+	} 
+}
+
+/* Rules fired when the block settles, in the order the per-frame checkers used to run */
+typedef void (*Rule)();
+static const Rule settle_rules[] = {
+	merge_checker,
+	orange_checker,
+	black_checker,
+	cross_checker,
+	switch_checker,
+	fall_rule,
+};
+
+void runRules(){
+	for(unsigned i=0;i<sizeof(settle_rules)/sizeof(settle_rules[0]);i++)
+		settle_rules[i]();
+}
+
+/* Advance the running topple animation by one step */
+void toppleStep(){
+	if(toppling == 1){
+		if(merged==1)
+			CuboidToppleNorth();
+		else
+			CubeToppleNorth();
+	}
+	if(toppling == 2){
+		if(merged==1)
+			CuboidToppleSouth();
+		else
+			CubeToppleSouth();
+	}
+	if(toppling == 3){
+		if(merged==1)
+			CuboidToppleWest();
+		else
+			CubeToppleWest();
+	}
+	if(toppling == 4){
+		if(merged==1)
+			CuboidToppleEast();
+		else
+			CubeToppleEast();
+	}
+}
+
+void gameEngine(){
+	if(rules_pending && toppling==0 && falling==0){
+		rules_pending=false;
+		runRules();
+	}
+	changeview();
+	
+	if(falling ==1){
+		if(merged==1){
+			cube[other].pos.z -=0.1;
+			cube[hola].pos.z -=0.1;
+			if(cube[hola].pos.z <=-10){
+				falling = 0;
+				Initialize();
+			}
+		}
+		else{
+			cube[dom].pos.z -=0.1;
+			if(cube[dom].pos.z <=-10){
+				falling = 0;
+				Initialize();
+			}
+		}	
+	}
+	// Replay a buffered move once the rules have seen the settled block,
+	// or keep rolling while an arrow key is held down
+	if(toppling==0 && falling==0 && move_queue_count>0)
+		CubeActivateTopple(popMove());
+	else if(toppling==0 && falling==0 && !rules_pending && heldMove())
+		CubeActivateTopple(heldMove());
+
+	// Catch up faster while more moves are waiting
+	int steps = move_queue_count>0 ? topple_speedup : 1;
+	for(int k=0;k<steps && toppling!=0 && falling==0;k++){
+		toppleStep();
+		if(toppling==0)
+			rules_pending=true;
+	}
+}
+void Level_creator(){
+	//Level1
+	Level_struct curr;
+	int m1[10][10] = {
+		{1,1,2,0,0,0,0,0,0,0},
+		{1,1,1,1,2,1,0,0,0,0},
+		{1,1,1,1,1,1,1,1,1,0},
+		{0,1,1,1,1,1,1,1,1,1},
+		{0,0,0,0,0,1,1,9,1,1},
+		{0,0,0,0,0,0,1,1,1,0},
+		{0,0,0,0,0,0,0,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0}
+	};
+	for(int i=0;i<dim;i++){
+		for(int j=0;j<dim;j++){
+			curr.levelMatrix[i][j] = m1[i][j];
+		}
+	}
+	curr.dim = 10;
+	curr.cube0_pos = glm::vec3(0,0,floor_grey.scale.z+ cube[0].scale.z);
+	curr.cube1_pos = glm::vec3(0,1,floor_grey.scale.z+ cube[0].scale.z);
+	levels.push_back(curr);
+
+	//Level2
+	int m2[10][10] = {
+		{1,1,1,1,0,0,0,1,1,1},
+		{1,1,1,1,0,0,0,1,9,1},
+		{1,1,1,1,0,0,0,1,1,1},
+		{1,1,1,1,0,0,1,1,1,1},
+		{0,0,0,0,1,1,1,0,0,0},
+		{0,0,0,0,1,1,1,0,0,0},
+		{0,0,0,0,1,1,1,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0},
+		{0,0,0,0,0,0,0,0,0,0}
+	};
+	for(int i=0;i<dim;i++){
+		for(int j=0;j<dim;j++){
+			curr.levelMatrix[i][j] = m2[i][j];
+		}
+	}
+
+	switch_struct sw;
+	sw.used=false;
+	sw.place = glm::vec3(2,2,0);
+	sw.locations.push_back(glm::vec3(3,4,0));
+	curr.switches.push_back(sw);
+
+
+	cross_struct cw;
+	cw.place = glm::vec3(6,4,floor_grey.scale.z+ cube[0].scale.z);
+	cw.other = glm::vec3(4,6,floor_grey.scale.z+ cube[0].scale.z);
+	curr.crosses.push_back(cw);
+
+	levels.push_back(curr);
+	Level_struct curr2;
+
+	int m3[10][10] = {
+		{1,1,1,1,2,2,2,2,0,0},
+		{1,1,1,1,2,2,2,2,0,0},
+		{1,1,1,1,0,0,0,1,1,1},
+		{1,1,1,1,0,0,0,0,1,1},
+		{0,0,0,0,0,0,0,0,1,1},
+		{0,0,0,0,0,0,2,2,2,2},
+		{0,1,1,1,1,1,2,2,2,2},
+		{0,1,1,1,1,1,2,1,2,2},
+		{0,1,9,1,0,0,2,2,2,2},
+		{0,1,1,1,0,0,0,0,0,0}
+	};
+	for(int i=0;i<dim;i++){
+		for(int j=0;j<dim;j++){
+			curr2.levelMatrix[i][j] = m3[i][j];
+		}
+	}
+
+	switch_struct sw1;
+	sw1.used=false;
+	sw1.place = glm::vec3(2,7,0);
+	sw1.locations.push_back(glm::vec3(4,1,0));
+	sw1.locations.push_back(glm::vec3(5,1,0));
+	curr2.switches.push_back(sw1);
+	curr2.dim = 10;
+	curr2.cube0_pos = glm::vec3(0,0,floor_grey.scale.z+ cube[0].scale.z);
+	curr2.cube1_pos = glm::vec3(0,1,floor_grey.scale.z+ cube[0].scale.z);
+
+	levels.push_back(curr2);
+}
+void computeView(int view, glm::vec3& eye_vec, glm::vec3& target_vec, glm::vec3& up_vec){
+	if(view==0){
+		//Tower View
+		eye_vec.x=0;eye_vec.y=-2;eye_vec.z=10;
+		target_vec.x=0,target_vec.y=0,target_vec.z=0;
+		up_vec.x=0,up_vec.y=0,up_vec.z=1;
+	}
+	if(view==1){
+		//Top View
+		eye_vec.x=0;eye_vec.y=0;eye_vec.z=10;
+		target_vec.x=0,target_vec.y=0,target_vec.z=0;
+		up_vec.x=0,up_vec.y=1,up_vec.z=0;
+	}
+	if(view==2){
+		//Followcam view
+		float follow_cam_rotation=270.0f;
+		eye_vec.x=cube[1].pos.x+5.0*cos(follow_cam_rotation*M_PI/180.0f);eye_vec.y=cube[1].pos.y+5.0*sin(follow_cam_rotation*M_PI/180.0f);eye_vec.z=5.0;
+		target_vec.x=cube[1].pos.x+2.0*cos(follow_cam_rotation*M_PI/180.0f),target_vec.y=cube[1].pos.y+2.0*sin(follow_cam_rotation*M_PI/180.0f),target_vec.z=3.0;
+		up_vec.x=0,up_vec.y=0,up_vec.z=0.1;
+	}
+	if(view==3){
+		//Helicopter View,
+
+		eye_vec.x=5*cos(camera_rotation_angle_x*M_PI/180.0f);
+		eye_vec.y=5*cos(camera_rotation_angle_y*M_PI/180.0f);
+		eye_vec.z=5*sin(camera_rotation_angle_y*M_PI/180.0f)+5*sin(camera_rotation_angle_x*M_PI/180.0f);
+		target_vec.x=a1;
+		target_vec.y=a2;
+		target_vec.z=0;
+		up_vec.x=0,up_vec.y=1,up_vec.z=0;
 	}
+}
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+void changeview(){
+	computeView(choice, eye_vec, target_vec, up_vec);
+}
 
-	window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
+/* True when two snapshots would draw the same frame */
+bool sameFrame(const GameSnapshot& a, const GameSnapshot& b){
+	if(a.board_version != b.board_version || a.choice != b.choice || a.split_view != b.split_view || a.minimap != b.minimap)
+		return false;
+	for(int k=0;k<2;k++)
+		if(a.cube_pos[k] != b.cube_pos[k] || a.cube_theta[k] != b.cube_theta[k])
+			return false;
+	for(int v=0;v<4;v++)
+		if(a.eye[v] != b.eye[v] || a.target[v] != b.target[v] || a.up[v] != b.up[v])
+			return false;
+	return a.camera_rotation_angle_x == b.camera_rotation_angle_x && a.camera_rotation_angle_y == b.camera_rotation_angle_y &&
+		a.score == b.score && a.moves == b.moves && a.timer == b.timer &&
+		a.paused == b.paused && a.game_over == b.game_over;
+}
 
-	if (!window) {
-		exit(EXIT_FAILURE);
-		glfwTerminate();
+/* Copy what sameFrame compares, board_version stands in for the board */
+void keepFrame(GameSnapshot& kept, const GameSnapshot& snap){
+	kept.board_version = snap.board_version;
+	kept.choice = snap.choice;
+	kept.split_view = snap.split_view;
+	kept.minimap = snap.minimap;
+	for(int k=0;k<2;k++){
+		kept.cube_pos[k] = snap.cube_pos[k];
+		kept.cube_theta[k] = snap.cube_theta[k];
 	}
+	for(int v=0;v<4;v++){
+		kept.eye[v] = snap.eye[v];
+		kept.target[v] = snap.target[v];
+		kept.up[v] = snap.up[v];
+	}
+	kept.camera_rotation_angle_x = snap.camera_rotation_angle_x;
+	kept.camera_rotation_angle_y = snap.camera_rotation_angle_y;
+	kept.score = snap.score;
+	kept.moves = snap.moves;
+	kept.timer = snap.timer;
+	kept.paused = snap.paused;
+	kept.game_over = snap.game_over;
+}
 
-	glfwMakeContextCurrent(window);
-	//    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-	glfwSwapInterval( 1 );
-	glfwSetFramebufferSizeCallback(window, reshapeWindow);
-	glfwSetWindowSizeCallback(window, reshapeWindow);
-	glfwSetWindowCloseCallback(window, quit);
-	glfwSetKeyCallback(window, keyboard);      // general keyboard input
-	glfwSetCharCallback(window, keyboardChar);  // simpler specific character handling
-	glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+/* Copy the state the renderer needs into a snapshot slot */
+void fillSnapshot(GameSnapshot& snap){
+	// Slots rotate, so a slot only needs the board when it holds an older version
+	snap.dim = dim;
+	if(snap.board_version != board_version){
+		for(int i=0;i<dim;i++)
+			memcpy(snap.boardMatrix[i], boardMatrix[i], dim*sizeof(int));
+		snap.board_version = board_version;
+	}
+	for(int k=0;k<2;k++){
+		snap.cube_pos[k] = cube[k].pos;
+		snap.cube_theta[k] = cube[k].theta;
+	}
+	snap.choice = choice;
+	snap.split_view = split_view;
+	snap.minimap = minimap;
+	for(int v=0;v<4;v++)
+		computeView(v, snap.eye[v], snap.target[v], snap.up[v]);
+	snap.camera_rotation_angle_x = camera_rotation_angle_x;
+	snap.camera_rotation_angle_y = camera_rotation_angle_y;
+	snap.score = score;
+	snap.moves = moves[current_level];
+	snap.timer = timer[current_level];
+	snap.paused = paused;
+	snap.game_over = game_over;
+}
 
-	return window;
+/* Fill the next snapshot slot, nothing is published when the frame would look the same as the last one */
+bool publishSnapshot(){
+	static bool published = false;
+	static GameSnapshot last;
+	GameSnapshot& snap = snapshots.writeBuffer();
+	fillSnapshot(snap);
+
+	if(published && sameFrame(snap, last))
+		return false;
+	keepFrame(last, snap);
+	published = true;
+
+	snapshots.publish();
+	return true;
 }
 
-/* Initialize the OpenGL rendering properties */
-/* Add all the models to be created here */
-void initGL (GLFWwindow* window, int width, int height)
+/* Nothing animates until the next input or the next timer second */
+bool simulationIdle(){
+	if(paused || game_over)
+		return true;
+	return toppling==0 && falling==0 && !rules_pending && move_queue_count==0;
+}
+
+/* Without a window the render thread waits on render_wakeup */
+void wakeRenderer (GLFWwindow* window){
+	if(window){
+		glfwPostEmptyEvent();
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(render_wait_mutex);
+		render_pending = true;
+	}
+	render_wakeup.notify_one();
+}
+
+void requestClose (GLFWwindow* window){
+	if(window){
+		glfwSetWindowShouldClose(window, GLFW_TRUE);
+		return;
+	}
+	close_requested = true;
+	wakeRenderer(window);
+}
+
+/* Fixed rate game logic, independent of how long the render thread takes to swap */
+void simulationLoop (GLFWwindow* window){
+	using namespace std::chrono;
+	steady_clock::duration tick = duration_cast<steady_clock::duration>(duration<double>(SIM_TICK));
+	steady_clock::time_point next_tick = steady_clock::now();
+	steady_clock::time_point last_update = next_tick;
+	int hol_time=0;
+
+	while(sim_running){
+		processInput(inputClock());
+
+		if(!paused && !game_over){
+			gameEngine();
+		}
+
+		if (steady_clock::now() - last_update >= seconds(1)) {
+			if(!paused)
+				timer[current_level]+=1;
+			last_update = steady_clock::now();
+			if(game_over){
+				if(hol_time==0)
+					cout << "Press r to restart or q to quit"<<endl;
+				hol_time++;
+				if(hol_time>5)
+					requestClose(window);
+			}
+		}
+
+		// Wake the render thread only when there is something new to draw
+		if(publishSnapshot())
+			wakeRenderer(window);
+
+		if(simulationIdle()){
+			// Sleep until input arrives or the HUD timer needs its next second
+			std::unique_lock<std::mutex> lock(sim_wait_mutex);
+			sim_wakeup.wait_until(lock, last_update + seconds(1), [] { return input_queue.front() != NULL || !sim_running; });
+			next_tick = steady_clock::now();
+			continue;
+		}
+		next_tick += tick;
+		std::this_thread::sleep_until(next_tick);
+	}
+}
+
+void startSimulation (GLFWwindow* window){
+	sim_running = true;
+	sim_thread = std::thread(simulationLoop, window);
+}
+
+void stopSimulation (){
+	if(!sim_thread.joinable())
+		return;
+	sim_running = false;
+	wakeSimulation();
+	sim_thread.join();
+}
+/* Headless batch rendering, never touches GL or GLFW:
+	--soft-render out.ppm [--level N] [--view V] [--split] [--size WxH] [--frames N] [--threads N]
+   Renders the start of a level with the software renderer, N frames for timing, and writes the last */
+int softRenderMain (int argc, char** argv)
 {
-	/* Objects should be created before any other gl function and shaders */
-	// Create the models
-	createRectangle ();
-	createCam();
-	createFloor();
+	if(argc < 1){
+		cerr << "--soft-render needs an output file" << endl;
+		return EXIT_FAILURE;
+	}
+	const char* out = argv[0];
+	int level = 0, width = 600, height = 600, frames = 1, threads = 0;
+	bool split = false;
+	choice = 0;
+	for(int i=1;i<argc;i++){
+		if(!strcmp(argv[i], "--level") && i+1<argc)
+			level = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--view") && i+1<argc)
+			choice = glm::clamp(atoi(argv[++i]), 0, 3);
+		else if(!strcmp(argv[i], "--split"))
+			split = true;
+		else if(!strcmp(argv[i], "--size") && i+1<argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if(!strcmp(argv[i], "--frames") && i+1<argc)
+			frames = max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--threads") && i+1<argc)
+			threads = max(1, atoi(argv[++i]));
+	}
+	width = max(1, width);
+	height = max(1, height);
+
+	// Same level setup as main, minus everything that needs a context
+	initShapes();
+	vector<Level_struct> pack = parseLevelPack(LEVEL_PACK_FILE);
+	if(pack.empty())
+		Level_creator();
+	for(vector<Level_struct>::iterator it=pack.begin();it<pack.end();it++){
+		placeLevel(*it);
+		levels.push_back(*it);
+	}
+	current_level = glm::clamp(level, 0, (int)levels.size()-1);
+	Initialize();
+	split_view = split;
+	publishSnapshot();
+	snapshots.update();
+	const GameSnapshot& snap = snapshots.readBuffer();
+
+	AtlasImage atlas = readAtlas();
+	SoftRenderer sr;
+	softInit(sr, width, height, threads, &atlas);
+	double start = inputClock();
+	for(int f=0;f<frames;f++)
+		softDrawFrame(sr, snap);
+	double elapsed = inputClock() - start;
+	cout << frames << " frames at " << width << "x" << height << " on " << sr.workers.size()+1 << " threads: "
+		<< elapsed*1000/frames << " ms per frame, " << frames/elapsed << " FPS" << endl;
+	softShutdown(sr);
+
+	if(!softWritePPM(sr, out)){
+		cerr << "Could not write " << out << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
 
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+/* One frame through whichever backend is active, up to the present */
+void composeFrame (const GameSnapshot& snap, int fbwidth, int fbheight)
+{
+	renderer->beginFrame(fbwidth, fbheight);
+
+	if(snap.split_view)
+		drawSplit(snap);
+	else{
+		draw(snap, 0, 0, 1, 1, 1, 1);
+		// The Top and Helicopter views show the whole board already
+		if(snap.minimap && (snap.choice == 0 || snap.choice == 2))
+			drawMinimap(snap, fbwidth, fbheight);
+	}
 
+	// The HUD always goes on top at the window's own resolution
+	renderer->endScene();
+	drawHUD(snap);
+}
 
-	reshapeWindow (window, width, height);
+void renderFrame (const GameSnapshot& snap, int fbwidth, int fbheight)
+{
+	composeFrame(snap, fbwidth, fbheight);
+	renderer->present();
+}
 
-	// Background color of the scene
-	glClearColor (0.1f, 0.1f, 0.1f, 0.0f); // R, G, B, A
-	glClearDepth (1.0f);
+/* Game loop on the null backend, no window and no context.
+   frames > 0 draws that many frames back to back and reports the cost of building them,
+   0 draws every new snapshot until the game closes itself */
+void headlessLoop (int frames, int width, int height)
+{
+	double start = inputClock();
+	int drawn = 0;
+	while(frames ? drawn < frames : !close_requested){
+		if(!snapshots.update() && frames == 0){
+			std::unique_lock<std::mutex> lock(render_wait_mutex);
+			render_wakeup.wait(lock, [] { return render_pending || close_requested; });
+			render_pending = false;
+			continue;
+		}
+		renderFrame(snapshots.readBuffer(), width, height);
+		drawn++;
+	}
+	double elapsed = inputClock() - start;
+
+	const RenderCounts& c = null_backend.counts;
+	long n = max(1L, c.frames);
+	cout << c.frames << " frames in " << elapsed*1000 << " ms, " << elapsed*1000/n << " ms per frame" << endl;
+	cout << "Per frame: " << c.views/n << " views, " << c.board_vertices/n << " board vertices in " << c.board_draws/n << " draws, "
+		<< c.mesh_draws/n << " mesh draws, " << c.texts/n << " texts" << endl;
+	cout << "Board meshing: " << c.chunk_uploads << " chunk uploads, " << c.uploaded_vertices << " vertices" << endl;
+	cout << "Minimap: " << c.minimaps << " frames, " << c.minimap_layers << " board layer redraws" << endl;
+}
 
-	glEnable (GL_DEPTH_TEST);
-	glDepthFunc (GL_LEQUAL);
-	// glEnable(GL_BLEND);
-	// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+/* Offline rendering - frames go to an offscreen target instead of the window. Its pixels come
+   back through a ring of pixel pack buffers a few frames late, so the GPU never waits for the
+   CPU, and worker threads encode them while the next frames are drawn */
+#define READBACK_SLOTS 3
+#define ENCODER_QUEUED_PER_THREAD 4
 
-	// Initialise FTGL stuff
-	const char* fontfile = "arial.ttf";
-	GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
+/* 8-bit RGB PNG from RGBA rows that start at the bottom, as glReadPixels returns them.
+   Rows use the Up filter, which suits the large flat areas of a board, and deflate runs at
+   its fastest level since the files are small and there are many of them */
+bool writePNG (const char* path, const unsigned char* rgba, int stride, int width, int height)
+{
+	size_t row_bytes = 1 + 3*(size_t)width;
+	vector<unsigned char> raw(row_bytes*height);
+	for(int y=0;y<height;y++){
+		const unsigned char* src = rgba + (size_t)(height-1-y)*stride;
+		const unsigned char* above = y ? rgba + (size_t)(height-y)*stride : NULL;
+		unsigned char* dst = &raw[y*row_bytes];
+		*dst++ = 2;
+		for(int x=0;x<width;x++)
+			for(int c=0;c<3;c++)
+				*dst++ = src[4*x+c] - (above ? above[4*x+c] : 0);
+	}
+	uLongf packed_size = compressBound(raw.size());
+	vector<unsigned char> packed(packed_size);
+	if(compress2(&packed[0], &packed_size, &raw[0], raw.size(), Z_BEST_SPEED) != Z_OK)
+		return false;
+
+	FILE* f = fopen(path, "wb");
+	if(f == NULL)
+		return false;
+	unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+		(unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+		8, 2, 0, 0, 0 };	// bit depth, RGB, deflate, adaptive filters, no interlace
+	struct { const char* type; const unsigned char* data; size_t size; } chunks[3] = {
+		{ "IHDR", header, sizeof(header) }, { "IDAT", &packed[0], packed_size }, { "IEND", NULL, 0 }
+	};
+	bool ok = fwrite("\x89PNG\r\n\x1a\n", 8, 1, f) == 1;
+	for(int c=0;c<3 && ok;c++){
+		unsigned char head[8] = { (unsigned char)(chunks[c].size >> 24), (unsigned char)(chunks[c].size >> 16),
+			(unsigned char)(chunks[c].size >> 8), (unsigned char)chunks[c].size };
+		memcpy(head+4, chunks[c].type, 4);
+		// crc32 with a NULL buffer returns the initial value, so IEND only hashes its type
+		uLong crc = crc32(0L, head+4, 4);
+		if(chunks[c].size)
+			crc = crc32(crc, chunks[c].data, chunks[c].size);
+		unsigned char tail[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+		ok = fwrite(head, 8, 1, f) == 1 && (chunks[c].size == 0 || fwrite(chunks[c].data, chunks[c].size, 1, f) == 1)
+			&& fwrite(tail, 4, 1, f) == 1;
+	}
+	return fclose(f) == 0 && ok;
+}
+
+/* Pixels of one frame as read back, RGBA rows from the bottom */
+struct ReadbackJob {
+	int index;		// level or frame number
+	vector<unsigned char> pixels;
+};
+typedef struct ReadbackJob ReadbackJob;
+
+struct ImageEncoder {
+	string path;		// output directory
+	FILE* stream;		// or the stream raw frames are appended to
+	int width, height;	// of the target read back
+	bool (*encode)(const struct ImageEncoder& enc, const ReadbackJob& job);
+	std::deque<ReadbackJob> queue;	// bounded, the renderer waits when the encoders fall behind
+	size_t max_queued;
+	vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, space;
+	bool stop;
+	std::atomic<int> written, failed;
+};
+typedef struct ImageEncoder ImageEncoder;
+
+void encoderWorker (ImageEncoder* enc)
+{
+	for(;;){
+		ReadbackJob job;
+		{
+			std::unique_lock<std::mutex> lock(enc->mutex);
+			enc->wake.wait(lock, [&] { return enc->stop || !enc->queue.empty(); });
+			// Stopping still drains whatever was queued
+			if(enc->queue.empty())
+				return;
+			job = std::move(enc->queue.front());
+			enc->queue.pop_front();
+		}
+		enc->space.notify_one();
+		if(enc->encode(*enc, job))
+			enc->written++;
+		else if(enc->failed++ == 0)
+			cerr << "Could not write image " << job.index << " to " << enc->path << endl;
+	}
+}
+
+/* threads 0 uses every core. Jobs are taken in order, so one thread also writes them in order */
+void startEncoder (ImageEncoder& enc, int width, int height, int threads)
+{
+	enc.width = width;
+	enc.height = height;
+	enc.stop = false;
+	enc.written = enc.failed = 0;
+	if(threads <= 0)
+		threads = max(1u, std::thread::hardware_concurrency());
+	enc.max_queued = ENCODER_QUEUED_PER_THREAD*threads;
+	for(int i=0;i<threads;i++)
+		enc.workers.push_back(std::thread(encoderWorker, &enc));
+}
 
-	if(GL3Font.font->Error())
+void queueEncode (ImageEncoder& enc, ReadbackJob& job)
+{
 	{
-		cout << "Error: Could not load font `" << fontfile << "'" << endl;
-		glfwTerminate();
-		exit(EXIT_FAILURE);
+		std::unique_lock<std::mutex> lock(enc.mutex);
+		enc.space.wait(lock, [&] { return enc.queue.size() < enc.max_queued; });
+		enc.queue.push_back(std::move(job));
 	}
+	enc.wake.notify_one();
+}
 
-	// Create and compile our GLSL program from the font shaders
-	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
+void stopEncoder (ImageEncoder& enc)
+{
+	{
+		std::lock_guard<std::mutex> lock(enc.mutex);
+		enc.stop = true;
+	}
+	enc.wake.notify_all();
+	for(size_t i=0;i<enc.workers.size();i++)
+		enc.workers[i].join();
+	enc.workers.clear();
+}
 
-	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
-	GL3Font.font->FaceSize(1);
-	GL3Font.font->Depth(0);
-	GL3Font.font->Outset(0, 0);
-	GL3Font.font->CharMap(ft_encoding_unicode);
+/* Colour and depth to draw into, and the readback ring that empties it */
+struct OffscreenTarget {
+	int width, height;
+	GpuHandle framebuffer, color, depth;
+	struct {
+		GpuHandle buffer;	// GL_PIXEL_PACK_BUFFER
+		GLsync fence;
+		int index;		// -1 while the slot is free
+	} slots[READBACK_SLOTS];
+	int next;
+};
+typedef struct OffscreenTarget OffscreenTarget;
 
-	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
-	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
-	cout << "VERSION: " << glGetString(GL_VERSION) << endl;
-	cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
+/* Leaves the target bound, false when the driver cannot render to it */
+bool createOffscreenTarget (OffscreenTarget& t, int width, int height)
+{
+	size_t size = (size_t)4*width*height;
+	t.width = width;
+	t.height = height;
+	t.framebuffer = GpuHandle(GPU_FRAMEBUFFER, GPU_TARGETS);
+	t.color = GpuHandle(GPU_RENDERBUFFER, GPU_TARGETS);
+	t.depth = GpuHandle(GPU_RENDERBUFFER, GPU_TARGETS);
+	glBindRenderbuffer(GL_RENDERBUFFER, t.color.id);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	t.color.setBytes(size);
+	glBindRenderbuffer(GL_RENDERBUFFER, t.depth.id);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	t.depth.setBytes(size);
+	glBindFramebuffer(GL_FRAMEBUFFER, t.framebuffer.id);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, t.color.id);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, t.depth.id);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+		cerr << "Offscreen target incomplete" << endl;
+		return false;
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	for(int r=0;r<READBACK_SLOTS;r++){
+		t.slots[r].buffer = GpuHandle(GPU_BUFFER, GPU_STREAMING);
+		t.slots[r].buffer.bufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		t.slots[r].fence = 0;
+		t.slots[r].index = -1;
+	}
+	t.next = 0;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return true;
 }
-int fall_checker(){
-	if(boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==0 || (int)cube[0].pos.y>=dim ||(int)cube[0].pos.y<0 
-		||  (int)cube[0].pos.x>=dim || (int)cube[0].pos.x<0   )
-	{
-		system("aplay -q ./sounds/pin.wav &");
-		return 0;
+
+/* Wait for a slot's pixels and hand a copy to the encoders, the buffer is reused right away */
+void collectReadback (OffscreenTarget& t, int slot, ImageEncoder& enc)
+{
+	size_t size = (size_t)4*t.width*t.height;
+	glClientWaitSync(t.slots[slot].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(t.slots[slot].fence);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, t.slots[slot].buffer.id);
+	const unsigned char* mapped = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	countGLCalls(4);
+	if(mapped){
+		ReadbackJob job;
+		job.index = t.slots[slot].index;
+		job.pixels.assign(mapped, mapped + size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		countGLCalls();
+		queueEncode(enc, job);
 	}
-	if(boardMatrix[(int)cube[1].pos.x][(int)cube[1].pos.y]==0 || (int)cube[1].pos.y>=dim ||(int)cube[1].pos.y<0 
-		||  (int)cube[1].pos.x>=dim || (int)cube[1].pos.x<0  )
+	else if(enc.failed++ == 0)
+		cerr << "Could not map the pixels of image " << t.slots[slot].index << endl;
+	t.slots[slot].index = -1;
+}
 
-		{
-			system("aplay -q ./sounds/pin.wav &");
-			return 1;
+/* Queue a read of what was drawn, the slot it lands in is collected when the ring comes round */
+void readBack (OffscreenTarget& t, int index, ImageEncoder& enc)
+{
+	int slot = t.next;
+	t.next = (t.next + 1) % READBACK_SLOTS;
+	if(t.slots[slot].index >= 0)
+		collectReadback(t, slot, enc);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, t.slots[slot].buffer.id);
+	glReadPixels(0, 0, t.width, t.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	t.slots[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	t.slots[slot].index = index;
+	countGLCalls(3);
+}
+
+/* Collect the reads still in flight, oldest first, and unbind the target */
+void finishReadbacks (OffscreenTarget& t, ImageEncoder& enc)
+{
+	for(int r=0;r<READBACK_SLOTS;r++){
+		int slot = (t.next + r) % READBACK_SLOTS;
+		if(t.slots[slot].index >= 0)
+			collectReadback(t, slot, enc);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	countGLCalls(2);
+}
+
+void releaseOffscreenTarget (OffscreenTarget& t)
+{
+	for(int r=0;r<READBACK_SLOTS;r++)
+		t.slots[r].buffer.reset();
+	t.framebuffer.reset();
+	t.color.reset();
+	t.depth.reset();
+}
+
+/* A hidden window only for its context, with everything initGL sets up */
+GLFWwindow* initOffscreenGL (int width, int height)
+{
+	hidden_window = true;
+	sound_enabled = false;
+	startAssetLoading();
+	GLFWwindow* window = initGLFW(width, height);
+	initGLEW();
+	initGL(window, width, height);
+	gl_backend.window = window;
+	renderer = &gl_backend;
+	Matrices.projection = glm::perspective((float)(M_PI/2), (float)width/height, 0.1f, 500.0f);
+	return window;
+}
+
+/* Tower on the left half of the target, Top on the right */
+bool encodeThumbnails (const ImageEncoder& enc, const ReadbackJob& job)
+{
+	static const char* view_names[2] = { "tower", "top" };
+	int width = enc.width/2;
+	bool ok = true;
+	for(int v=0;v<2;v++){
+		char name[64];
+		snprintf(name, sizeof(name), "/level%05d_%s.png", job.index, view_names[v]);
+		ok = writePNG((enc.path + name).c_str(), &job.pixels[4*v*width], 4*enc.width, width, enc.height) && ok;
+	}
+	return ok;
+}
+
+/* Level thumbnails, an offline step like --soft-render:
+	--thumbnails DIR [--pack FILE] [--size WxH] [--threads N]
+   Streams the pack, so it is not limited to MAX_LEVELS, and writes DIR/levelNNNNN_tower.png
+   and DIR/levelNNNNN_top.png for every level, numbered from 0 in pack order.
+   Both views of a level go side by side into one target and come back in one read */
+int thumbnailMain (int argc, char** argv)
+{
+	if(argc < 1){
+		cerr << "--thumbnails needs an output directory" << endl;
+		return EXIT_FAILURE;
+	}
+	const char* dir = argv[0];
+	const char* pack_file = LEVEL_PACK_FILE;
+	int width = 256, height = 256, threads = 0;
+	for(int i=1;i<argc;i++){
+		if(!strcmp(argv[i], "--pack") && i+1<argc)
+			pack_file = argv[++i];
+		else if(!strcmp(argv[i], "--size") && i+1<argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if(!strcmp(argv[i], "--threads") && i+1<argc)
+			threads = max(1, atoi(argv[++i]));
+	}
+	width = max(1, width);
+	height = max(1, height);
+
+	LevelPackReader reader;
+	if(!openLevelPack(reader, pack_file)){
+		cerr << "Could not read " << pack_file << endl;
+		return EXIT_FAILURE;
+	}
+	mkdir(dir, 0755);
+
+	initOffscreenGL(width, height);
+	OffscreenTarget target;
+	if(!createOffscreenTarget(target, 2*width, height)){
+		releaseOffscreenTarget(target);
+		releaseGpuResources();
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	ImageEncoder enc;
+	enc.path = dir;
+	enc.encode = encodeThumbnails;
+	startEncoder(enc, 2*width, height, threads);
+	int encoders = enc.workers.size();
+
+	// Every level is played as a one level game, Initialize sets the board and the blocks.
+	// readLevel skips bad levels, the files keep their place in the pack
+	static const float halves[2][4] = { {0,0,0.5f,1}, {0.5f,0,0.5f,1} };
+	choice = 0;
+	split_view = false;
+	levels.assign(1, Level_struct());
+	current_level = 0;
+	double start = inputClock();
+	int count = 0;
+	for(;readLevel(reader, levels[0]);count++){
+		placeLevel(levels[0]);
+		Initialize();
+		publishSnapshot();
+		snapshots.update();
+		const GameSnapshot& snap = snapshots.readBuffer();
+
+		render_width = target.width;
+		render_height = target.height;
+		glViewport(0, 0, render_width, render_height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		countGLCalls(2);
+		// The multiview shaders always fill four viewports, so the two views go one by one
+		for(int v=0;v<2;v++){
+			glm::mat4 VP = Matrices.projection * glm::lookAt(snap.eye[v], snap.target[v], snap.up[v]);
+			renderer->setViews(&VP, &halves[v], 1);
+			drawScene(snap, &VP, &snap.eye[v], 1, true);
 		}
-	return -1;	
+		readBack(target, count + reader.skipped, enc);
+	}
+	finishReadbacks(target, enc);
+	stopEncoder(enc);
+	double elapsed = inputClock() - start;
+
+	cout << count << " levels, " << reader.skipped << " skipped, " << 2*enc.written << " thumbnails at " << width << "x" << height << " in " << elapsed << " s, "
+		<< count*60/max(elapsed, 1e-6) << " levels per minute on " << encoders << " encoder threads" << endl;
+	int failed = enc.failed;
+	releaseOffscreenTarget(target);
+	releaseGpuResources();
+	glfwTerminate();
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-int hola,other;
-void merge_checker(){
-	if((abs((int)cube[0].pos.y - (int)cube[1].pos.y)==1&&abs((int)cube[0].pos.x - (int)cube[1].pos.x)==0) || (abs((int)cube[0].pos.y - (int)cube[1].pos.y)==0 &&abs((int)cube[0].pos.x - (int)cube[1].pos.x)==1) ){
-		if(merged==0 && toppling==0 && falling==0){
-			merged=1;
+
+bool encodeFramePNG (const ImageEncoder& enc, const ReadbackJob& job)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/frame%05d.png", job.index);
+	return writePNG((enc.path + name).c_str(), &job.pixels[0], 4*enc.width, enc.width, enc.height);
+}
+
+/* RGB24 rows from the top, the layout ffmpeg's rawvideo input expects. Only one encoder
+   thread appends to the stream, so frames stay in order */
+bool encodeFrameRaw (const ImageEncoder& enc, const ReadbackJob& job)
+{
+	vector<unsigned char> rgb(3*(size_t)enc.width*enc.height);
+	unsigned char* dst = &rgb[0];
+	for(int y=enc.height-1;y>=0;y--){
+		const unsigned char* src = &job.pixels[(size_t)4*enc.width*y];
+		for(int x=0;x<enc.width;x++, src+=4){
+			*dst++ = src[0];
+			*dst++ = src[1];
+			*dst++ = src[2];
+		}
+	}
+	return fwrite(&rgb[0], rgb.size(), 1, enc.stream) == 1;
+}
+
+/* Replays - recorded keys played through the game on the calling thread, one fixed tick at a time */
+#define REPLAY_TICKS_PER_SECOND ((int)(1/(SIM_TICK) + 0.5))
+
+/* U D L R for the arrow keys and S for the space bar that switches blocks.
+   Whitespace and # comments are skipped */
+void parseMoves (const string& text, const char* source, vector<int>& keys)
+{
+	for(size_t c=0;c<text.size();c++){
+		switch(toupper(text[c])){
+			case 'U': keys.push_back(GLFW_KEY_UP); break;
+			case 'D': keys.push_back(GLFW_KEY_DOWN); break;
+			case 'L': keys.push_back(GLFW_KEY_LEFT); break;
+			case 'R': keys.push_back(GLFW_KEY_RIGHT); break;
+			case 'S': keys.push_back(GLFW_KEY_SPACE); break;
+			case '#':
+				while(c+1<text.size() && text[c+1] != '\n')
+					c++;
+				break;
+			default:
+				if(!isspace((unsigned char)text[c]))
+					cerr << source << ": unknown move `" << text[c] << "'" << endl;
+				break;
+		}
+	}
+}
+
+/* One simulation tick. The next key is pressed and released once the block has settled,
+   like a player who waits for every move. True when the keys are used up and the block
+   is at rest, or the game is won */
+bool replayTick (const vector<int>& keys, size_t& next_key, int tick)
+{
+	bool idle = toppling == 0 && falling == 0 && !rules_pending && move_queue_count == 0;
+	if(idle && next_key < keys.size()){
+		handleKey(keys[next_key], GLFW_PRESS);
+		handleKey(keys[next_key], GLFW_RELEASE);
+		next_key++;
+	}
+	if(!paused && !game_over)
+		gameEngine();
+	if(tick % REPLAY_TICKS_PER_SECOND == REPLAY_TICKS_PER_SECOND-1 && !paused)
+		timer[current_level]++;
+	return (next_key == keys.size() && idle) || game_over;
+}
+
+/* Replay export, an offline step like --thumbnails:
+	--export-replay MOVES OUT [--level N] [--view V] [--split] [--size WxH] [--threads N] [--tail S]
+   MOVES is a file of moves, U D L R for the arrow keys and S for the space bar that switches
+   blocks. Whitespace and # comments are skipped. Each move is pressed once the block has
+   settled, and plays through the normal topple animation, one simulation tick per frame.
+   OUT ending in .rgb, or - for stdout, gets a raw RGB24 stream at 1/SIM_TICK frames per second.
+   Anything else is a directory that gets frame00000.png, frame00001.png ... */
+int exportReplayMain (int argc, char** argv)
+{
+	if(argc < 2){
+		cerr << "--export-replay needs a move file and an output" << endl;
+		return EXIT_FAILURE;
+	}
+	const char* moves_file = argv[0];
+	string out = argv[1];
+	int level = 0, view = 0, width = 640, height = 480, threads = 0;
+	double tail = 1;
+	bool split = false;
+	for(int i=2;i<argc;i++){
+		if(!strcmp(argv[i], "--level") && i+1<argc)
+			level = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--view") && i+1<argc)
+			view = glm::clamp(atoi(argv[++i]), 0, 3);
+		else if(!strcmp(argv[i], "--split"))
+			split = true;
+		else if(!strcmp(argv[i], "--size") && i+1<argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if(!strcmp(argv[i], "--threads") && i+1<argc)
+			threads = max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--tail") && i+1<argc)
+			tail = max(0.0, atof(argv[++i]));
+	}
+	width = max(1, width);
+	height = max(1, height);
+
+	vector<unsigned char> text;
+	if(!readFile(moves_file, text)){
+		cerr << "Could not read " << moves_file << endl;
+		return EXIT_FAILURE;
+	}
+	vector<int> keys;
+	parseMoves(string(text.begin(), text.end()), moves_file, keys);
+
+	ImageEncoder enc;
+	enc.path = out;
+	enc.stream = NULL;
+	bool raw = out == "-" || (out.size() > 4 && out.compare(out.size()-4, 4, ".rgb") == 0);
+	if(raw){
+		// Score lines and the like would land in the video, they go to stderr instead
+		if(out == "-")
+			cout.rdbuf(cerr.rdbuf());
+		enc.stream = out == "-" ? stdout : fopen(out.c_str(), "wb");
+		if(enc.stream == NULL){
+			cerr << "Could not write " << out << endl;
+			return EXIT_FAILURE;
 		}
+		enc.encode = encodeFrameRaw;
+		threads = 1;
+	}
+	else{
+		mkdir(out.c_str(), 0755);
+		enc.encode = encodeFramePNG;
+	}
+
+	initOffscreenGL(width, height);
+	OffscreenTarget target;
+	if(!createOffscreenTarget(target, width, height)){
+		releaseOffscreenTarget(target);
+		releaseGpuResources();
+		glfwTerminate();
+		return EXIT_FAILURE;
 	}
-}
-void black_checker(){
-	if(cube[0].pos.y==cube[1].pos.y && cube[0].pos.x ==cube[1].pos.x && abs(cube[0].pos.z-cube[1].pos.z)==1 && merged==1 && falling ==0 && boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==9){
-		falling = 1;
-		hola=0;
-		other=1;
-		right_move=true;
-		system("aplay -q ./sounds/pin.wav &");
+	startEncoder(enc, width, height, threads);
+
+	// Same level setup as main, the game then runs on this thread instead of the simulation thread
+	if(assets.levels.empty())
+		Level_creator();
+	for(vector<Level_struct>::iterator it=assets.levels.begin();it<assets.levels.end();it++){
+		placeLevel(*it);
+		levels.push_back(*it);
+	}
+	current_level = glm::clamp(level, 0, (int)levels.size()-1);
+	Initialize();
+	score = 0;
+	choice = view;
+	split_view = split;
+	changeview();
 
+	double start = inputClock();
+	size_t next_key = 0;
+	int frames = 0, settled = 0;
+	// The clip ends a little after the last move has settled, or the game was won
+	while(settled <= tail*REPLAY_TICKS_PER_SECOND){
+		if(replayTick(keys, next_key, frames))
+			settled++;
+
+		publishSnapshot();
+		snapshots.update();
+		composeFrame(snapshots.readBuffer(), width, height);
+		readBack(target, frames++, enc);
 	}
+	finishReadbacks(target, enc);
+	stopEncoder(enc);
+	double elapsed = inputClock() - start;
+	if(raw && enc.stream != stdout)
+		fclose(enc.stream);
+
+	// Progress goes to stderr, stdout may be the video stream
+	double seconds = frames*(SIM_TICK);
+	cerr << frames << " frames, " << seconds << " s of video at " << width << "x" << height << " in " << elapsed << " s, "
+		<< seconds/max(elapsed, 1e-6) << "x real time" << endl;
+	if(raw)
+		cerr << "Encode with: ffmpeg -f rawvideo -pix_fmt rgb24 -s " << width << "x" << height << " -r " << REPLAY_TICKS_PER_SECOND
+			<< " -i " << out << " replay.mp4" << endl;
+	int failed = enc.failed;
+	releaseOffscreenTarget(target);
+	releaseGpuResources();
+	glfwTerminate();
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-void orange_checker(){
-	if(cube[0].pos.y==cube[1].pos.y && cube[0].pos.x ==cube[1].pos.x && abs(cube[0].pos.z-cube[1].pos.z)==1&& toppling ==0 && merged==1 && falling ==0 && boardMatrix[(int)cube[0].pos.x][(int)cube[0].pos.y]==2){
-		falling = 1;
-		hola=0;
-		other=1;
+
+/* Image regression - scripted scenes, headless on the software renderer. Scene script:
+	scene NAME
+	level N			level of the pack, played from its start
+	moves UURRD		keys played before the pictures are taken, as for --export-replay
+	helicopter X Y		angles of the Helicopter view, as a/d and w/s turn them (default 90 90, the Top view)
+	budget MS		median milliseconds per frame of every view, 0 for no budget
+	tolerance T P		fail when more than P percent of the pixels differ by more than T
+	end
+   Lines starting with # are comments */
+#define REGRESS_MAX_TICKS 36000	// ten minutes of play, enough for any scripted scene
+
+struct RegressScene {
+	string name;
+	int level;
+	string moves;
+	float helicopter_x, helicopter_y;
+	double budget;
+	int tolerance;		// per channel, out of 255
+	double max_differing;	// percent of the pixels beyond the tolerance
+};
+typedef struct RegressScene RegressScene;
+
+vector<RegressScene> parseRegressScript (const char* path)
+{
+	vector<RegressScene> scenes;
+	std::ifstream file(path, std::ios::in);
+	if(!file.is_open())
+		return scenes;
+
+	RegressScene scene;
+	int line_no = 0;
+	std::string line;
+	while(getline(file, line)){
+		line_no++;
+		std::istringstream in(line);
+		std::string word;
+		if(!(in >> word) || word[0] == '#')
+			continue;
+		if(word == "scene"){
+			scene = RegressScene();
+			in >> scene.name;
+			scene.level = 0;
+			scene.helicopter_x = scene.helicopter_y = 90;
+			scene.budget = 0;
+			scene.tolerance = 8;
+			scene.max_differing = 0.1;
+		}
+		else if(word == "level")
+			in >> scene.level;
+		else if(word == "moves")
+			getline(in, scene.moves);
+		else if(word == "helicopter")
+			in >> scene.helicopter_x >> scene.helicopter_y;
+		else if(word == "budget")
+			in >> scene.budget;
+		else if(word == "tolerance")
+			in >> scene.tolerance >> scene.max_differing;
+		else if(word == "end")
+			scenes.push_back(scene);
+		else
+			cerr << path << ":" << line_no << ": unknown keyword `" << word << "'" << endl;
 	}
+	return scenes;
 }
-void cross_checker(){
-	for(vector<cross_struct>::iterator it=levels[current_level].crosses.begin();it<levels[current_level].crosses.end();it++)
-		{
-			if(merged==1 && falling ==0 && toppling ==0 &&
-				cube[0].pos.y==cube[1].pos.y && 
-				cube[0].pos.x==cube[1].pos.x && 
-				((cube[0].pos.x==it->place.x&&cube[0].pos.y==it->place.y))){
-				cube[0].pos = it->place;					
-				cube[1].pos = it->other;					
-				merged=0;				
-				chosen=0;
-				break;
-			}
-		}
 
+/* Binary PPM as softWritePPM writes it */
+bool readPPM (const char* path, int& width, int& height, vector<unsigned char>& rgb)
+{
+	FILE* f = fopen(path, "rb");
+	if(f == NULL)
+		return false;
+	int max_value = 0;
+	bool ok = fscanf(f, "P6 %d %d %d", &width, &height, &max_value) == 3 && max_value == 255 && fgetc(f) != EOF
+		&& width > 0 && height > 0;
+	if(ok){
+		rgb.resize((size_t)3*width*height);
+		ok = fread(&rgb[0], rgb.size(), 1, f) == 1;
+	}
+	fclose(f);
+	return ok;
 }
-void switch_checker(){
-	for(vector<switch_struct>::iterator it=levels[current_level].switches.begin();it<levels[current_level].switches.end();it++)
-		{
-			if(falling ==0 && toppling ==0 && ((cube[0].pos.x==it->place.x&&cube[0].pos.y==it->place.y)||(cube[1].pos.x==it->place.x&&cube[1].pos.y==it->place.y))){
-				if(it->used==false){
-					it->used=true;
-					for(vector<glm::vec3>::iterator it2 = it->locations.begin();it2< it->locations.end();it2++){
-						boardMatrix[(int)it2->x][(int)it2->y]=1;
-					}
+
+/* Percent of the pixels with a channel more than tolerance away from the golden image */
+double differingPixels (const SoftRenderer& sr, const vector<unsigned char>& golden, int tolerance)
+{
+	long differing = 0;
+	for(int y=0;y<sr.height;y++){
+		for(int x=0;x<sr.width;x++){
+			unsigned c = sr.color[(size_t)y*sr.stride + x];
+			const unsigned char* g = &golden[3*((size_t)y*sr.width + x)];
+			for(int k=0;k<3;k++){
+				if(abs((int)((c >> 8*k) & 0xff) - g[k]) > tolerance){
+					differing++;
+					break;
 				}
-				
 			}
 		}
+	}
+	return 100.0*differing/((double)sr.width*sr.height);
 }
 
-void gameEngine(){
-	merge_checker();
-	orange_checker();
-	black_checker();
-	cross_checker();
-	switch_checker();
-	changeview();
-	
-	//faller
-	if(fall_checker()!=-1 && toppling==0 && falling == 0){
-		hola = fall_checker();
-		other = 1-hola;
-		if(merged==1){
-			if(cube[other].pos.x == cube[hola].pos.x && cube[other].pos.y != cube[hola].pos.y){
-				int temp=1;
+/* Image and frame-time regressions, never touches GL or GLFW:
+	--regress SCRIPT [--golden DIR] [--update] [--size WxH] [--frames N] [--threads N]
+   Every scene is drawn from all four cameras. Each image is compared against
+   DIR/SCENE_VIEW.ppm, and the median time of N frames is held against the scene's budget.
+   A failing image is written next to its golden one as SCENE_VIEW.actual.ppm.
+   --update records the golden images instead of comparing them.
+   The exit status is non-zero if any image or budget fails */
+int regressMain (int argc, char** argv)
+{
+	if(argc < 1){
+		cerr << "--regress needs a scene script" << endl;
+		return EXIT_FAILURE;
+	}
+	const char* script = argv[0];
+	string golden_dir = "golden";
+	int width = 320, height = 240, frames = 5, threads = 0;
+	bool update = false;
+	for(int i=1;i<argc;i++){
+		if(!strcmp(argv[i], "--golden") && i+1<argc)
+			golden_dir = argv[++i];
+		else if(!strcmp(argv[i], "--update"))
+			update = true;
+		else if(!strcmp(argv[i], "--size") && i+1<argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if(!strcmp(argv[i], "--frames") && i+1<argc)
+			frames = max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--threads") && i+1<argc)
+			threads = max(1, atoi(argv[++i]));
+	}
+	width = max(1, width);
+	height = max(1, height);
+	vector<RegressScene> scenes = parseRegressScript(script);
+	if(scenes.empty()){
+		cerr << "No scenes in " << script << endl;
+		return EXIT_FAILURE;
+	}
+	if(update)
+		mkdir(golden_dir.c_str(), 0755);
+
+	// Same level setup as --soft-render
+	sound_enabled = false;
+	initShapes();
+	vector<Level_struct> pack = parseLevelPack(LEVEL_PACK_FILE);
+	if(pack.empty())
+		Level_creator();
+	for(vector<Level_struct>::iterator it=pack.begin();it<pack.end();it++){
+		placeLevel(*it);
+		levels.push_back(*it);
+	}
+	AtlasImage atlas = readAtlas();
+	SoftRenderer sr;
+	softInit(sr, width, height, threads, &atlas);
+
+	static const char* view_names[4] = { "tower", "top", "follow", "helicopter" };
+	int failures = 0, images = 0;
+	vector<double> times(frames);
+	for(size_t s=0;s<scenes.size();s++){
+		const RegressScene& scene = scenes[s];
+		vector<int> keys;
+		parseMoves(scene.moves, script, keys);
+
+		// Every scene starts from a fresh game on its level
+		game_over = paused = split_view = false;
+		score = chosen = 0;
+		memset(moves, 0, sizeof(moves));
+		camera_rotation_angle_x = scene.helicopter_x;
+		camera_rotation_angle_y = scene.helicopter_y;
+		current_level = glm::clamp(scene.level, 0, (int)levels.size()-1);
+		Initialize();
+		size_t next_key = 0;
+		for(int tick=0;tick<REGRESS_MAX_TICKS && !replayTick(keys, next_key, tick);tick++)
+			;
+
+		for(int v=0;v<4;v++){
+			choice = v;
+			publishSnapshot();
+			snapshots.update();
+			const GameSnapshot& snap = snapshots.readBuffer();
+			for(int f=0;f<frames;f++){
+				double start = inputClock();
+				softDrawFrame(sr, snap);
+				times[f] = (inputClock() - start)*1000;
 			}
-			else if(cube[other].pos.y == cube[hola].pos.y && cube[other].pos.x != cube[hola].pos.x){
-				int temp=1;
+			std::nth_element(times.begin(), times.begin() + frames/2, times.end());
+			double ms = times[frames/2];
+
+			string path = golden_dir + "/" + scene.name + "_" + view_names[v];
+			std::ostringstream result;
+			bool failed = false;
+			if(update){
+				if(!softWritePPM(sr, (path + ".ppm").c_str())){
+					result << "could not write " << path << ".ppm";
+					failed = true;
+				}
+				else
+					result << "recorded";
 			}
 			else{
-				cube[other].pos.x = cube[hola].pos.x;
-				cube[other].pos.y = cube[hola].pos.y;
-				cube[other].pos.z = floor_grey.scale.z + cube[other].scale.z; 
-				cube[ hola].pos.z = floor_grey.scale.z + 3*cube[other].scale.z;
-			}
-		
-		}
-		toppling = 0;
-		falling  = 1;
-	} 
-	if(falling ==1){
-		if(merged==1){
-			cube[other].pos.z -=0.1;
-			cube[hola].pos.z -=0.1;
-			if(cube[hola].pos.z <=-10){
-				falling = 0;
-				Initialize();
+				int golden_width, golden_height;
+				vector<unsigned char> golden;
+				if(!readPPM((path + ".ppm").c_str(), golden_width, golden_height, golden)){
+					result << "no golden image " << path << ".ppm";
+					failed = true;
+				}
+				else if(golden_width != width || golden_height != height){
+					result << "golden image is " << golden_width << "x" << golden_height;
+					failed = true;
+				}
+				else{
+					double differing = differingPixels(sr, golden, scene.tolerance);
+					result << differing << "% of the pixels differ";
+					failed = differing > scene.max_differing;
+				}
+				if(failed)
+					softWritePPM(sr, (path + ".actual.ppm").c_str());
 			}
-		}
-		else{
-			cube[dom].pos.z -=0.1;
-			if(cube[dom].pos.z <=-10){
-				falling = 0;
-				Initialize();
+			result << ", " << ms << " ms per frame";
+			if(scene.budget > 0){
+				result << " (budget " << scene.budget << ")";
+				if(ms > scene.budget)
+					failed = true;
 			}
-		}	
-	}
-	if(toppling!=0 && falling == 0  ){
-		if(toppling == 1){
-			if(merged==1)
-				CuboidToppleNorth();
-			else
-				CubeToppleNorth();
-		}
-		if(toppling == 2){
-			if(merged==1)
-				CuboidToppleSouth();
-			else
-				CubeToppleSouth();
-		}
-		if(toppling == 3){
-			if(merged==1)
-				CuboidToppleWest();
-			else
-				CubeToppleWest();
-		}
-		if(toppling == 4){
-			if(merged==1)
-				CuboidToppleEast();
-			else
-				CubeToppleEast();
+			cout << (failed ? "FAIL " : "ok   ") << scene.name << " " << view_names[v] << ": " << result.str() << endl;
+			failures += failed;
+			images++;
 		}
 	}
-	// if(buttons["LEFT"])
-	// 		CubeActivateTopple(3);
-	// if(buttons["RIGHT"])
-	// 		CubeActivateTopple(4);
-	// if(buttons["UP"])
-	// 		CubeActivateTopple(1);
-	// if(buttons["DOWN"])
-	// 		CubeActivateTopple(2);
+	softShutdown(sr);
+	cout << images - failures << " of " << images << " images passed" << endl;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-void Level_creator(){
-	//Level1
-	Level_struct curr;
-	int m1[10][10] = {
-		{1,1,2,0,0,0,0,0,0,0},
-		{1,1,1,1,2,1,0,0,0,0},
-		{1,1,1,1,1,1,1,1,1,0},
-		{0,1,1,1,1,1,1,1,1,1},
-		{0,0,0,0,0,1,1,9,1,1},
-		{0,0,0,0,0,0,1,1,1,0},
-		{0,0,0,0,0,0,0,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0}
-	};
-	for(int i=0;i<dim;i++){
-		for(int j=0;j<dim;j++){
-			curr.levelMatrix[i][j] = m1[i][j];
-		}
-	}
-	curr.cube0_pos = glm::vec3(0,0,floor_grey.scale.z+ cube[0].scale.z);
-	curr.cube1_pos = glm::vec3(0,1,floor_grey.scale.z+ cube[0].scale.z);
-	levels.push_back(curr);
-
-	//Level2
-	int m2[10][10] = {
-		{1,1,1,1,0,0,0,1,1,1},
-		{1,1,1,1,0,0,0,1,9,1},
-		{1,1,1,1,0,0,0,1,1,1},
-		{1,1,1,1,0,0,1,1,1,1},
-		{0,0,0,0,1,1,1,0,0,0},
-		{0,0,0,0,1,1,1,0,0,0},
-		{0,0,0,0,1,1,1,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0},
-		{0,0,0,0,0,0,0,0,0,0}
-	};
-	for(int i=0;i<dim;i++){
-		for(int j=0;j<dim;j++){
-			curr.levelMatrix[i][j] = m2[i][j];
-		}
-	}
 
-	switch_struct sw;
-	sw.used=false;
-	sw.place = glm::vec3(2,2,0);
-	sw.locations.push_back(glm::vec3(3,4,0));
-	curr.switches.push_back(sw);
+/* Wall mode - many games in one process, each in its own cell of a grid:
+	--wall N [MOVES ...] [--view V] [--size WxH] [--frames F]
+   Session i starts at level i of the pack, wrapping round, and plays move file i of the
+   MOVES given, also wrapping round, as --export-replay does. A finished replay stays on
+   screen for a moment and starts over. Without move files the sessions wait at the start
+   of their levels. --frames draws F frames back to back and reports the frame time */
+#define WALL_STAGGER_TICKS 10	// between the starts of neighbouring sessions
+#define WALL_HOLD_TICKS 120	// a finished replay stays on screen this long
+
+struct WallSession {
+	// The game globals of the session while another one is swapped in, see swapSession
+	vector<Level_struct> levels;
+	Sprite cube[2];
+	int score, current_level, dom, rec, mode, toppling, merged, chosen, falling, hola, other;
+	int timer[MAX_LEVELS+1], moves[MAX_LEVELS+1];
+	bool paused, right_move, game_over, rules_pending;
+	int move_queue[MOVE_QUEUE_SIZE], move_queue_head, move_queue_count;
+	int dim, board_version;
+	int (*boardMatrix)[MAX_DIM];
+	unordered_map<int,vector<int> > switch_cells;
+	unordered_map<int,int> cross_cells;
+	PreparedLevel prepared[2];
+	PreparedLevel *active_level, *next_level;
+
+	// The replay that plays in place of a player
+	int start_level;
+	vector<int> keys;
+	size_t next_key;
+	int tick, wait, settled;
+
+	TripleBuffer<GameSnapshot> snapshots;
+};
+typedef struct WallSession WallSession;
 
+/* Exchange the game globals with the session's copy, the same call swaps it in and out */
+void swapSession (WallSession& s)
+{
+	std::swap(levels, s.levels);
+	std::swap(cube, s.cube);
+	std::swap(score, s.score);
+	std::swap(current_level, s.current_level);
+	std::swap(dom, s.dom);
+	std::swap(rec, s.rec);
+	std::swap(mode, s.mode);
+	std::swap(toppling, s.toppling);
+	std::swap(merged, s.merged);
+	std::swap(chosen, s.chosen);
+	std::swap(falling, s.falling);
+	std::swap(hola, s.hola);
+	std::swap(other, s.other);
+	std::swap(timer, s.timer);
+	std::swap(moves, s.moves);
+	std::swap(paused, s.paused);
+	std::swap(right_move, s.right_move);
+	std::swap(game_over, s.game_over);
+	std::swap(rules_pending, s.rules_pending);
+	std::swap(move_queue, s.move_queue);
+	std::swap(move_queue_head, s.move_queue_head);
+	std::swap(move_queue_count, s.move_queue_count);
+	std::swap(dim, s.dim);
+	std::swap(board_version, s.board_version);
+	std::swap(boardMatrix, s.boardMatrix);
+	switch_cells.swap(s.switch_cells);
+	cross_cells.swap(s.cross_cells);
+	std::swap(active_level, s.active_level);
+	std::swap(next_level, s.next_level);
+}
 
-	cross_struct cw;
-	cw.place = glm::vec3(6,4,floor_grey.scale.z+ cube[0].scale.z);
-	cw.other = glm::vec3(4,6,floor_grey.scale.z+ cube[0].scale.z);
-	curr.crosses.push_back(cw);
+/* Back to the start of the session's level with a new score, on a swapped in session */
+void restartSession (WallSession& s)
+{
+	current_level = s.start_level;
+	score = 0;
+	memset(timer, 0, sizeof(timer));
+	memset(moves, 0, sizeof(moves));
+	right_move = game_over = false;
+	chosen = 0;
+	Initialize();
+	s.next_key = 0;
+	s.tick = 0;
+	s.settled = 0;
+}
 
-	levels.push_back(curr);
-	Level_struct curr2;
+/* Every session ticks in turn on the simulation thread, the render thread reads their snapshots */
+void wallSimulation (vector<WallSession>* sessions)
+{
+	using namespace std::chrono;
+	steady_clock::duration tick = duration_cast<steady_clock::duration>(duration<double>(SIM_TICK));
+	steady_clock::time_point next_tick = steady_clock::now();
+	static const vector<int> no_keys;
+
+	while(sim_running){
+		// The sessions only play their replays, keys are dropped once the callbacks have seen quit
+		while(input_queue.front() != NULL)
+			input_queue.pop();
+		for(size_t i=0;i<sessions->size();i++){
+			WallSession& s = (*sessions)[i];
+			swapSession(s);
+			size_t unused = 0;
+			if(s.wait > 0){
+				s.wait--;
+				replayTick(no_keys, unused, s.tick++);
+			}
+			else if(replayTick(s.keys, s.next_key, s.tick++))
+				s.settled++;
+			if(s.settled > WALL_HOLD_TICKS && (!s.keys.empty() || game_over))
+				restartSession(s);
+			fillSnapshot(s.snapshots.writeBuffer());
+			s.snapshots.publish();
+			swapSession(s);
+		}
+		next_tick += tick;
+		std::this_thread::sleep_until(next_tick);
+	}
+}
 
-	int m3[10][10] = {
-		{1,1,1,1,2,2,2,2,0,0},
-		{1,1,1,1,2,2,2,2,0,0},
-		{1,1,1,1,0,0,0,1,1,1},
-		{1,1,1,1,0,0,0,0,1,1},
-		{0,0,0,0,0,0,0,0,1,1},
-		{0,0,0,0,0,0,2,2,2,2},
-		{0,1,1,1,1,1,2,2,2,2},
-		{0,1,1,1,1,1,2,1,2,2},
-		{0,1,9,1,0,0,2,2,2,2},
-		{0,1,1,1,0,0,0,0,0,0}
-	};
-	for(int i=0;i<dim;i++){
-		for(int j=0;j<dim;j++){
-			curr2.levelMatrix[i][j] = m3[i][j];
+int wallMain (int argc, char** argv)
+{
+	int count = argc > 0 ? atoi(argv[0]) : 0;
+	if(count < 1 || count > WALL_MAX_SESSIONS){
+		cerr << "--wall needs between 1 and " << WALL_MAX_SESSIONS << " sessions" << endl;
+		return EXIT_FAILURE;
+	}
+	int view = 0, width = 1280, height = 960, frames = 0;
+	vector< vector<int> > replays;
+	for(int i=1;i<argc;i++){
+		if(!strcmp(argv[i], "--view") && i+1<argc)
+			view = glm::clamp(atoi(argv[++i]), 0, 3);
+		else if(!strcmp(argv[i], "--size") && i+1<argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if(!strcmp(argv[i], "--frames") && i+1<argc)
+			frames = max(0, atoi(argv[++i]));
+		else{
+			vector<unsigned char> text;
+			if(!readFile(argv[i], text)){
+				cerr << "Could not read " << argv[i] << endl;
+				return EXIT_FAILURE;
+			}
+			replays.push_back(vector<int>());
+			parseMoves(string(text.begin(), text.end()), argv[i], replays.back());
 		}
 	}
+	width = max(1, width);
+	height = max(1, height);
 
-	switch_struct sw1;
-	sw1.used=false;
-	sw1.place = glm::vec3(2,7,0);
-	sw1.locations.push_back(glm::vec3(4,1,0));
-	sw1.locations.push_back(glm::vec3(5,1,0));
-	curr2.switches.push_back(sw1);
-	curr2.cube0_pos = glm::vec3(0,0,floor_grey.scale.z+ cube[0].scale.z);
-	curr2.cube1_pos = glm::vec3(0,1,floor_grey.scale.z+ cube[0].scale.z);
+	// Sixty-four sessions would each start aplay on every move
+	sound_enabled = false;
+	level_preloading = false;
+	startAssetLoading();
+	GLFWwindow* window = initGLFW(width, height);
+	initGLEW();
+	initGL(window, width, height);
+	if(!createWallRenderer(count)){
+		cerr << "Could not build the wall shaders" << endl;
+		releaseGpuResources();
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
 
-	levels.push_back(curr2);
-}
-void changeview(){
-	if(choice==0){
-		//Tower View
-		eye_vec.x=0;eye_vec.y=-2;eye_vec.z=10;
-		target_vec.x=0,target_vec.y=0,target_vec.z=0;
-		up_vec.x=0,up_vec.y=0,up_vec.z=1;
+	if(assets.levels.empty())
+		Level_creator();
+	for(vector<Level_struct>::iterator it=assets.levels.begin();it<assets.levels.end();it++){
+		placeLevel(*it);
+		levels.push_back(*it);
 	}
-	if(choice==1){
-		//Top View
-		eye_vec.x=0;eye_vec.y=0;eye_vec.z=10;
-		target_vec.x=0,target_vec.y=0,target_vec.z=0;
-		up_vec.x=0,up_vec.y=1,up_vec.z=0;
+	choice = view;
+	split_view = false;
+
+	// Every session starts from a copy of the globals as they are now
+	vector<WallSession> sessions(count);
+	vector<const GameSnapshot*> snaps(count);
+	for(int i=0;i<count;i++){
+		WallSession& s = sessions[i];
+		s.levels = levels;
+		for(int k=0;k<2;k++)
+			s.cube[k] = cube[k];
+		s.active_level = &s.prepared[0];
+		s.next_level = &s.prepared[1];
+		s.start_level = i % levels.size();
+		if(!replays.empty())
+			s.keys = replays[i % replays.size()];
+		s.wait = i*WALL_STAGGER_TICKS;
+		swapSession(s);
+		restartSession(s);
+		fillSnapshot(s.snapshots.writeBuffer());
+		s.snapshots.publish();
+		swapSession(s);
 	}
-	if(choice==2){
-		//Followcam view
-		float follow_cam_rotation=270.0f;
-		eye_vec.x=cube[1].pos.x+5.0*cos(follow_cam_rotation*M_PI/180.0f);eye_vec.y=cube[1].pos.y+5.0*sin(follow_cam_rotation*M_PI/180.0f);eye_vec.z=5.0;
-		target_vec.x=cube[1].pos.x+2.0*cos(follow_cam_rotation*M_PI/180.0f),target_vec.y=cube[1].pos.y+2.0*sin(follow_cam_rotation*M_PI/180.0f),target_vec.z=3.0;
-		up_vec.x=0,up_vec.y=0,up_vec.z=0.1;
+	sim_running = true;
+	sim_thread = std::thread(wallSimulation, &sessions);
+
+	double start = glfwGetTime();
+	int drawn = 0;
+	while(!glfwWindowShouldClose(window) && (frames == 0 || drawn < frames)){
+		for(int i=0;i<count;i++){
+			sessions[i].snapshots.update();
+			snaps[i] = &sessions[i].snapshots.readBuffer();
+		}
+		int fbwidth, fbheight;
+		glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+		drawWall(&snaps[0], count, fbwidth, fbheight);
+		glfwSwapBuffers(window);
+		drawn++;
+		glfwPollEvents();
 	}
-	if(choice==3){
-		//Helicopter View,
+	double elapsed = glfwGetTime() - start;
+	cout << drawn << " frames of " << count << " sessions, " << elapsed*1000/max(1, drawn) << " ms per frame, "
+		<< drawn/max(elapsed, 1e-6) << " FPS" << endl;
 
-		eye_vec.x=5*cos(camera_rotation_angle_x*M_PI/180.0f);
-		eye_vec.y=5*cos(camera_rotation_angle_y*M_PI/180.0f);
-		eye_vec.z=5*sin(camera_rotation_angle_y*M_PI/180.0f)+5*sin(camera_rotation_angle_x*M_PI/180.0f);
-		target_vec.x=a1;
-		target_vec.y=a2;
-		target_vec.z=0;
-		up_vec.x=0,up_vec.y=1,up_vec.z=0;
-	}
+	stopSimulation();
+	printGpuStats(cout);
+	releaseGpuResources();
+	glfwTerminate();
+	return EXIT_SUCCESS;
 }
+
 int main (int argc, char** argv)
 {		choice=0;
 
+	// Offline step, writes the mipmapped tile atlas and exits
+	if(argc > 1 && !strcmp(argv[1], "--bake-atlas")){
+		if(!saveAtlas(ATLAS_FILE, bakeAtlas(argv+2, argc-2))){
+			cerr << "Could not write " << ATLAS_FILE << endl;
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	if(argc > 1 && !strcmp(argv[1], "--soft-render"))
+		return softRenderMain(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--thumbnails"))
+		return thumbnailMain(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--export-replay"))
+		return exportReplayMain(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--regress"))
+		return regressMain(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--wall"))
+		return wallMain(argc-2, argv+2);
+
+	for(int i=1;i<argc;i++){
+		if(!strcmp(argv[i], "--topple-speedup") && i+1<argc)
+			topple_speedup = max(1, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--swap-interval") && i+1<argc)
+			frame.swap_interval = max(0, atoi(argv[++i]));
+		else if(!strcmp(argv[i], "--max-fps") && i+1<argc)
+			frame.max_fps = max(0.0, atof(argv[++i]));
+		else if(!strcmp(argv[i], "--gl-stats"))
+			gl_stats.enabled = true;
+		else if(!strcmp(argv[i], "--dynamic-res") && i+1<argc){
+			dynres.enabled = true;
+			dynres.budget = max(1.0, atof(argv[++i]));
+		}
+		else if(!strcmp(argv[i], "--cpu-board"))
+			cpu_board = true;
+		else if(!strcmp(argv[i], "--headless"))
+			headless = true;
+		else if(!strcmp(argv[i], "--vulkan")){
+#ifdef USE_VULKAN
+			use_vulkan = true;
+#else
+			cerr << "Built without Vulkan, rebuild with make VULKAN=1" << endl;
+#endif
+		}
+		else if(!strcmp(argv[i], "--frames") && i+1<argc)
+			bench_frames = max(0, atoi(argv[++i]));
+	}
+
 	game_over=false;
 	int width = 600;
 	int height = 600;
 
 	do_rot = 0;
 
-	GLFWwindow* window = initGLFW(width, height);
-	initGLEW();
-	initGL (window, width, height);
-
-
-	last_update_time = glfwGetTime();
+	// Files load on worker threads while the window and context are created
+	double startup_time = inputClock();
+	startAssetLoading();
 
+	GLFWwindow* window = NULL;
+	if(headless){
+		finishAssetLoading();
+		initShapes();
+		Matrices.projection = glm::perspective((float)(M_PI/2), (float)width/height, 0.1f, 500.0f);
+		renderer = &null_backend;
+	}
+	else{
+		window = initGLFW(width, height);
+#ifdef USE_VULKAN
+		if(use_vulkan){
+			finishAssetLoading();
+			int fbwidth, fbheight;
+			glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+			if(vulkanInit(window, fbwidth, fbheight)){
+				reshapeWindow(window, width, height);
+				cout << "First frame after " << (inputClock() - startup_time)*1000 << " ms" << endl;
+				renderer = &vulkan_backend;
+			}
+			else{
+				cerr << "Vulkan backend unavailable, using OpenGL" << endl;
+				vulkanShutdown();
+				glfwDestroyWindow(window);
+				use_vulkan = false;
+				window = initGLFW(width, height);
+			}
+		}
+#endif
+		if(!use_vulkan){
+			initGLEW();
+			drawFirstFrame(window);
+			cout << "First frame after " << (inputClock() - startup_time)*1000 << " ms" << endl;
+			initGL (window, width, height);
+			gl_backend.window = window;
+			renderer = &gl_backend;
+		}
+	}
 
-	Level_creator();
-	int current_level=0;
+	// Levels from the pack, the built-in ones if there is none
+	if(assets.levels.empty())
+		Level_creator();
+	for(vector<Level_struct>::iterator it=assets.levels.begin();it<assets.levels.end();it++){
+		placeLevel(*it);
+		levels.push_back(*it);
+	}
 	Initialize();
 	score=0;
-	int hol_time=0;
 	/* Draw in loop */
 		changeview();
 
-	while (!glfwWindowShouldClose(window)) {
-
-		// clear the color and depth in the frame buffer
-		if(!paused && !game_over){
-			gameEngine();
-		}
-
-		
-		
+	publishSnapshot();
+	startSimulation(window);
 
+	if(headless){
+		headlessLoop(bench_frames, width, height);
+		stopSimulation();
+		return EXIT_SUCCESS;
+	}
 
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// With --frames every frame is drawn, without waiting, to compare the backends
+	double bench_start = glfwGetTime(), bench_render = 0;
+	int drawn = 0;
+	while (!glfwWindowShouldClose(window) && (bench_frames == 0 || drawn < bench_frames)) {
 
-		// OpenGL Draw commands
-		current_time = glfwGetTime();
-		if ((current_time - last_update_time) >= 1) { // atleast 0.5s elapsed since last frame
-			if(!paused)
-				timer[current_level]+=1;
-			last_update_time = current_time;
-			if(game_over){
-				hol_time++;
-				cout << "Press r to restart or q to quit"<<endl;
-				if(hol_time>5)
-					break;
-			}
+		// Frame cap, wait out the rest of the frame while still handling events
+		double now = glfwGetTime();
+		if(bench_frames == 0 && frame.max_fps > 0 && now - frame.last_frame < 1.0/frame.max_fps){
+			glfwWaitEventsTimeout(frame.last_frame + 1.0/frame.max_fps - now);
+			continue;
 		}
-			// do something every 0.5 seconds ..
-			
-		
 
-		draw(window, 0, 0, 1, 1, 0, 1, 1);
-		// draw(window, 0.5, 0, 0.5, 0.5, 0, 1, 1);
-		// draw(window, 0, 0.5, 0.5, 0.5, 1, 0, 1);
-		// draw(window, 0.5, 0.5, 0.5, 0.5, 0, 0, 1);
+		// Pick up the newest state, drawing never waits for the simulation
+		// Nothing new and nothing damaged, block until the next event
+		if(!snapshots.update() && !frame.dirty && bench_frames == 0){
+			glfwWaitEvents();
+			continue;
+		}
+		frame.dirty = false;
+		frame.last_frame = now;
+		const GameSnapshot& snap = snapshots.readBuffer();
 
-		// Swap Frame Buffer in double buffering
-		glfwSwapBuffers(window);
+		int fbwidth, fbheight;
+		glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+		renderFrame(snap, fbwidth, fbheight);
+		bench_render += glfwGetTime() - now;
+		drawn++;
 
 		// Poll for Keyboard and mouse events
 		glfwPollEvents();
 	}
-
+	if(bench_frames)
+		cout << drawn << " frames with " << (use_vulkan ? "Vulkan" : "OpenGL") << ", " << bench_render*1000/max(1, drawn) << " ms per frame in renderFrame, "
+			<< (glfwGetTime() - bench_start)*1000/max(1, drawn) << " ms per frame in total" << endl;
+
+	stopSimulation();
+#ifdef USE_VULKAN
+	if(use_vulkan)
+		vulkanShutdown();
+#endif
+	if(!use_vulkan){
+		printGpuStats(cout);
+		releaseGpuResources();
+	}
 	glfwTerminate();
 	//    exit(EXIT_SUCCESS);
 }
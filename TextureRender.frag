@@ -1,17 +1,29 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
-in vec2 fragTexCoord;
+in TileData {
+    vec3 texCoord;
+} tile;
 
 // output data
 out vec3 color;
 
-// Texture sample for the whole mesh
-uniform sampler2D texSampler;
+// One layer per tile type, each with its own mip chain
+uniform sampler2DArray texSampler;
+
+// Tile edges are blended in here instead of a second GL_LINE pass
+uniform vec3 lineColor;
 
 void main()
 {
-    // Output color = color from texture sample specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
-    color = texture( texSampler, fragTexCoord ).rgb;
-}
\ No newline at end of file
+    // A merged face spans several tiles, the texture repeats once per tile
+    vec2 uv = tile.texCoord.xy;
+    vec2 width = fwidth(uv);
+    color = textureGrad( texSampler, vec3(fract(uv), tile.texCoord.z), dFdx(uv), dFdy(uv) ).rgb;
+
+    // Distance to the nearest tile border in pixels, faded out where tiles get too small for lines
+    vec2 d = min(fract(uv), 1.0 - fract(uv)) / max(width, vec2(1e-6));
+    float edge = 1.0 - clamp(min(d.x, d.y) - 0.5, 0.0, 1.0);
+    edge *= clamp(2.0 - 16.0 * max(width.x, width.y), 0.0, 1.0);
+    color = mix(color, lineColor, edge);
+}
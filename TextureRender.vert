@@ -1,22 +1,23 @@
 #version 330 core
 
-// input data : sent from main program
+// input data : the greedy board mesh in world space, texture coordinates in tile units
 layout (location = 0) in vec3 vertexPosition;
-layout (location = 2) in vec2 vertexTexCoord;
+layout (location = 2) in vec3 vertexTexCoord;
 
-uniform mat4 MVP;
+uniform mat4 VP[4];
+// Leave the position in world space when a geometry shader projects it per viewport
+uniform bool worldSpace;
 
-// output data : used by fragment shader
-out vec2 fragTexCoord;
+// output data : used by fragment shader, the atlas layer rides along as the third coord
+out TileData {
+    vec3 texCoord;
+} tile;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec4 v = vec4(vertexPosition, 1);
 
-    // The texture coord of each vertex will be interpolated
-    // to produce the color of each fragment
-    fragTexCoord = vertexTexCoord;
+    tile.texCoord = vertexTexCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
-}
\ No newline at end of file
+    gl_Position = worldSpace ? v : VP[0] * v;
+}
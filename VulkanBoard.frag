@@ -0,0 +1,28 @@
+#version 450
+
+// Interpolated values from the vertex shaders
+layout (location = 0) in vec3 texCoord;
+
+// output data
+layout (location = 0) out vec4 color;
+
+layout (set = 0, binding = 0) uniform Frame {
+    mat4 VP[4];
+    vec4 lineColor;
+} frame;
+
+// One layer per tile type, each with its own mip chain
+layout (set = 0, binding = 1) uniform sampler2DArray texSampler;
+
+void main()
+{
+    // Same shading as TextureRender.frag : the texture repeats once per tile, borders fade with distance
+    vec2 uv = texCoord.xy;
+    vec2 width = fwidth(uv);
+    vec3 c = textureGrad( texSampler, vec3(fract(uv), texCoord.z), dFdx(uv), dFdy(uv) ).rgb;
+
+    vec2 d = min(fract(uv), 1.0 - fract(uv)) / max(width, vec2(1e-6));
+    float edge = 1.0 - clamp(min(d.x, d.y) - 0.5, 0.0, 1.0);
+    edge *= clamp(2.0 - 16.0 * max(width.x, width.y), 0.0, 1.0);
+    color = vec4(mix(c, frame.lineColor.rgb, edge), 1);
+}
@@ -0,0 +1,25 @@
+#version 450
+
+// input data : the greedy board mesh in world space, texture coordinates in tile units
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexTexCoord;
+
+// Written once per frame, the board commands only pick their view
+layout (set = 0, binding = 0) uniform Frame {
+    mat4 VP[4];
+    vec4 lineColor;
+} frame;
+
+layout (push_constant) uniform Draw {
+    int view;
+} draw;
+
+// output data : used by fragment shader, the atlas layer rides along as the third coord
+layout (location = 0) out vec3 texCoord;
+
+void main ()
+{
+    texCoord = vertexTexCoord;
+
+    gl_Position = frame.VP[draw.view] * vec4(vertexPosition, 1);
+}
@@ -0,0 +1,25 @@
+#version 450
+
+// Interpolated values from the vertex shaders
+layout (location = 0) in vec3 fragBary;
+
+layout (push_constant) uniform Draw {
+    mat4 MVP;
+    vec4 color;
+    vec4 edge;
+} draw;
+
+// output data
+layout (location = 0) out vec4 color;
+
+void main()
+{
+    // Same edges as Sample_GL.frag, from the barycentric coordinates
+    vec3 d = fragBary / fwidth(fragBary);
+    float edge = 1.0 - clamp(min(min(d.x, d.y), d.z) - 0.5, 0.0, 1.0);
+
+    // Alpha 0 draws the edges only, like GL_LINE polygon mode
+    if (draw.edge.a < 0.5 && edge < 0.5)
+        discard;
+    color = vec4(mix(draw.color.rgb, draw.edge.rgb, draw.edge.a < 0.5 ? 1.0 : edge), 1);
+}
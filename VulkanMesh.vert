@@ -0,0 +1,22 @@
+#version 450
+
+// input data : an arena mesh or a text quad
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexBary;
+
+// per draw : pushed before every block, marker or line of text
+layout (push_constant) uniform Draw {
+    mat4 MVP;
+    vec4 color;
+    vec4 edge;
+} draw;
+
+// output data : used by fragment shader
+layout (location = 0) out vec3 fragBary;
+
+void main ()
+{
+    fragBary = vertexBary;
+
+    gl_Position = draw.MVP * vec4(vertexPosition, 1);
+}
@@ -0,0 +1,40 @@
+#version 330 core
+
+// input data : the cube mesh of the arena
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 3) in vec3 vertexBary;
+// per instance : one tile or block half of one session of the wall
+layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec4 edgeColor;
+layout (location = 4) in float session;
+layout (location = 5) in mat4 model;
+
+// Camera of every session and its cell of the window, scale in xy and centre in zw
+layout (std140) uniform Sessions {
+    mat4 VP[64];
+    vec4 cell[64];
+};
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec3 fragBary;
+flat out vec4 fragEdge;
+
+void main ()
+{
+    int s = int(session + 0.5);
+    vec4 clip = VP[s] * model * vec4(vertexPosition, 1);
+
+    // The side planes of the session's own frustum keep it inside its cell
+    gl_ClipDistance[0] = clip.w + clip.x;
+    gl_ClipDistance[1] = clip.w - clip.x;
+    gl_ClipDistance[2] = clip.w + clip.y;
+    gl_ClipDistance[3] = clip.w - clip.y;
+
+    fragColor = vertexColor;
+    fragBary = vertexBary;
+    fragEdge = edgeColor;
+
+    // Scaled and moved in clip space, so the divide by w lands it in the cell
+    gl_Position = vec4(clip.xy * cell[s].xy + cell[s].zw * clip.w, clip.zw);
+}
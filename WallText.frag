@@ -0,0 +1,22 @@
+#version 330 core
+
+// 5x7 bitmap font, 5 bits a row from the top, rows 0-3 in x and rows 4-6 in y
+uniform ivec2 font[40];
+uniform vec3 textColor;
+
+in vec2 fragCell;
+flat in int fragGlyph;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    int column = min(int(fragCell.x), 4);
+    int row = 6 - min(int(fragCell.y), 6);
+    int bits = row < 4 ? font[fragGlyph].x >> (5 * row) : font[fragGlyph].y >> (5 * (row - 4));
+
+    if (((bits >> (4 - column)) & 1) == 0)
+        discard;
+    color = textColor;
+}
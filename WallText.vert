@@ -0,0 +1,20 @@
+#version 330 core
+
+// per instance : one character, the four corners of its quad come from gl_VertexID
+layout (location = 0) in vec4 rect;	// x, y, width, height in normalized device coordinates
+layout (location = 1) in float glyph;	// index in the font
+
+// output data : used by fragment shader
+out vec2 fragCell;
+flat out int fragGlyph;
+
+void main ()
+{
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
+    // Font pixels across and up the glyph
+    fragCell = corner * vec2(5, 7);
+    fragGlyph = int(glyph + 0.5);
+
+    gl_Position = vec4(rect.xy + corner * rect.zw, 0, 1);
+}